@@ -52,6 +52,78 @@ extern "C" {
 JNIEXPORT jbyteArray JNICALL Java_net_i2p_util_NativeBigInteger_nativeModPow
   (JNIEnv *, jclass, jbyteArray, jbyteArray, jbyteArray);
 
+/*
+ * Class:     net_i2p_util_NativeBigInteger
+ * Method:    nativeModPowInto
+ * Signature: ([B[B[B[B)V
+ */
+JNIEXPORT void JNICALL Java_net_i2p_util_NativeBigInteger_nativeModPowInto
+  (JNIEnv *, jclass, jbyteArray, jbyteArray, jbyteArray, jbyteArray);
+
+/*
+ * Class:     net_i2p_util_NativeBigInteger
+ * Method:    nativeModPowBatch
+ * Signature: ([[B[[B[B)[[B
+ */
+JNIEXPORT jobjectArray JNICALL Java_net_i2p_util_NativeBigInteger_nativeModPowBatch
+  (JNIEnv *, jclass, jobjectArray, jobjectArray, jbyteArray);
+
+/*
+ * Class:     net_i2p_util_NativeBigInteger
+ * Method:    nativeNewModulus
+ * Signature: ([B)J
+ */
+JNIEXPORT jlong JNICALL Java_net_i2p_util_NativeBigInteger_nativeNewModulus
+  (JNIEnv *, jclass, jbyteArray);
+
+/*
+ * Class:     net_i2p_util_NativeBigInteger
+ * Method:    nativeModPowModulus
+ * Signature: (J[B[B)[B
+ */
+JNIEXPORT jbyteArray JNICALL Java_net_i2p_util_NativeBigInteger_nativeModPowModulus
+  (JNIEnv *, jclass, jlong, jbyteArray, jbyteArray);
+
+/*
+ * Class:     net_i2p_util_NativeBigInteger
+ * Method:    nativeFreeModulus
+ * Signature: (J)V
+ */
+JNIEXPORT void JNICALL Java_net_i2p_util_NativeBigInteger_nativeFreeModulus
+  (JNIEnv *, jclass, jlong);
+
+/*
+ * Class:     net_i2p_util_NativeBigInteger
+ * Method:    nativeNewFixedBase
+ * Signature: ([B[BI)J
+ */
+JNIEXPORT jlong JNICALL Java_net_i2p_util_NativeBigInteger_nativeNewFixedBase
+  (JNIEnv *, jclass, jbyteArray, jbyteArray, jint);
+
+/*
+ * Class:     net_i2p_util_NativeBigInteger
+ * Method:    nativeModPowFixedBase
+ * Signature: (J[B)[B
+ */
+JNIEXPORT jbyteArray JNICALL Java_net_i2p_util_NativeBigInteger_nativeModPowFixedBase
+  (JNIEnv *, jclass, jlong, jbyteArray);
+
+/*
+ * Class:     net_i2p_util_NativeBigInteger
+ * Method:    nativeFreeFixedBase
+ * Signature: (J)V
+ */
+JNIEXPORT void JNICALL Java_net_i2p_util_NativeBigInteger_nativeFreeFixedBase
+  (JNIEnv *, jclass, jlong);
+
+/*
+ * Class:     net_i2p_util_NativeBigInteger
+ * Method:    nativeMultiModPow
+ * Signature: ([B[B[B[B[B)[B
+ */
+JNIEXPORT jbyteArray JNICALL Java_net_i2p_util_NativeBigInteger_nativeMultiModPow
+  (JNIEnv *, jclass, jbyteArray, jbyteArray, jbyteArray, jbyteArray, jbyteArray);
+
 /*
  * Class:     net_i2p_util_NativeBigInteger
  * Method:    nativeDoubleValue
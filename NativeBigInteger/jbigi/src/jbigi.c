@@ -1,11 +1,83 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <gmp.h>
 #include "jbigi.h"
 
 /******** prototypes */
 
 void convert_j2mp(JNIEnv* env, jbyteArray jvalue, mpz_t* mvalue);
+void import_j2mp(JNIEnv* env, jbyteArray jvalue, mpz_t mvalue);
 void convert_mp2j(JNIEnv* env, mpz_t mvalue, jbyteArray* jvalue);
+int convert_mp2j_into(JNIEnv* env, mpz_t mvalue, jbyteArray jvalue);
+mpz_ptr get_scratch(int i);
+
+struct jbigi_modulus* new_modulus(mpz_t mod);
+void free_modulus(struct jbigi_modulus* m);
+void mont_mul(struct jbigi_modulus* m, mp_limb_t* rp, const mp_limb_t* ap, const mp_limb_t* bp, mp_limb_t* tp);
+void mont_import(struct jbigi_modulus* m, mp_limb_t* rp, mpz_t a, mp_limb_t* tp);
+void mont_export(struct jbigi_modulus* m, mpz_t r, const mp_limb_t* ap, mp_limb_t* tp);
+struct jbigi_fixedbase* new_fixedbase(mpz_t base, mpz_t mod, long bits);
+void free_fixedbase(struct jbigi_fixedbase* fb);
+int fixedbase_powm(struct jbigi_fixedbase* fb, mpz_t r, mpz_t exp);
+int multi_powm(struct jbigi_modulus* m, mpz_t r, mpz_t base1, mpz_t exp1, mpz_t base2, mpz_t exp2);
+
+/******** scratch values */
+/*
+ * GMP values kept by each thread from one call to the next, so that the
+ * native methods neither allocate nor free their operands: the values only
+ * grow to the largest operands seen on the thread, and are not freed when
+ * it exits. The calls of a thread do not overlap, and the functions below
+ * the native methods do not use them.
+ */
+#if defined(_MSC_VER)
+#define JBIGI_TLS __declspec(thread)
+#else
+#define JBIGI_TLS __thread
+#endif
+#define JBIGI_SCRATCH 6         /* nativeMultiModPow() needs the most */
+
+static JBIGI_TLS mpz_t scratch_values[JBIGI_SCRATCH];
+static JBIGI_TLS int scratch_ready;
+
+/******** modulus contexts */
+/*
+ * A modulus converted once, along with the constants of Montgomery
+ * multiplication, so that it can be reused for many operations. Java
+ * threads share the handles, so nothing is written to a context after
+ * new_modulus(); scratch space is allocated by each call.
+ */
+struct jbigi_modulus {
+        mpz_t mod;              /* the modulus */
+        int odd;                /* Montgomery multiplication needs an odd modulus */
+        mp_size_t size;         /* size of the modulus in limbs */
+        mp_limb_t minv;         /* -1/mod mod 2^GMP_NUMB_BITS */
+        mp_limb_t* limbs;       /* the modulus, least significant limb first */
+        mp_limb_t* r2;          /* R^2 mod mod, where R = 2^(GMP_NUMB_BITS*size) */
+};
+
+/******** fixed base contexts */
+/*
+ * The precomputed tables of a Lim-Lee comb for base ^ x mod m, for any x
+ * below 2^bits. x is cut in rows of cols bits; bit j of every row makes
+ * the index of an entry of the first table, a product of
+ * base ^ (2^(row*cols)), and bit j+half the index of an entry of the
+ * second table, the same products raised to 2^half. Exponentiation then
+ * takes half squarings and cols multiplications, against about bits
+ * squarings for mpz_powm(). Shared like the modulus contexts.
+ */
+#define JBIGI_COMB_ROWS 8       /* 2 * 2^8 entries, 128KB for 2048 bits */
+
+struct jbigi_fixedbase {
+        struct jbigi_modulus* m;
+        mpz_t base;             /* for the exponents the tables do not cover */
+        long bits;              /* the tables cover the exponents below 2^bits */
+        int rows;
+        long cols;              /* ceil(bits / rows) */
+        long half;              /* ceil(cols / 2) */
+        mp_limb_t* table;       /* 2 * 2^rows entries of size limbs, NULL for an even modulus */
+};
 
 
 /*****************************************
@@ -34,14 +106,14 @@ JNIEXPORT jbyteArray JNICALL Java_net_i2p_util_NativeBigInteger_nativeModPow
          * 3) Convert libgmp's result into a big endian twos complement number.
          */
 
-        mpz_t mbase;
-        mpz_t mexp;
-        mpz_t mmod;
+        mpz_ptr mbase = get_scratch(0);
+        mpz_ptr mexp = get_scratch(1);
+        mpz_ptr mmod = get_scratch(2);
         jbyteArray jresult;
 
-        convert_j2mp(env, jbase, &mbase);
-        convert_j2mp(env, jexp,  &mexp);
-        convert_j2mp(env, jmod,  &mmod);
+        import_j2mp(env, jbase, mbase);
+        import_j2mp(env, jexp,  mexp);
+        import_j2mp(env, jmod,  mmod);
  
 		/* Perform the actual powmod. We use mmod for the result because it is
          * always at least as big as the result.
@@ -50,10 +122,340 @@ JNIEXPORT jbyteArray JNICALL Java_net_i2p_util_NativeBigInteger_nativeModPow
 
 		convert_mp2j(env, mmod, &jresult);
 
+        return jresult;
+}
+
+/******** nativeModPowInto() */
+/*
+ * Class:     net_i2p_util_NativeBigInteger
+ * Method:    nativeModPowInto
+ * Signature: ([B[B[B[B)V
+ *
+ * From the javadoc:
+ *
+ * calculate (base ^ exponent) % modulus into a buffer of the caller, which
+ * can be reused from call to call.
+ * @param base big endian twos complement representation of the base (but it must be positive)
+ * @param exponent big endian twos complement representation of the exponent
+ * @param modulus big endian twos complement representation of the modulus
+ * @param result filled with the big endian twos complement representation of
+ *        (base ^ exponent) % modulus, zero padded on the left; one byte longer
+ *        than the magnitude of the modulus is always enough
+ */
+
+JNIEXPORT void JNICALL Java_net_i2p_util_NativeBigInteger_nativeModPowInto
+        (JNIEnv* env, jclass cls, jbyteArray jbase, jbyteArray jexp, jbyteArray jmod, jbyteArray jresult) {
+        mpz_ptr mbase = get_scratch(0);
+        mpz_ptr mexp = get_scratch(1);
+        mpz_ptr mmod = get_scratch(2);
+
+        import_j2mp(env, jbase, mbase);
+        import_j2mp(env, jexp,  mexp);
+        import_j2mp(env, jmod,  mmod);
+
+        mpz_powm(mmod, mbase, mexp, mmod);
+
+        if (convert_mp2j_into(env, mmod, jresult) != 0)
+                (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"),
+                        "result buffer too small");
+}
+
+/******** nativeModPowBatch() */
+/*
+ * Class:     net_i2p_util_NativeBigInteger
+ * Method:    nativeModPowBatch
+ * Signature: ([[B[[B[B)[[B
+ *
+ * From the javadoc:
+ *
+ * calculate (bases[i] ^ exponents[i]) % modulus for every i, in one call.
+ * @param bases big endian twos complement representations of the bases (but they must be positive)
+ * @param exponents big endian twos complement representations of the exponents, as many as bases
+ * @param modulus big endian twos complement representation of the modulus shared by all the bases
+ * @return big endian twos complement representations of the results, in the order of bases
+ */
+
+JNIEXPORT jobjectArray JNICALL Java_net_i2p_util_NativeBigInteger_nativeModPowBatch
+        (JNIEnv* env, jclass cls, jobjectArray jbases, jobjectArray jexps, jbyteArray jmod) {
+        /* Same steps as nativeModPow(), but the modulus is converted only once
+         * for all the operations.
+         */
+
+        mpz_ptr mbase = get_scratch(0);
+        mpz_ptr mexp = get_scratch(1);
+        mpz_ptr mmod = get_scratch(2);
+        mpz_ptr mresult = get_scratch(3);
+        jobjectArray jresults;
+        jbyteArray jbase;
+        jbyteArray jexp;
+        jbyteArray jresult;
+        jsize count;
+        jsize i;
+
+        count = (*env)->GetArrayLength(env, jbases);
+        if ((*env)->GetArrayLength(env, jexps) != count) {
+                (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"),
+                        "as many exponents as bases are needed");
+                return NULL;
+        }
+        jresults = (*env)->NewObjectArray(env, count, (*env)->FindClass(env, "[B"), NULL);
+        if (jresults == NULL)
+                return NULL; /* OutOfMemoryError is pending */
+
+        import_j2mp(env, jmod, mmod);
+        if ((*env)->ExceptionCheck(env))
+                return NULL;
+
+        for (i = 0; i < count; i++) {
+                /* There is no Java wrapper to check the elements */
+                jbase = (jbyteArray)(*env)->GetObjectArrayElement(env, jbases, i);
+                jexp = (jbyteArray)(*env)->GetObjectArrayElement(env, jexps, i);
+                if (jbase == NULL || jexp == NULL) {
+                        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/NullPointerException"),
+                                "null base or exponent");
+                        return NULL;
+                }
+                import_j2mp(env, jbase, mbase);
+                if ((*env)->ExceptionCheck(env))
+                        return NULL;
+                import_j2mp(env, jexp, mexp);
+                if ((*env)->ExceptionCheck(env))
+                        return NULL;
+
+                mpz_powm(mresult, mbase, mexp, mmod);
+
+                convert_mp2j(env, mresult, &jresult);
+                if ((*env)->ExceptionCheck(env))
+                        return NULL;
+                (*env)->SetObjectArrayElement(env, jresults, i, jresult);
+
+                /* Hundreds of operations would overflow the local reference table */
+                (*env)->DeleteLocalRef(env, jresult);
+                (*env)->DeleteLocalRef(env, jexp);
+                (*env)->DeleteLocalRef(env, jbase);
+        }
+
+        return jresults;
+}
+
+/******** nativeNewModulus() */
+/*
+ * Class:     net_i2p_util_NativeBigInteger
+ * Method:    nativeNewModulus
+ * Signature: ([B)J
+ *
+ * From the javadoc:
+ *
+ * Prepare a modulus for repeated use by nativeModPowModulus().
+ * @param modulus big endian twos complement representation of the modulus (must be positive)
+ * @return a handle to the native modulus, to be freed with nativeFreeModulus()
+ */
+
+JNIEXPORT jlong JNICALL Java_net_i2p_util_NativeBigInteger_nativeNewModulus
+        (JNIEnv* env, jclass cls, jbyteArray jmod) {
+        mpz_t mmod;
+        struct jbigi_modulus* m;
+
+        convert_j2mp(env, jmod, &mmod);
+        if (mpz_sgn(mmod) == 0) {
+                mpz_clear(mmod);
+                (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/ArithmeticException"),
+                        "BigInteger: modulus not positive");
+                return 0;
+        }
+        m = new_modulus(mmod);
+        mpz_clear(mmod);
+        if (m == NULL)
+                (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/OutOfMemoryError"), "jbigi");
+        return (jlong)(intptr_t)m;
+}
+
+/******** nativeModPowModulus() */
+/*
+ * Class:     net_i2p_util_NativeBigInteger
+ * Method:    nativeModPowModulus
+ * Signature: (J[B[B)[B
+ *
+ * From the javadoc:
+ *
+ * calculate (base ^ exponent) % modulus, for a modulus from nativeNewModulus().
+ * @param modulus the handle returned by nativeNewModulus()
+ * @param base big endian twos complement representation of the base (but it must be positive)
+ * @param exponent big endian twos complement representation of the exponent
+ * @return big endian twos complement representation of (base ^ exponent) % modulus
+ */
+
+JNIEXPORT jbyteArray JNICALL Java_net_i2p_util_NativeBigInteger_nativeModPowModulus
+        (JNIEnv* env, jclass cls, jlong jm, jbyteArray jbase, jbyteArray jexp) {
+        /* Same as nativeModPow(), but the modulus is not converted again.
+         */
+
+        struct jbigi_modulus* m = (struct jbigi_modulus*)(intptr_t)jm;
+        mpz_ptr mbase = get_scratch(0);
+        mpz_ptr mexp = get_scratch(1);
+        mpz_ptr mresult = get_scratch(2);
+        jbyteArray jresult;
+
+        import_j2mp(env, jbase, mbase);
+        import_j2mp(env, jexp,  mexp);
+
+        mpz_powm(mresult, mbase, mexp, m->mod);
+
+        convert_mp2j(env, mresult, &jresult);
+
+        return jresult;
+}
+
+/******** nativeFreeModulus() */
+/*
+ * Class:     net_i2p_util_NativeBigInteger
+ * Method:    nativeFreeModulus
+ * Signature: (J)V
+ *
+ * From the javadoc:
+ *
+ * Free a modulus from nativeNewModulus(). The handle must not be used afterwards.
+ * @param modulus the handle returned by nativeNewModulus(), or 0
+ */
+
+JNIEXPORT void JNICALL Java_net_i2p_util_NativeBigInteger_nativeFreeModulus
+        (JNIEnv* env, jclass cls, jlong jm) {
+        free_modulus((struct jbigi_modulus*)(intptr_t)jm);
+}
+
+/******** nativeNewFixedBase() */
+/*
+ * Class:     net_i2p_util_NativeBigInteger
+ * Method:    nativeNewFixedBase
+ * Signature: ([B[BI)J
+ *
+ * From the javadoc:
+ *
+ * Precompute the tables to raise a fixed base to many exponents, such as a
+ * DH or ElGamal generator.
+ * @param base big endian twos complement representation of the base (but it must be positive)
+ * @param modulus big endian twos complement representation of the modulus (must be positive)
+ * @param exponentBits size in bits of the largest exponent; larger ones are still right, but slow
+ * @return a handle to the native tables, to be freed with nativeFreeFixedBase()
+ */
+
+JNIEXPORT jlong JNICALL Java_net_i2p_util_NativeBigInteger_nativeNewFixedBase
+        (JNIEnv* env, jclass cls, jbyteArray jbase, jbyteArray jmod, jint jbits) {
+        mpz_t mbase;
+        mpz_t mmod;
+        struct jbigi_fixedbase* fb = NULL;
+
+        convert_j2mp(env, jbase, &mbase);
+        convert_j2mp(env, jmod,  &mmod);
+        if (mpz_sgn(mmod) == 0)
+                (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/ArithmeticException"),
+                        "BigInteger: modulus not positive");
+        else if (jbits <= 0)
+                (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"),
+                        "exponentBits must be positive");
+        else if ((fb = new_fixedbase(mbase, mmod, jbits)) == NULL)
+                (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/OutOfMemoryError"), "jbigi");
+
         mpz_clear(mbase);
-        mpz_clear(mexp);
         mpz_clear(mmod);
 
+        return (jlong)(intptr_t)fb;
+}
+
+/******** nativeModPowFixedBase() */
+/*
+ * Class:     net_i2p_util_NativeBigInteger
+ * Method:    nativeModPowFixedBase
+ * Signature: (J[B)[B
+ *
+ * From the javadoc:
+ *
+ * calculate (base ^ exponent) % modulus, for a base and modulus from nativeNewFixedBase().
+ * @param fixedBase the handle returned by nativeNewFixedBase()
+ * @param exponent big endian twos complement representation of the exponent
+ * @return big endian twos complement representation of (base ^ exponent) % modulus
+ */
+
+JNIEXPORT jbyteArray JNICALL Java_net_i2p_util_NativeBigInteger_nativeModPowFixedBase
+        (JNIEnv* env, jclass cls, jlong jfb, jbyteArray jexp) {
+        struct jbigi_fixedbase* fb = (struct jbigi_fixedbase*)(intptr_t)jfb;
+        mpz_ptr mexp = get_scratch(0);
+        mpz_ptr mresult = get_scratch(1);
+        jbyteArray jresult = NULL;
+
+        import_j2mp(env, jexp, mexp);
+
+        if (fixedbase_powm(fb, mresult, mexp) == 0)
+                convert_mp2j(env, mresult, &jresult);
+        else
+                (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/OutOfMemoryError"), "jbigi");
+
+        return jresult;
+}
+
+/******** nativeFreeFixedBase() */
+/*
+ * Class:     net_i2p_util_NativeBigInteger
+ * Method:    nativeFreeFixedBase
+ * Signature: (J)V
+ *
+ * From the javadoc:
+ *
+ * Free the tables from nativeNewFixedBase(). The handle must not be used afterwards.
+ * @param fixedBase the handle returned by nativeNewFixedBase(), or 0
+ */
+
+JNIEXPORT void JNICALL Java_net_i2p_util_NativeBigInteger_nativeFreeFixedBase
+        (JNIEnv* env, jclass cls, jlong jfb) {
+        free_fixedbase((struct jbigi_fixedbase*)(intptr_t)jfb);
+}
+
+/******** nativeMultiModPow() */
+/*
+ * Class:     net_i2p_util_NativeBigInteger
+ * Method:    nativeMultiModPow
+ * Signature: ([B[B[B[B[B)[B
+ *
+ * From the javadoc:
+ *
+ * calculate (base1 ^ exponent1 * base2 ^ exponent2) % modulus, as DSA and
+ * ElGamal signature verification do, in a single pass.
+ * @param base1 big endian twos complement representation of the first base (but it must be positive)
+ * @param exponent1 big endian twos complement representation of the first exponent
+ * @param base2 big endian twos complement representation of the second base (but it must be positive)
+ * @param exponent2 big endian twos complement representation of the second exponent
+ * @param modulus big endian twos complement representation of the modulus (must be positive)
+ * @return big endian twos complement representation of (base1 ^ exponent1 * base2 ^ exponent2) % modulus
+ */
+
+JNIEXPORT jbyteArray JNICALL Java_net_i2p_util_NativeBigInteger_nativeMultiModPow
+        (JNIEnv* env, jclass cls, jbyteArray jbase1, jbyteArray jexp1, jbyteArray jbase2, jbyteArray jexp2, jbyteArray jmod) {
+        mpz_ptr mbase1 = get_scratch(0);
+        mpz_ptr mexp1 = get_scratch(1);
+        mpz_ptr mbase2 = get_scratch(2);
+        mpz_ptr mexp2 = get_scratch(3);
+        mpz_ptr mmod = get_scratch(4);
+        mpz_ptr mresult = get_scratch(5);
+        struct jbigi_modulus* m = NULL;
+        jbyteArray jresult = NULL;
+
+        import_j2mp(env, jbase1, mbase1);
+        import_j2mp(env, jexp1,  mexp1);
+        import_j2mp(env, jbase2, mbase2);
+        import_j2mp(env, jexp2,  mexp2);
+        import_j2mp(env, jmod,   mmod);
+
+        if (mpz_sgn(mmod) == 0)
+                (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/ArithmeticException"),
+                        "BigInteger: modulus not positive");
+        else if ((m = new_modulus(mmod)) == NULL ||
+            multi_powm(m, mresult, mbase1, mexp1, mbase2, mexp2) != 0)
+                (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/OutOfMemoryError"), "jbigi");
+        else
+                convert_mp2j(env, mresult, &jresult);
+
+        free_modulus(m);
+
         return jresult;
 }
 
@@ -75,13 +477,10 @@ JNIEXPORT jdouble JNICALL Java_net_i2p_util_NativeBigInteger_nativeDoubleValue
          * 2) Call libgmp's mpz_get_d.
          * 3) Convert libgmp's result into a big endian twos complement number.
          */
-        mpz_t mval;
-		jdouble retval;
-        convert_j2mp(env, jba, &mval);
+        mpz_ptr mval = get_scratch(0);
+        import_j2mp(env, jba, mval);
 
-		retval = mpz_get_d(mval);
-		mpz_clear(mval);
-		return retval;
+		return mpz_get_d(mval);
 }
 
 /******************************
@@ -102,14 +501,35 @@ JNIEXPORT jdouble JNICALL Java_net_i2p_util_NativeBigInteger_nativeDoubleValue
 void convert_j2mp(JNIEnv* env, jbyteArray jvalue, mpz_t* mvalue)
 {
         jsize size;
-        jbyte* jbuffer;
-		//int sign;
 
         size = (*env)->GetArrayLength(env, jvalue);
-        jbuffer = (*env)->GetByteArrayElements(env, jvalue, NULL);
 
         mpz_init2(*mvalue, sizeof(jbyte) * 8 * size); //preallocate the size
 
+        import_j2mp(env, jvalue, *mvalue);
+}
+
+/******** import_j2mp() */
+/*
+ * Converts the Java value into an already initialized GMP value, which
+ * GMP grows if it is too small. Lets a caller reuse the same GMP value
+ * for many conversions. The Java array is read in place when the VM allows
+ * it, rather than copied.
+ */
+
+void import_j2mp(JNIEnv* env, jbyteArray jvalue, mpz_t mvalue)
+{
+        jsize size;
+        jbyte* jbuffer;
+		//int sign;
+
+        size = (*env)->GetArrayLength(env, jvalue);
+        jbuffer = (*env)->GetPrimitiveArrayCritical(env, jvalue, NULL);
+        if (jbuffer == NULL) {
+                mpz_set_ui(mvalue, 0); /* OutOfMemoryError is pending */
+                return;
+        }
+
         /* void mpz_import(
          *   mpz_t rop, size_t count, int order, int size, int endian,
          *   size_t nails, const void *op);
@@ -124,14 +544,14 @@ void convert_j2mp(JNIEnv* env, jbyteArray jvalue, mpz_t* mvalue)
          *   The most significant nails bits of each word are skipped, this can
          *   be 0 to use the full words.
          */
-        mpz_import(*mvalue, size, 1, sizeof(jbyte), 1, 0, (void*)jbuffer);
+        mpz_import(mvalue, size, 1, sizeof(jbyte), 1, 0, (void*)jbuffer);
 		/*Uncomment this to support negative integer values,
 		not tested though..
 		sign = jbuffer[0] < 0?-1:1;
 		if(sign == -1)
-			mpz_neg(*mvalue,*mvalue);
+			mpz_neg(mvalue,mvalue);
 		*/
-        (*env)->ReleaseByteArrayElements(env, jvalue, jbuffer, JNI_ABORT);
+        (*env)->ReleasePrimitiveArrayCritical(env, jvalue, jbuffer, JNI_ABORT);
 }
 
 /******** convert_mp2j() */
@@ -147,16 +567,18 @@ void convert_mp2j(JNIEnv* env, mpz_t mvalue, jbyteArray* jvalue)
         // elsewhere, and/or adjust memory alloc sizes?)
         size_t size; 
         jbyte* buffer;
-        jboolean copy;
 		//int i;
 
-        copy = JNI_FALSE;
-
         /* sizeinbase() + 7 => Ceil division */
         size = (mpz_sizeinbase(mvalue, 2) + 7) / 8 + sizeof(jbyte);
         *jvalue = (*env)->NewByteArray(env, size);
+        if (*jvalue == NULL)
+                return; /* OutOfMemoryError is pending */
 
-        buffer = (*env)->GetByteArrayElements(env, *jvalue, &copy);
+        /* Written in place when the VM allows it, rather than through a copy */
+        buffer = (*env)->GetPrimitiveArrayCritical(env, *jvalue, NULL);
+        if (buffer == NULL)
+                return;
         buffer[0] = 0x00;
 		//Uncomment the comments below to support negative integer values,
 		//not very well-tested though..
@@ -170,11 +592,443 @@ void convert_mp2j(JNIEnv* env, mpz_t mvalue, jbyteArray* jvalue)
 		//	}
 		//}
 
-		/* mode has (supposedly) no effect if elems is not a copy of the
-         * elements in array
+        (*env)->ReleasePrimitiveArrayCritical(env, *jvalue, buffer, 0);
+}
+
+/******** convert_mp2j_into() */
+/*
+ * Converts the (positive) GMP value into an existing Java array, right
+ * aligned and padded with 0 on the left so the twos complement value is
+ * positive. Returns 0, or -1 if the array does not have room for the
+ * value and a 0 byte.
+ */
+
+int convert_mp2j_into(JNIEnv* env, mpz_t mvalue, jbyteArray jvalue)
+{
+        size_t size;
+        jsize length;
+        jbyte* buffer;
+
+        /* mpz_export() writes nothing for 0 */
+        size = mpz_sgn(mvalue) == 0 ? 0 : (mpz_sizeinbase(mvalue, 2) + 7) / 8;
+        length = (*env)->GetArrayLength(env, jvalue);
+        if ((size_t)length < size + sizeof(jbyte))
+                return -1;
+
+        buffer = (*env)->GetPrimitiveArrayCritical(env, jvalue, NULL);
+        if (buffer == NULL)
+                return 0; /* OutOfMemoryError is pending */
+        memset(buffer, 0, length - size);
+        mpz_export((void*)&buffer[length - size], NULL, 1, sizeof(jbyte), 1, 0, mvalue);
+        (*env)->ReleasePrimitiveArrayCritical(env, jvalue, buffer, 0);
+        return 0;
+}
+
+/******** get_scratch() */
+/*
+ * Returns scratch value i of the calling thread, initializing them all on
+ * its first call.
+ */
+
+mpz_ptr get_scratch(int i)
+{
+        int j;
+
+        if (!scratch_ready) {
+                for (j = 0; j < JBIGI_SCRATCH; j++)
+                        mpz_init(scratch_values[j]);
+                scratch_ready = 1;
+        }
+        return scratch_values[i];
+}
+
+/******************************
+ *****Modulus contexts*********
+ ******************************/
+
+/*The numbers are kept in GMP's low level (mpn) format, size limbs each, and
+ *multiplied with mpn_mul_n() or mpn_sqr() followed by a Montgomery
+ *reduction, which is cheaper than the division mpz_mod() would do.
+ */
+
+/******** new_modulus() */
+/*
+ * Returns a new context for the (positive) modulus, or NULL if out of memory.
+ */
+
+struct jbigi_modulus* new_modulus(mpz_t mod)
+{
+        struct jbigi_modulus* m;
+        mp_size_t size;
+        mp_limb_t inv;
+        mpz_t r2;
+        int i;
+
+        size = mpz_size(mod);
+        m = malloc(sizeof(struct jbigi_modulus) + 2 * size * sizeof(mp_limb_t));
+        if (m == NULL)
+                return NULL;
+        m->limbs = (mp_limb_t*)(m + 1);
+        m->r2 = m->limbs + size;
+        m->size = size;
+        m->odd = mpz_odd_p(mod);
+        mpz_init_set(m->mod, mod);
+
+        mpz_export(m->limbs, NULL, -1, sizeof(mp_limb_t), 0, 0, mod);
+
+        /* Newton's iteration doubles the correct low bits of 1/mod, starting
+         * from 3 as mod * mod = 1 mod 8.
          */
-        (*env)->ReleaseByteArrayElements(env, *jvalue, buffer, 0);
-        //mode has (supposedly) no effect if elems is not a copy of the elements in array
+        inv = m->limbs[0];
+        for (i = 0; i < 5; i++)
+                inv *= 2 - m->limbs[0] * inv;
+        m->minv = -inv;
+
+        mpz_init(r2);
+        mpz_setbit(r2, 2 * GMP_NUMB_BITS * size);
+        mpz_mod(r2, r2, mod);
+        memset(m->r2, 0, size * sizeof(mp_limb_t));
+        mpz_export(m->r2, NULL, -1, sizeof(mp_limb_t), 0, 0, r2);
+        mpz_clear(r2);
+
+        return m;
+}
+
+/******** free_modulus() */
+
+void free_modulus(struct jbigi_modulus* m)
+{
+        if (m == NULL)
+                return;
+        mpz_clear(m->mod);
+        free(m);
+}
+
+/******** mont_redc() */
+/*
+ * rp = tp / R mod m, for tp < m * R of 2 * size limbs. tp is overwritten.
+ */
+
+static void mont_redc(struct jbigi_modulus* m, mp_limb_t* rp, mp_limb_t* tp)
+{
+        mp_size_t n = m->size;
+        mp_size_t i;
+        mp_limb_t cy;
+
+        /* Each step clears a low limb; its carry is kept in that limb and
+         * added to the high half at the end.
+         */
+        for (i = 0; i < n; i++)
+                tp[i] = mpn_addmul_1(tp + i, m->limbs, n, tp[i] * m->minv);
+        cy = mpn_add_n(rp, tp + n, tp, n);
+        if (cy != 0 || mpn_cmp(rp, m->limbs, n) >= 0)
+                mpn_sub_n(rp, rp, m->limbs, n);
+}
+
+/******** mont_mul() */
+/*
+ * rp = ap * bp / R mod m. rp may be ap or bp; tp is scratch of 2 * size limbs.
+ */
+
+void mont_mul(struct jbigi_modulus* m, mp_limb_t* rp, const mp_limb_t* ap, const mp_limb_t* bp, mp_limb_t* tp)
+{
+        if (ap == bp)
+                mpn_sqr(tp, ap, m->size);
+        else
+                mpn_mul_n(tp, ap, bp, m->size);
+        mont_redc(m, rp, tp);
+}
+
+/******** mont_import() */
+/*
+ * rp = a * R mod m, the Montgomery form of a. tp is scratch of 2 * size limbs.
+ */
+
+void mont_import(struct jbigi_modulus* m, mp_limb_t* rp, mpz_t a, mp_limb_t* tp)
+{
+        mpz_t ared;
+
+        mpz_init(ared);
+        mpz_mod(ared, a, m->mod);
+        memset(rp, 0, m->size * sizeof(mp_limb_t));
+        mpz_export(rp, NULL, -1, sizeof(mp_limb_t), 0, 0, ared);
+        mpz_clear(ared);
+
+        mont_mul(m, rp, rp, m->r2, tp);
+}
+
+/******** mont_export() */
+/*
+ * r = ap / R mod m, the value of a Montgomery form. tp is scratch of 2 * size limbs.
+ */
+
+void mont_export(struct jbigi_modulus* m, mpz_t r, const mp_limb_t* ap, mp_limb_t* tp)
+{
+        mp_size_t n = m->size;
+
+        memcpy(tp, ap, n * sizeof(mp_limb_t));
+        memset(tp + n, 0, n * sizeof(mp_limb_t));
+        mont_redc(m, tp + n, tp);
+        mpz_import(r, n, -1, sizeof(mp_limb_t), 0, 0, tp + n);
+}
+
+/******** new_fixedbase() */
+/*
+ * Returns the comb tables of base for the (positive) modulus and the
+ * exponents below 2^bits, or NULL if out of memory.
+ */
+
+struct jbigi_fixedbase* new_fixedbase(mpz_t base, mpz_t mod, long bits)
+{
+        struct jbigi_fixedbase* fb;
+        struct jbigi_modulus* m;
+        mp_size_t n;
+        mp_limb_t* tp;
+        mp_limb_t* pw;
+        mp_limb_t* g;
+        long k, idx;
+        int t;
+
+        fb = malloc(sizeof(struct jbigi_fixedbase));
+        if (fb == NULL)
+                return NULL;
+        fb->m = m = new_modulus(mod);
+        if (m == NULL) {
+                free(fb);
+                return NULL;
+        }
+        mpz_init_set(fb->base, base);
+        fb->bits = bits;
+        fb->rows = bits < JBIGI_COMB_ROWS ? bits : JBIGI_COMB_ROWS;
+        fb->cols = (bits + fb->rows - 1) / fb->rows;
+        fb->half = (fb->cols + 1) / 2;
+        fb->table = NULL;
+        if (!m->odd)
+                return fb; /* everything goes to mpz_powm() */
+
+        n = m->size;
+        fb->table = malloc((2 << fb->rows) * n * sizeof(mp_limb_t));
+        tp = malloc(3 * n * sizeof(mp_limb_t));
+        if (fb->table == NULL || tp == NULL) {
+                free(tp);
+                free_fixedbase(fb);
+                return NULL;
+        }
+        pw = tp + 2 * n;
+
+        /* The single bit entries: base ^ (2^k) for the first bit of each row
+         * in the first table, and for its bit half in the second.
+         */
+        mont_import(m, pw, base, tp);
+        for (k = 0; k < fb->rows * fb->cols; k++) {
+                if (k % fb->cols == 0)
+                        memcpy(fb->table + (1L << (k / fb->cols)) * n, pw, n * sizeof(mp_limb_t));
+                else if (k % fb->cols == fb->half)
+                        memcpy(fb->table + ((1L << fb->rows) + (1L << (k / fb->cols))) * n, pw, n * sizeof(mp_limb_t));
+                mont_mul(m, pw, pw, pw, tp);
+        }
+
+        /* The other entries, each the product of its lowest bit entry and of
+         * the entry without that bit. The second table is not used with a
+         * single column.
+         */
+        for (t = 0; t < (fb->half < fb->cols ? 2 : 1); t++) {
+                g = fb->table + ((long)t << fb->rows) * n;
+                for (idx = 1; idx < (1L << fb->rows); idx++)
+                        if (idx & (idx - 1))
+                                mont_mul(m, g + idx * n, g + (idx & (idx - 1)) * n, g + (idx & -idx) * n, tp);
+        }
+
+        free(tp);
+        return fb;
+}
+
+/******** free_fixedbase() */
+
+void free_fixedbase(struct jbigi_fixedbase* fb)
+{
+        if (fb == NULL)
+                return;
+        free(fb->table);
+        mpz_clear(fb->base);
+        free_modulus(fb->m);
+        free(fb);
+}
+
+/******** fixedbase_powm() */
+/*
+ * r = base ^ exp mod m, with the comb tables when they cover exp. Returns 0,
+ * or -1 if out of memory.
+ */
+
+int fixedbase_powm(struct jbigi_fixedbase* fb, mpz_t r, mpz_t exp)
+{
+        struct jbigi_modulus* m = fb->m;
+        mp_size_t n = m->size;
+        mp_limb_t* tp;
+        mp_limb_t* acc;
+        mp_limb_t* entry;
+        long j, c, idx;
+        int t, row, started;
+
+        if (fb->table == NULL || mpz_sgn(exp) == 0 || (long)mpz_sizeinbase(exp, 2) > fb->bits) {
+                mpz_powm(r, fb->base, exp, m->mod);
+                return 0;
+        }
+
+        tp = malloc(3 * n * sizeof(mp_limb_t));
+        if (tp == NULL)
+                return -1;
+        acc = tp + 2 * n;
+
+        started = 0;
+        for (j = fb->half - 1; j >= 0; j--) {
+                if (started)
+                        mont_mul(m, acc, acc, acc, tp);
+                for (t = 0; t < 2; t++) {
+                        c = j + t * fb->half;
+                        if (c >= fb->cols)
+                                continue;
+                        idx = 0;
+                        for (row = fb->rows - 1; row >= 0; row--)
+                                idx = idx << 1 | mpz_tstbit(exp, row * fb->cols + c);
+                        if (idx == 0)
+                                continue;
+                        entry = fb->table + (((long)t << fb->rows) + idx) * n;
+                        if (started)
+                                mont_mul(m, acc, acc, entry, tp);
+                        else
+                                memcpy(acc, entry, n * sizeof(mp_limb_t));
+                        started = 1;
+                }
+        }
+
+        mont_export(m, r, acc, tp);
+        free(tp);
+        return 0;
+}
+
+/******** window_bits() */
+/*
+ * The window size that costs the fewest multiplications for an exponent of
+ * bits bits: 2^(w-1) to fill the table, about bits/(w+1) in the scan.
+ */
+
+static int window_bits(size_t bits)
+{
+        int w = 1;
+
+        while (w < 8 && (1UL << w) + bits / (w + 2) < (1UL << (w - 1)) + bits / (w + 1))
+                w++;
+        return w;
+}
+
+/******** multi_powm() */
+/*
+ * r = base1 ^ exp1 * base2 ^ exp2 mod m, with interleaved sliding windows:
+ * both exponents are scanned together from their top bits, so the
+ * squarings are shared, and each has its own window and table of odd
+ * powers. Falls back to mpz_powm() for an even modulus. Returns 0, or -1
+ * if out of memory.
+ */
+
+int multi_powm(struct jbigi_modulus* m, mpz_t r, mpz_t base1, mpz_t exp1, mpz_t base2, mpz_t exp2)
+{
+        mp_size_t n = m->size;
+        mpz_ptr base[2];
+        mpz_ptr exp[2];
+        long bits[2];           /* exponent sizes, 0 for a zero exponent */
+        int w[2];               /* window sizes */
+        long end[2];            /* where the window being read ends, or -1 */
+        unsigned long value[2]; /* the odd value of that window */
+        mp_limb_t* table[2];    /* table[k][i] = base[k] ^ (2i + 1) */
+        mp_limb_t* tp;
+        mp_limb_t* acc;
+        long i, j, top;
+        int k, started;
+        size_t limbs;
+
+        if (!m->odd) {
+                mpz_t p2;
+
+                mpz_init(p2);
+                mpz_powm(r, base1, exp1, m->mod);
+                mpz_powm(p2, base2, exp2, m->mod);
+                mpz_mul(r, r, p2);
+                mpz_mod(r, r, m->mod);
+                mpz_clear(p2);
+                return 0;
+        }
+
+        base[0] = base1;
+        base[1] = base2;
+        exp[0] = exp1;
+        exp[1] = exp2;
+        limbs = 3 * n;
+        top = -1;
+        for (k = 0; k < 2; k++) {
+                bits[k] = mpz_sgn(exp[k]) == 0 ? 0 : mpz_sizeinbase(exp[k], 2);
+                w[k] = window_bits(bits[k]);
+                limbs += (1 << (w[k] - 1)) * n;
+                if (bits[k] - 1 > top)
+                        top = bits[k] - 1;
+                end[k] = -1;
+        }
+
+        tp = malloc(limbs * sizeof(mp_limb_t));
+        if (tp == NULL)
+                return -1;
+        acc = tp + 2 * n;
+        table[0] = acc + n;
+        table[1] = table[0] + (1 << (w[0] - 1)) * n;
+
+        for (k = 0; k < 2; k++) {
+                if (bits[k] == 0)
+                        continue;
+                mont_import(m, table[k], base[k], tp);
+                if (w[k] > 1) {
+                        mont_mul(m, acc, table[k], table[k], tp);
+                        for (i = 1; i < (1 << (w[k] - 1)); i++)
+                                mont_mul(m, table[k] + i * n, table[k] + (i - 1) * n, acc, tp);
+                }
+        }
+
+        started = 0;
+        for (i = top; i >= 0; i--) {
+                if (started)
+                        mont_mul(m, acc, acc, acc, tp);
+                for (k = 0; k < 2; k++) {
+                        /* a window starts at each 1 outside of a window, and
+                         * ends at the lowest 1 of its w bits
+                         */
+                        if (end[k] < 0 && i < bits[k] && mpz_tstbit(exp[k], i)) {
+                                end[k] = i - w[k] + 1 < 0 ? 0 : i - w[k] + 1;
+                                while (!mpz_tstbit(exp[k], end[k]))
+                                        end[k]++;
+                                value[k] = 0;
+                                for (j = i; j >= end[k]; j--)
+                                        value[k] = value[k] << 1 | mpz_tstbit(exp[k], j);
+                        }
+                        if (end[k] != i)
+                                continue;
+                        if (started)
+                                mont_mul(m, acc, acc, table[k] + (value[k] >> 1) * n, tp);
+                        else
+                                memcpy(acc, table[k] + (value[k] >> 1) * n, n * sizeof(mp_limb_t));
+                        started = 1;
+                        end[k] = -1;
+                }
+        }
+
+        if (started) {
+                mont_export(m, r, acc, tp);
+        } else {
+                /* both exponents are zero */
+                mpz_set_ui(r, 1);
+                mpz_mod(r, r, m->mod);
+        }
+        free(tp);
+        return 0;
 }
 
 /******** eof */
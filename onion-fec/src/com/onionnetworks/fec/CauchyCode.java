@@ -0,0 +1,87 @@
+package com.onionnetworks.fec;
+
+import com.onionnetworks.util.*;
+
+/**
+ * This class is the frontend for the native Cauchy Reed-Solomon code, which
+ * works on the GF(2) bit matrix of a Cauchy matrix over GF(2^8): encoding
+ * and decoding are only XORs of whole machine words, with no table lookups
+ * or multiplications.  It is interchangeable with the other 8 bit codes
+ * (it is MDS and systematic, n <= 256) but does not produce the same repair
+ * packets as Native8Code or PureCode, so both ends must use it.  Add
+ * "cauchy8" to the com.onionnetworks.fec.keys property to use it.
+ *
+ * Each packet is split in 8 sub-packets that the repair packets mix, so
+ * the packetLength must be a multiple of 8. Padding shorter packets does
+ * not work: the tail of a repair packet would be parity, not zeros, and
+ * could not be dropped.
+ *
+ * The native methods live in the fec8 library, with those of Native8Code.
+ */
+public class CauchyCode extends FECCode {
+
+    // As in Native8Code, the memory address of a native struct that must
+    // not escape.
+    final private long code;
+
+    static {
+        String path = NativeDeployer.getLibraryPath
+            (CauchyCode.class.getClassLoader(),"fec8");
+        if (path != null) {
+            System.load(path);
+        } else {
+            System.out.println("Unable to find native library for fec8 for platform "+NativeDeployer.OS_ARCH);
+            System.out.println(path);
+        }
+    }
+
+    public CauchyCode(int k, int n) {
+        super(k,n);
+        code = nativeNewCode(k,n);
+    }
+
+    protected void encode(byte[][] src, int[] srcOff, byte[][] repair,
+                          int[] repairOff, int[] index, int packetLength) {
+        if (packetLength % 8 != 0) {
+            throw new IllegalArgumentException("For the Cauchy code, "+
+                                               "packets must be a multiple "+
+                                               "of 8 bytes.");
+        }
+        nativeEncode(code,src,srcOff,index,repair,repairOff,k,packetLength);
+    }
+
+    protected void decode(byte[][] pkts, int[] pktsOff,
+                          int[] index, int packetLength, boolean inOrder) {
+        if (packetLength % 8 != 0) {
+            throw new IllegalArgumentException("For the Cauchy code, "+
+                                               "packets must be a multiple "+
+                                               "of 8 bytes.");
+        }
+        // Shuffle first so that the byte[][] stays in sync with the native
+        // side, as in Native8Code.
+        if (!inOrder) {
+            shuffle(pkts,pktsOff,index,k);
+        }
+        nativeDecode(code,pkts,pktsOff,index,k,packetLength);
+    }
+
+    private static native void nativeEncode
+        (long code, byte[][] src, int[] srcOff, int[] index, byte[][] ret,
+         int[] retOff, int k, int packetLength);
+
+    private static native void nativeDecode
+        (long code, byte[][] pkts, int[] pktsOff, int[] index, int k,
+         int packetLength);
+
+    private static synchronized native long nativeNewCode(int k, int n);
+
+    private static synchronized native void nativeFreeCode(long code);
+
+    protected void finalize() throws Throwable {
+        nativeFreeCode(code);
+    }
+
+    public String toString() {
+        return new String("CauchyCode[k="+k+",n="+n+"]");
+    }
+}
@@ -2,9 +2,9 @@ package com.onionnetworks.fec;
 
 import java.util.*;
 import java.io.IOException;
+import java.lang.ref.SoftReference;
 import java.lang.reflect.*;
 import com.onionnetworks.util.Tuple;
-import com.onionnetworks.util.TimedSoftHashMap;
 
 /**
  * This is the default FECCodeFactory that wraps all of the FECCode 
@@ -20,6 +20,12 @@ import com.onionnetworks.util.TimedSoftHashMap;
  * let me know because I worked my ass of to provide this for you, so do me
  * a favor and at least let me know what you're using this for.
  *
+ * Codes do not change once built and may be used by several threads at
+ * once, so the factory hands out the same instance for the same k and n
+ * while it is cached.  Up to DEFAULT_CACHE_SIZE codes are kept, through
+ * SoftReferences so that idle ones can be reclaimed under memory
+ * pressure.
+ *
  * (c) Copyright 2001 Onion Networks
  * (c) Copyright 2000 OpenCola
  *
@@ -28,8 +34,14 @@ import com.onionnetworks.util.TimedSoftHashMap;
 public class DefaultFECCodeFactory extends FECCodeFactory {
 
     public static final int DEFAULT_CACHE_TIME = 2*60*1000;
+    public static final int DEFAULT_CACHE_SIZE = 32;
 
-    //protected TimedSoftHashMap codeCache = new HashMap();
+    // Tuple(k,n) -> SoftReference(FECCode), least recently used first.
+    protected LinkedHashMap codeCache = new LinkedHashMap(16,0.75f,true) {
+            protected boolean removeEldestEntry(Map.Entry eldest) {
+                return size() > DEFAULT_CACHE_SIZE;
+            }
+        };
     protected ArrayList eightBitCodes = new ArrayList();
     protected ArrayList sixteenBitCodes = new ArrayList();
     protected Properties fecProperties;
@@ -98,7 +110,11 @@ public class DefaultFECCodeFactory extends FECCodeFactory {
         Tuple t = new Tuple(K,N);
 
         // See if there is a cached code.
-        FECCode result = null; //(FECCode) codeCache.get(t);
+        FECCode result = null;
+        SoftReference ref = (SoftReference) codeCache.get(t);
+        if (ref != null) {
+            result = (FECCode) ref.get();
+        }
         if (result == null) {
             if (k < 1 || k > 65536 || n < k || n > 65536) {
                 throw new IllegalArgumentException
@@ -122,9 +138,9 @@ public class DefaultFECCodeFactory extends FECCodeFactory {
                 }
             }
                         
-            //if (result != null) {
-            //    codeCache.put(t,result,DEFAULT_CACHE_TIME);
-            // }
+            if (result != null) {
+                codeCache.put(t,new SoftReference(result));
+            }
         } 
         return result;
     }
@@ -1,5 +1,11 @@
 package com.onionnetworks.fec;
 
+import java.nio.ByteBuffer;
+import java.util.concurrent.Executor;
+import java.util.concurrent.Executors;
+import java.util.concurrent.Semaphore;
+import java.util.concurrent.ThreadFactory;
+
 import com.onionnetworks.util.Util;
 import com.onionnetworks.util.Buffer;
 
@@ -28,6 +34,19 @@ import com.onionnetworks.util.Buffer;
  */
 public abstract class FECCode {
 
+    /**
+     * At most this many submitted jobs may be unfinished at once, unless
+     * the "com.onionnetworks.fec.maxpending" system property says
+     * otherwise.  submitEncode() and submitDecode() block while the limit
+     * is reached.
+     */
+    public static final int DEFAULT_MAX_PENDING = 64;
+
+    private static final Semaphore pending = new Semaphore
+        (Integer.getInteger("com.onionnetworks.fec.maxpending",
+                            DEFAULT_MAX_PENDING).intValue());
+    private static Executor executor;
+
     protected int k,n;
     
     /**
@@ -205,6 +224,424 @@ public abstract class FECCode {
         decode(bufs,offs,index,pkts[0].len,true);
     }
 
+    /**
+     * ByteBuffer version of encode(Buffer[],Buffer[],int[]).  Each packet
+     * starts at the position of its buffer and is
+     * <code>src[0].remaining()</code> bytes long.  The positions and limits
+     * of the buffers are left alone.
+     *
+     * Native codes read and write direct buffers in place, without copying
+     * or pinning anything.  Otherwise the packets are encoded through their
+     * backing byte[], or through a copy if there is none.
+     */
+    public void encode(ByteBuffer[] src, ByteBuffer[] repair, int[] index) {
+        int packetLength = src[0].remaining();
+        byte[][] srcBufs = new byte[src.length][];
+        int[] srcOffs = new int[src.length];
+        byte[][] repairBufs = new byte[repair.length][];
+        int[] repairOffs = new int[repair.length];
+        for (int i=0;i<srcBufs.length;i++) {
+            toArray(src[i],packetLength,srcBufs,srcOffs,i,true);
+        }
+        for (int i=0;i<repairBufs.length;i++) {
+            toArray(repair[i],packetLength,repairBufs,repairOffs,i,false);
+        }
+
+        encode(srcBufs,srcOffs,repairBufs,repairOffs,index,packetLength);
+
+        for (int i=0;i<repairBufs.length;i++) {
+            fromArray(repair[i],packetLength,repairBufs[i],repairOffs[i]);
+        }
+    }
+
+    /**
+     * Encode packets laid out in one buffer each for the source and the
+     * repair packets: packet i starts <code>i*stride</code> bytes after the
+     * position of its buffer.
+     *
+     * @param src holds the <code>k</code> source packets.
+     * @param srcStride distance between the starts of two source packets.
+     * @param repair receives the packets listed in <code>index</code>.
+     * @param repairStride distance between the starts of two repair
+     * packets.
+     * @param index the indexes of the packets to be encoded.
+     * @param packetLength the packetLength in bytes.
+     */
+    public void encode(ByteBuffer src, int srcStride, ByteBuffer repair,
+                       int repairStride, int[] index, int packetLength) {
+        encode(packets(src,srcStride,k,packetLength),
+               packets(repair,repairStride,index.length,packetLength),index);
+    }
+
+    /**
+     * ByteBuffer version of decode(Buffer[],int[]).  As there, the data is
+     * moved rather than the buffers, so that once decoding is complete
+     * pkts[i] holds packet i.
+     */
+    public void decode(ByteBuffer[] pkts, int[] index) {
+        copyShuffle(pkts,index,k);
+
+        int packetLength = pkts[0].remaining();
+        byte[][] bufs = new byte[pkts.length][];
+        int[] offs = new int[pkts.length];
+        for (int i=0;i<bufs.length;i++) {
+            toArray(pkts[i],packetLength,bufs,offs,i,true);
+        }
+        decode(bufs,offs,index,packetLength,true);
+        for (int i=0;i<bufs.length;i++) {
+            fromArray(pkts[i],packetLength,bufs[i],offs[i]);
+        }
+    }
+
+    /**
+     * Decode <code>k</code> packets laid out <code>stride</code> bytes
+     * apart from the position of <code>pkts</code>.  Once decoding is
+     * complete the source block is in order in the buffer.
+     */
+    public void decode(ByteBuffer pkts, int stride, int[] index,
+                       int packetLength) {
+        decode(packets(pkts,stride,k,packetLength),index);
+    }
+
+    /**
+     * Returns an encoder that produces the packets listed in
+     * <code>index</code> from source packets added one at a time.  This
+     * one keeps copies of the source packets and encodes them when
+     * finished; native codes accumulate the repair packets as the sources
+     * arrive instead.
+     */
+    public FECEncoder createEncoder(int[] index, int packetLength) {
+        for (int i=0;i<index.length;i++) {
+            if (index[i] < 0 || index[i] >= n) {
+                throw new IllegalArgumentException("Invalid index "+index[i]+
+                                                   " (max "+(n-1)+")");
+            }
+        }
+        return new BufferedEncoder(index,packetLength);
+    }
+
+    private class BufferedEncoder extends FECEncoder {
+
+        private byte[][] src;
+        private int added;
+
+        BufferedEncoder(int[] index, int packetLength) {
+            super(FECCode.this.k,index,packetLength);
+            src = new byte[k][];
+        }
+
+        public void add(byte[] buf, int off, int i) {
+            if (src == null) {
+                throw new IllegalStateException("Encoder finished");
+            }
+            if (i < 0 || i >= k || src[i] != null) {
+                throw new IllegalArgumentException
+                    ("Bad or repeated source packet "+i);
+            }
+            src[i] = new byte[packetLength];
+            System.arraycopy(buf,off,src[i],0,packetLength);
+            added++;
+        }
+
+        public void finish(byte[][] repair, int[] repairOff) {
+            if (src == null || added != k) {
+                throw new IllegalStateException
+                    ("Not all the source packets were added");
+            }
+            encode(src,new int[k],repair,repairOff,index,packetLength);
+            src = null;
+        }
+
+        public void abort() {
+            src = null;
+        }
+    }
+
+    /**
+     * Returns a decoder for a block whose packets are received one at a
+     * time.  This one keeps copies of the packets and decodes them when
+     * finished; native codes eliminate as the packets arrive instead.
+     */
+    public FECDecoder createDecoder(int packetLength) {
+        return new BufferedDecoder(packetLength);
+    }
+
+    private class BufferedDecoder extends FECDecoder {
+
+        private byte[][] pkts;
+        private int[] index;
+        private boolean[] seen;
+        private int added;
+
+        BufferedDecoder(int packetLength) {
+            super(FECCode.this.k,FECCode.this.n,packetLength);
+            pkts = new byte[k][];
+            index = new int[k];
+            seen = new boolean[n];
+        }
+
+        public int add(byte[] buf, int off, int i) {
+            if (pkts == null) {
+                throw new IllegalStateException("Decoder finished");
+            }
+            if (i < 0 || i >= n || seen[i]) {
+                throw new IllegalArgumentException
+                    ("Bad or repeated packet "+i);
+            }
+            if (added < k) {
+                seen[i] = true;
+                pkts[added] = new byte[packetLength];
+                System.arraycopy(buf,off,pkts[added],0,packetLength);
+                index[added++] = i;
+            }
+            return k - added;
+        }
+
+        public void finish(byte[][] dst, int[] dstOff) {
+            if (pkts == null || added != k) {
+                throw new IllegalStateException
+                    ("Not enough packets to decode");
+            }
+            decode(pkts,new int[k],index,packetLength,false);
+            for (int i=0;i<k;i++) {
+                System.arraycopy(pkts[i],0,dst[i],dstOff[i],packetLength);
+            }
+            pkts = null;
+        }
+
+        public void abort() {
+            pkts = null;
+        }
+    }
+
+    /**
+     * Starts encode(ByteBuffer,int,ByteBuffer,int,int[],int) in the
+     * background and returns at once, unless DEFAULT_MAX_PENDING jobs are
+     * already unfinished, in which case it first waits for one of them.
+     * Native codes run the job in the native library, on direct buffers;
+     * otherwise it is run by a pool of Java threads.
+     *
+     * @param listener if not null, told when the job is done.
+     */
+    public FECFuture submitEncode(ByteBuffer src, int srcStride,
+                                  ByteBuffer repair, int repairStride,
+                                  int[] index, int packetLength,
+                                  FECListener listener) {
+        FECFuture f = new FECFuture(listener);
+        boolean started = false;
+        pending.acquireUninterruptibly();
+        try {
+            startEncode(f,src,srcStride,repair,repairStride,index,
+                        packetLength);
+            started = true;
+        } finally {
+            // e.g. OutOfMemoryError from the native submit
+            if (!started)
+                pending.release();
+        }
+        return f;
+    }
+
+    /**
+     * Starts decode(ByteBuffer,int,int[],int) in the background, as
+     * submitEncode() does.  index is updated when the job is done.
+     */
+    public FECFuture submitDecode(ByteBuffer pkts, int stride, int[] index,
+                                  int packetLength, FECListener listener) {
+        FECFuture f = new FECFuture(listener);
+        boolean started = false;
+        pending.acquireUninterruptibly();
+        try {
+            startDecode(f,pkts,stride,index,packetLength);
+            started = true;
+        } finally {
+            if (!started)
+                pending.release();
+        }
+        return f;
+    }
+
+    /**
+     * Runs the encode for submitEncode() and completes f.  This one hands
+     * it to the Java pool, codes with a faster way override it.
+     */
+    protected void startEncode(final FECFuture f, final ByteBuffer src,
+                               final int srcStride, final ByteBuffer repair,
+                               final int repairStride, final int[] index,
+                               final int packetLength) {
+        executor().execute(new Runnable() {
+                public void run() {
+                    Throwable t = null;
+                    try {
+                        encode(src,srcStride,repair,repairStride,index,
+                               packetLength);
+                    } catch (Throwable e) {
+                        t = e;
+                    }
+                    f.complete(t);
+                }
+            });
+    }
+
+    /**
+     * Runs the decode for submitDecode() and completes f.
+     */
+    protected void startDecode(final FECFuture f, final ByteBuffer pkts,
+                               final int stride, final int[] index,
+                               final int packetLength) {
+        executor().execute(new Runnable() {
+                public void run() {
+                    Throwable t = null;
+                    try {
+                        decode(pkts,stride,index,packetLength);
+                    } catch (Throwable e) {
+                        t = e;
+                    }
+                    f.complete(t);
+                }
+            });
+    }
+
+    /**
+     * A submitted job is done, make room for another one.
+     */
+    static void jobDone() {
+        pending.release();
+    }
+
+    /**
+     * The Java pool, one daemon thread per processor.
+     */
+    private static synchronized Executor executor() {
+        if (executor == null) {
+            executor = Executors.newFixedThreadPool
+                (Runtime.getRuntime().availableProcessors(),
+                 new ThreadFactory() {
+                     public Thread newThread(Runnable r) {
+                         Thread t = new Thread(r,"FEC worker");
+                         t.setDaemon(true);
+                         return t;
+                     }
+                 });
+        }
+        return executor;
+    }
+
+    /**
+     * Returns the positions of the buffers if they are all direct (and
+     * writable if the packets are written), null otherwise.  Throws
+     * IllegalArgumentException if a buffer holds less than packetLength
+     * bytes.
+     */
+    protected static final int[] directPositions(ByteBuffer[] bufs,
+                                                 int packetLength,
+                                                 boolean write) {
+        int[] pos = new int[bufs.length];
+        boolean direct = true;
+        for (int i=0;i<bufs.length;i++) {
+            if (bufs[i].remaining() < packetLength) {
+                throw new IllegalArgumentException
+                    ("Buffer "+i+" shorter than a packet");
+            }
+            direct &= bufs[i].isDirect() && !(write && bufs[i].isReadOnly());
+            pos[i] = bufs[i].position();
+        }
+        return direct ? pos : null;
+    }
+
+    /**
+     * Returns true if the segment is direct (and writable if the packets
+     * are written).  Throws IllegalArgumentException if num packets do not
+     * fit between its position and limit.
+     */
+    protected static final boolean isDirectSegment(ByteBuffer seg, int stride,
+                                                   int num, int packetLength,
+                                                   boolean write) {
+        if (stride < packetLength || (num > 0 && (long) (num-1)*stride + 
+                                      packetLength > seg.remaining())) {
+            throw new IllegalArgumentException
+                ("Segment too short for "+num+" packets");
+        }
+        return seg.isDirect() && !(write && seg.isReadOnly());
+    }
+
+    /**
+     * One buffer per packet of a segment.
+     */
+    private static ByteBuffer[] packets(ByteBuffer seg, int stride, int num,
+                                        int packetLength) {
+        isDirectSegment(seg,stride,num,packetLength,false);
+        ByteBuffer[] pkts = new ByteBuffer[num];
+        for (int i=0;i<num;i++) {
+            ByteBuffer b = seg.duplicate();
+            b.position(seg.position()+i*stride);
+            b.limit(b.position()+packetLength);
+            pkts[i] = b.slice();
+        }
+        return pkts;
+    }
+
+    /**
+     * Point bufs[i], offs[i] at the packet in b: its backing array if it
+     * has one, otherwise a new byte[], holding a copy of the packet if
+     * <code>copy</code> is set.
+     */
+    private static void toArray(ByteBuffer b, int packetLength,
+                                byte[][] bufs, int[] offs, int i,
+                                boolean copy) {
+        if (b.hasArray()) {
+            bufs[i] = b.array();
+            offs[i] = b.arrayOffset()+b.position();
+        } else {
+            bufs[i] = new byte[packetLength];
+            if (copy) {
+                b.duplicate().get(bufs[i]);
+            }
+        }
+    }
+
+    /**
+     * Write back a packet that toArray() had to copy.
+     */
+    private static void fromArray(ByteBuffer b, int packetLength, byte[] buf,
+                                  int off) {
+        if (!b.hasArray()) {
+            b.duplicate().put(buf,off,packetLength);
+        }
+    }
+
+    /**
+     * ByteBuffer version of copyShuffle(Buffer[],int[],int).
+     */
+    protected static final void copyShuffle(ByteBuffer[] pkts, int index[],
+                                            int k) {
+        byte[] b = null, c2 = null;
+        for (int i = 0;i < k ;) {
+            if (index[i] >= k || index[i] == i) {
+                i++;
+            } else {
+                int c = index[i];
+
+                if (index[c] == c) {
+                    throw new IllegalArgumentException
+                        ("Shuffle Error: Duplicate indexes at "+i);
+                }
+                int tmp = index[i];
+                index[i] = index[c];
+                index[c] = tmp;
+
+                if (b == null) {
+                    b = new byte[pkts[0].remaining()];
+                    c2 = new byte[b.length];
+                }
+                pkts[i].duplicate().get(b);
+                pkts[c].duplicate().get(c2);
+                pkts[i].duplicate().put(c2);
+                pkts[c].duplicate().put(b);
+            }
+        }
+    }
+
     /**
      * Move packets with index < k into their position.  This method
      * copies the data using System.arraycopy rather than modifying the
@@ -0,0 +1,61 @@
+package com.onionnetworks.fec;
+
+import com.onionnetworks.util.Buffer;
+
+/**
+ * Decodes a block from packets given one at a time as they are received,
+ * in any order, instead of all at once as with FECCode.decode().  Native
+ * codes do the elimination as the packets arrive, so that little work is
+ * left when the last one comes in.  Get one from FECCode.createDecoder().
+ * A decoder is not safe for concurrent use.
+ */
+public abstract class FECDecoder {
+
+    protected final int k, n;
+    protected final int packetLength;
+
+    protected FECDecoder(int k, int n, int packetLength) {
+        this.k = k;
+        this.n = n;
+        this.packetLength = packetLength;
+    }
+
+    /**
+     * Adds packet <code>index</code> (0..n-1) of the block,
+     * <code>packetLength</code> bytes of <code>pkt</code> starting at
+     * <code>pktOff</code>, which may be reused when this returns.  Packets
+     * beyond the k needed are ignored.
+     *
+     * @return the number of packets still needed, 0 once the block can be
+     * finished.
+     * @throws IllegalArgumentException for a bad or repeated index.
+     */
+    public abstract int add(byte[] pkt, int pktOff, int index);
+
+    public int add(Buffer pkt, int index) {
+        return add(pkt.b,pkt.off,index);
+    }
+
+    /**
+     * Writes the k source packets, in order, to <code>dst</code> and
+     * releases the decoder.
+     *
+     * @throws IllegalStateException if packets are still needed.
+     */
+    public abstract void finish(byte[][] dst, int[] dstOff);
+
+    public void finish(Buffer[] dst) {
+        byte[][] bufs = new byte[dst.length][];
+        int[] offs = new int[dst.length];
+        for (int i=0;i<dst.length;i++) {
+            bufs[i] = dst[i].b;
+            offs[i] = dst[i].off;
+        }
+        finish(bufs,offs);
+    }
+
+    /**
+     * Releases the decoder without producing anything.
+     */
+    public abstract void abort();
+}
@@ -0,0 +1,59 @@
+package com.onionnetworks.fec;
+
+import com.onionnetworks.util.Buffer;
+
+/**
+ * Encodes a block whose source packets arrive one at a time, for example
+ * as they are read from disk, instead of all at once as with
+ * FECCode.encode().  Each packet is folded into the repair packets when it
+ * is added and may be reused by the caller right away, so that only the
+ * repair packets are held while the block is in flight.  Get one from
+ * FECCode.createEncoder().  An encoder is not safe for concurrent use.
+ */
+public abstract class FECEncoder {
+
+    protected final int k;
+    protected final int[] index;
+    protected final int packetLength;
+
+    protected FECEncoder(int k, int[] index, int packetLength) {
+        this.k = k;
+        this.index = (int[]) index.clone();
+        this.packetLength = packetLength;
+    }
+
+    /**
+     * Adds source packet <code>i</code> (0..k-1), <code>packetLength</code>
+     * bytes of <code>src</code> starting at <code>srcOff</code>.  Each
+     * source packet must be added exactly once, in any order.
+     */
+    public abstract void add(byte[] src, int srcOff, int i);
+
+    public void add(Buffer src, int i) {
+        add(src.b,src.off,i);
+    }
+
+    /**
+     * Once all k source packets have been added, writes the packets
+     * listed in <code>index</code> to <code>repair</code> and releases the
+     * encoder.
+     *
+     * @throws IllegalStateException if some source packets are missing.
+     */
+    public abstract void finish(byte[][] repair, int[] repairOff);
+
+    public void finish(Buffer[] repair) {
+        byte[][] bufs = new byte[repair.length][];
+        int[] offs = new int[repair.length];
+        for (int i=0;i<repair.length;i++) {
+            bufs[i] = repair[i].b;
+            offs[i] = repair[i].off;
+        }
+        finish(bufs,offs);
+    }
+
+    /**
+     * Releases the encoder without producing anything.
+     */
+    public abstract void abort();
+}
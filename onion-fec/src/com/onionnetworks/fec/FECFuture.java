@@ -0,0 +1,89 @@
+package com.onionnetworks.fec;
+
+import java.util.concurrent.ExecutionException;
+import java.util.concurrent.Future;
+import java.util.concurrent.TimeUnit;
+import java.util.concurrent.TimeoutException;
+
+/**
+ * The pending result of FECCode.submitEncode() or submitDecode().  Once
+ * the job is done get() returns null, or throws an ExecutionException
+ * wrapping what the blocking encode or decode would have thrown.  The
+ * buffers of a job must be left alone until then.  A submitted job runs
+ * to completion, it cannot be cancelled.
+ */
+public class FECFuture implements Future {
+
+    private final FECListener listener;
+    private boolean done;
+    private Throwable error;
+
+    // What the native side works on, kept reachable until the job is done.
+    Object refs;
+    // Decodes: the indexes to hand back when done.
+    int[][] index;
+
+    FECFuture(FECListener listener) {
+        this.listener = listener;
+    }
+
+    /**
+     * Called once, by whoever ran the job.
+     */
+    void complete(Throwable t) {
+        synchronized (this) {
+            error = t;
+            done = true;
+            refs = null;
+            notifyAll();
+        }
+        FECCode.jobDone();
+        if (listener != null) {
+            try {
+                listener.fecDone(this);
+            } catch (RuntimeException e) {
+                e.printStackTrace();
+            }
+        }
+    }
+
+    public boolean cancel(boolean mayInterruptIfRunning) {
+        return false;
+    }
+
+    public boolean isCancelled() {
+        return false;
+    }
+
+    public synchronized boolean isDone() {
+        return done;
+    }
+
+    public synchronized Object get() throws InterruptedException,
+                                            ExecutionException {
+        while (!done) {
+            wait();
+        }
+        return result();
+    }
+
+    public synchronized Object get(long timeout, TimeUnit unit)
+        throws InterruptedException, ExecutionException, TimeoutException {
+        long end = System.nanoTime()+unit.toNanos(timeout);
+        while (!done) {
+            long left = end-System.nanoTime();
+            if (left <= 0) {
+                throw new TimeoutException();
+            }
+            TimeUnit.NANOSECONDS.timedWait(this,left);
+        }
+        return result();
+    }
+
+    private Object result() throws ExecutionException {
+        if (error != null) {
+            throw new ExecutionException(error);
+        }
+        return null;
+    }
+}
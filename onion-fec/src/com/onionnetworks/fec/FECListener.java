@@ -0,0 +1,14 @@
+package com.onionnetworks.fec;
+
+/**
+ * Told when a job submitted with FECCode.submitEncode() or submitDecode()
+ * has finished.  It is called from the thread that ran or reaped the job,
+ * so it should hand off anything slow rather than do it there.
+ */
+public interface FECListener {
+
+    /**
+     * @param f the finished job; f.get() returns at once.
+     */
+    public void fecDone(FECFuture f);
+}
@@ -2,6 +2,9 @@ package com.onionnetworks.fec;
 
 //import java.security.AccessController;
 //import sun.security.action.*;
+import java.nio.ByteBuffer;
+import java.util.HashMap;
+
 import com.onionnetworks.util.*;
 
 /**
@@ -20,6 +23,11 @@ public class Native16Code extends FECCode {
     // attacker the ability to point to anything in memory.
     final private long code;
 
+    // Native handle -> FECFuture of the submitted jobs, and the thread
+    // that completes them.
+    private static final HashMap jobs = new HashMap();
+    private static Thread reaper;
+
     static {
         String path = NativeDeployer.getLibraryPath
             (Native8Code.class.getClassLoader(),"fec16");
@@ -59,6 +67,371 @@ public class Native16Code extends FECCode {
         nativeDecode(pkts,pktsOff,index,k,packetLength);
     }
 
+    /**
+     * Decodes the packets where they are, moving the data into order
+     * natively instead of with FECCode.copyShuffle().
+     */
+    public void decode(Buffer[] pkts, int[] index) {
+        if (pkts[0].len % 2 != 0) {
+            throw new IllegalArgumentException("For 16 bit codes, buffers "+
+                                               "must be 16 bit aligned.");
+        }
+        byte[][] bufs = new byte[pkts.length][];
+        int[] offs = new int[pkts.length];
+        for (int i=0;i<bufs.length;i++) {
+            bufs[i] = pkts[i].b;
+            offs[i] = pkts[i].off;
+        }
+        nativeDecodeInPlace(bufs,offs,index,k,pkts[0].len);
+    }
+
+    /**
+     * Direct buffers are encoded in place, others go through FECCode.
+     */
+    public void encode(ByteBuffer[] src, ByteBuffer[] repair, int[] index) {
+        int packetLength = src[0].remaining();
+        int[] srcOff = directPositions(src,packetLength,false);
+        int[] repairOff = directPositions(repair,packetLength,true);
+        if (srcOff == null || repairOff == null) {
+            super.encode(src,repair,index);
+            return;
+        }
+        if (packetLength % 2 != 0) {
+            throw new IllegalArgumentException("For 16 bit codes, buffers "+
+                                               "must be 16 bit aligned.");
+        }
+        nativeEncodeDirect(src,srcOff,index,repair,repairOff,k,packetLength);
+    }
+
+    public void encode(ByteBuffer src, int srcStride, ByteBuffer repair,
+                       int repairStride, int[] index, int packetLength) {
+        if (!isDirectSegment(src,srcStride,k,packetLength,false) ||
+            !isDirectSegment(repair,repairStride,index.length,packetLength,
+                             true)) {
+            super.encode(src,srcStride,repair,repairStride,index,
+                         packetLength);
+            return;
+        }
+        if (packetLength % 2 != 0) {
+            throw new IllegalArgumentException("For 16 bit codes, buffers "+
+                                               "must be 16 bit aligned.");
+        }
+        nativeEncodeSegment(src,src.position(),srcStride,index,repair,
+                            repair.position(),repairStride,k,packetLength);
+    }
+
+    public void decode(ByteBuffer[] pkts, int[] index) {
+        int packetLength = pkts[0].remaining();
+        int[] pktsOff = directPositions(pkts,packetLength,true);
+        if (pktsOff == null) {
+            super.decode(pkts,index);
+            return;
+        }
+        if (packetLength % 2 != 0) {
+            throw new IllegalArgumentException("For 16 bit codes, buffers "+
+                                               "must be 16 bit aligned.");
+        }
+        // the packets are shuffled into place natively, by copying
+        nativeDecodeDirect(pkts,pktsOff,index,k,packetLength);
+    }
+
+    public void decode(ByteBuffer pkts, int stride, int[] index,
+                       int packetLength) {
+        if (!isDirectSegment(pkts,stride,k,packetLength,true)) {
+            super.decode(pkts,stride,index,packetLength);
+            return;
+        }
+        if (packetLength % 2 != 0) {
+            throw new IllegalArgumentException("For 16 bit codes, buffers "+
+                                               "must be 16 bit aligned.");
+        }
+        nativeDecodeSegment(pkts,pkts.position(),stride,index,k,
+                            packetLength);
+    }
+
+    /**
+     * The repair packets are accumulated in native memory as the source
+     * packets are added.
+     */
+    public FECEncoder createEncoder(int[] index, int packetLength) {
+        return new Encoder(index,packetLength);
+    }
+
+    private class Encoder extends FECEncoder {
+
+        // Native memory address, as code; 0 once finished.
+        private long enc;
+        private int added;
+
+        Encoder(int[] index, int packetLength) {
+            super(Native16Code.this.k,index,packetLength);
+            enc = nativeNewEncoder(this.index,packetLength);
+        }
+
+        public synchronized void add(byte[] src, int srcOff, int i) {
+            if (enc == 0) {
+                throw new IllegalStateException("Encoder finished");
+            }
+            nativeEncoderAdd(enc,src,srcOff,i);
+            added++;
+        }
+
+        public synchronized void finish(byte[][] repair, int[] repairOff) {
+            if (enc == 0 || added != k) {
+                throw new IllegalStateException
+                    ("Not all the source packets were added");
+            }
+            if (repair.length != index.length ||
+                repairOff.length != index.length) {
+                throw new IllegalArgumentException
+                    ("Need one repair packet per index");
+            }
+            long e = enc;
+            enc = 0;
+            nativeEncoderFinish(e,repair,repairOff);
+        }
+
+        public synchronized void abort() {
+            if (enc != 0) {
+                nativeEncoderFinish(enc,null,null);
+                enc = 0;
+            }
+        }
+
+        protected void finalize() throws Throwable {
+            abort();
+        }
+    }
+
+    /**
+     * The packets are eliminated in native memory as they are added.
+     */
+    public FECDecoder createDecoder(int packetLength) {
+        return new Decoder(packetLength);
+    }
+
+    private class Decoder extends FECDecoder {
+
+        // Native memory address, as code; 0 once finished.
+        private long dec;
+        private int needed;
+
+        Decoder(int packetLength) {
+            super(Native16Code.this.k,Native16Code.this.n,packetLength);
+            dec = nativeNewDecoder(packetLength);
+            needed = k;
+        }
+
+        public synchronized int add(byte[] pkt, int pktOff, int index) {
+            if (dec == 0) {
+                throw new IllegalStateException("Decoder finished");
+            }
+            needed = nativeDecoderAdd(dec,pkt,pktOff,index);
+            return needed;
+        }
+
+        public synchronized void finish(byte[][] dst, int[] dstOff) {
+            if (dec == 0 || needed != 0) {
+                throw new IllegalStateException
+                    ("Not enough packets to decode");
+            }
+            if (dst.length != k || dstOff.length != k) {
+                throw new IllegalArgumentException("Need k packets");
+            }
+            long d = dec;
+            dec = 0;
+            nativeDecoderFinish(d,dst,dstOff);
+        }
+
+        public synchronized void abort() {
+            if (dec != 0) {
+                nativeDecoderFinish(dec,null,null);
+                dec = 0;
+            }
+        }
+
+        protected void finalize() throws Throwable {
+            abort();
+        }
+    }
+
+    /**
+     * Encodes a batch of segments, e.g. all the segments of a file, in one
+     * native call instead of one call per segment.  Segment i uses
+     * <code>codes[i]</code> and is laid out as for
+     * encode(ByteBuffer,int,ByteBuffer,int,int[],int): its source packets
+     * <code>srcStride[i]</code> bytes apart in <code>src[i]</code>, the
+     * packets listed in <code>index[i]</code> written
+     * <code>repairStride[i]</code> bytes apart to <code>repair[i]</code>.
+     * If any of the buffers is not direct, the segments are encoded one by
+     * one.
+     */
+    public static void encodeBatch(Native16Code[] codes, ByteBuffer[] src,
+                                   int[] srcStride, ByteBuffer[] repair,
+                                   int[] repairStride, int[][] index,
+                                   int[] packetLength) {
+        int num = codes.length;
+        int[] srcOff = new int[num];
+        int[] repairOff = new int[num];
+        boolean direct = true;
+        for (int i=0;i<num;i++) {
+            if (packetLength[i] % 2 != 0) {
+                throw new IllegalArgumentException("For 16 bit codes, "+
+                                                   "buffers must be 16 bit "+
+                                                   "aligned.");
+            }
+            direct &= isDirectSegment(src[i],srcStride[i],codes[i].k,
+                                      packetLength[i],false);
+            direct &= isDirectSegment(repair[i],repairStride[i],
+                                      index[i].length,packetLength[i],true);
+            srcOff[i] = src[i].position();
+            repairOff[i] = repair[i].position();
+        }
+        if (!direct) {
+            for (int i=0;i<num;i++) {
+                codes[i].encode(src[i],srcStride[i],repair[i],repairStride[i],
+                                index[i],packetLength[i]);
+            }
+            return;
+        }
+        nativeEncodeBatch(codes,src,srcOff,srcStride,index,repair,repairOff,
+                          repairStride,packetLength);
+    }
+
+    /**
+     * Decodes a batch of segments in one native call.  Segment i is
+     * decoded as by decode(ByteBuffer,int,int[],int) with
+     * <code>codes[i]</code>.
+     */
+    public static void decodeBatch(Native16Code[] codes, ByteBuffer[] pkts,
+                                   int[] stride, int[][] index,
+                                   int[] packetLength) {
+        int num = codes.length;
+        int[] pktsOff = new int[num];
+        boolean direct = true;
+        for (int i=0;i<num;i++) {
+            if (packetLength[i] % 2 != 0) {
+                throw new IllegalArgumentException("For 16 bit codes, "+
+                                                   "buffers must be 16 bit "+
+                                                   "aligned.");
+            }
+            if (index[i].length != codes[i].k) {
+                throw new IllegalArgumentException("Must be exactly k "+
+                                                   "index entries.");
+            }
+            direct &= isDirectSegment(pkts[i],stride[i],codes[i].k,
+                                      packetLength[i],true);
+            pktsOff[i] = pkts[i].position();
+        }
+        if (!direct) {
+            for (int i=0;i<num;i++) {
+                codes[i].decode(pkts[i],stride[i],index[i],packetLength[i]);
+            }
+            return;
+        }
+        nativeDecodeBatch(codes,pkts,pktsOff,stride,index,packetLength);
+    }
+
+    /**
+     * Direct segments are handed to the native library, which runs the job
+     * on its own threads.
+     */
+    protected void startEncode(FECFuture f, ByteBuffer src, int srcStride,
+                               ByteBuffer repair, int repairStride,
+                               int[] index, int packetLength) {
+        if (!isDirectSegment(src,srcStride,k,packetLength,false) ||
+            !isDirectSegment(repair,repairStride,index.length,packetLength,
+                             true)) {
+            super.startEncode(f,src,srcStride,repair,repairStride,index,
+                              packetLength);
+            return;
+        }
+        if (packetLength % 2 != 0) {
+            throw new IllegalArgumentException("For 16 bit codes, buffers "+
+                                               "must be 16 bit aligned.");
+        }
+        Native16Code[] codes = new Native16Code[] {this};
+        ByteBuffer[] srcs = new ByteBuffer[] {src};
+        ByteBuffer[] repairs = new ByteBuffer[] {repair};
+        f.refs = new Object[] {codes,srcs,repairs};
+        synchronized (jobs) {
+            long h = nativeSubmitEncode
+                (codes,srcs,new int[] {src.position()},new int[] {srcStride},
+                 new int[][] {index},repairs,new int[] {repair.position()},
+                 new int[] {repairStride},new int[] {packetLength});
+            jobs.put(new Long(h),f);
+            startReaper();
+        }
+    }
+
+    protected void startDecode(FECFuture f, ByteBuffer pkts, int stride,
+                               int[] index, int packetLength) {
+        if (!isDirectSegment(pkts,stride,k,packetLength,true)) {
+            super.startDecode(f,pkts,stride,index,packetLength);
+            return;
+        }
+        if (index.length != k) {
+            throw new IllegalArgumentException("Must be exactly k "+
+                                               "index entries.");
+        }
+        if (packetLength % 2 != 0) {
+            throw new IllegalArgumentException("For 16 bit codes, buffers "+
+                                               "must be 16 bit aligned.");
+        }
+        Native16Code[] codes = new Native16Code[] {this};
+        ByteBuffer[] bufs = new ByteBuffer[] {pkts};
+        f.refs = new Object[] {codes,bufs};
+        f.index = new int[][] {index};
+        synchronized (jobs) {
+            long h = nativeSubmitDecode
+                (codes,bufs,new int[] {pkts.position()},new int[] {stride},
+                 f.index,new int[] {packetLength});
+            jobs.put(new Long(h),f);
+            startReaper();
+        }
+    }
+
+    /**
+     * Completes the jobs the native library has finished.  Started with
+     * the first job, called with jobs locked.
+     */
+    private static void startReaper() {
+        if (reaper != null) {
+            return;
+        }
+        reaper = new Thread("Native16Code reaper") {
+                public void run() {
+                    while (true) {
+                        long h = nativeReap();
+                        FECFuture f;
+                        synchronized (jobs) {
+                            f = (FECFuture) jobs.remove(new Long(h));
+                        }
+                        Throwable t = null;
+                        try {
+                            nativeFinish(h,f.index);
+                        } catch (Throwable e) {
+                            t = e;
+                        }
+                        f.complete(t);
+                    }
+                }
+            };
+        reaper.setDaemon(true);
+        reaper.start();
+    }
+
+    /**
+     * Sets the number of threads, including the calling one, that a single
+     * encode or decode (or batch) of a Native16Code may use.  The native
+     * library keeps a pool of worker threads for large calls; 1, the
+     * default, does everything in the calling thread.  Returns the number
+     * actually set, at least 1 and at most 64.
+     */
+    public static int setThreads(int n) {
+        return nativeSetThreads(n);
+    }
+
     protected native void nativeEncode
         (byte[][] src, int[] srcOff, int[] index, byte[][] repair,
          int[] repairOff, int k, int packetLength);
@@ -66,6 +439,67 @@ public class Native16Code extends FECCode {
     protected native void nativeDecode(byte[][] pkts, int[] pktsOff,
                                        int[] index, int k, int packetLength);
 
+    protected native void nativeDecodeInPlace(byte[][] pkts, int[] pktsOff,
+                                              int[] index, int k,
+                                              int packetLength);
+
+    protected native void nativeEncodeDirect
+        (ByteBuffer[] src, int[] srcOff, int[] index, ByteBuffer[] repair,
+         int[] repairOff, int k, int packetLength);
+
+    protected native void nativeEncodeSegment
+        (ByteBuffer src, int srcOff, int srcStride, int[] index,
+         ByteBuffer repair, int repairOff, int repairStride, int k,
+         int packetLength);
+
+    protected native void nativeDecodeDirect(ByteBuffer[] pkts, int[] pktsOff,
+                                             int[] index, int k,
+                                             int packetLength);
+
+    protected native void nativeDecodeSegment(ByteBuffer pkts, int pktsOff,
+                                              int stride, int[] index, int k,
+                                              int packetLength);
+
+    protected static native void nativeEncodeBatch
+        (Native16Code[] codes, ByteBuffer[] src, int[] srcOff, int[] srcStride,
+         int[][] index, ByteBuffer[] repair, int[] repairOff,
+         int[] repairStride, int[] packetLength);
+
+    protected static native void nativeDecodeBatch
+        (Native16Code[] codes, ByteBuffer[] pkts, int[] pktsOff, int[] stride,
+         int[][] index, int[] packetLength);
+
+    protected static native int nativeSetThreads(int n);
+
+    protected static native long nativeSubmitEncode
+        (Native16Code[] codes, ByteBuffer[] src, int[] srcOff, int[] srcStride,
+         int[][] index, ByteBuffer[] repair, int[] repairOff,
+         int[] repairStride, int[] packetLength);
+
+    protected static native long nativeSubmitDecode
+        (Native16Code[] codes, ByteBuffer[] pkts, int[] pktsOff, int[] stride,
+         int[][] index, int[] packetLength);
+
+    protected static native long nativeReap();
+
+    protected static native void nativeFinish(long handle, int[][] index);
+
+    private native long nativeNewDecoder(int packetLength);
+
+    private static native int nativeDecoderAdd(long dec, byte[] pkt,
+                                               int pktOff, int index);
+
+    private static native void nativeDecoderFinish(long dec, byte[][] dst,
+                                                   int[] dstOff);
+
+    private native long nativeNewEncoder(int[] index, int packetLength);
+
+    private static native void nativeEncoderAdd(long enc, byte[] src,
+                                                int srcOff, int i);
+
+    private static native void nativeEncoderFinish(long enc, byte[][] repair,
+                                                   int[] repairOff);
+
     protected synchronized native long nativeNewFEC(int k, int n);
 
     protected synchronized native void nativeFreeFEC();
@@ -0,0 +1,197 @@
+#include <string.h>
+#include <jni.h>
+#include <stdio.h>
+#include <stdlib.h>
+#if defined(__GNUC__) || !defined(_WIN32)
+#include <stdint.h>
+#endif
+
+#include "com_onionnetworks_fec_CauchyCode.h"
+#include "cauchy.h"
+
+/*
+** JNI methods of com.onionnetworks.fec.CauchyCode, linked into libfec8
+** next to those of Native8Code. The handle of the code is passed in by
+** the (private) native methods rather than read from a field.
+*/
+
+#define CAUCHY_METHOD(NAME) Java_com_onionnetworks_fec_CauchyCode_ ## NAME
+
+static void
+throw_cauchy_error(JNIEnv *env, int err)
+{
+    if (err == CAUCHY_ENOMEM)
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/OutOfMemoryError"), "cauchy: out of memory");
+    else if (err != 0)
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"), "cauchy: bad index, packets or length");
+}
+
+/*
+** Fetch the references of the num packets of arr. Returns 0, or -1 with
+** an exception pending; a null packet throws NullPointerException. Every
+** reference is fetched before anything is pinned, since no JNI call is
+** allowed once in a critical.
+*/
+static int
+fetch_packets(JNIEnv *env, jobjectArray arr, int num, jbyteArray *ref)
+{
+    int i;
+
+    for (i=0; i<num; i++) {
+        ref[i] = (*env)->GetObjectArrayElement(env, arr, i);
+        if (ref[i] == NULL) {
+            if (!(*env)->ExceptionCheck(env))
+                (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/NullPointerException"), "null packet");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+** Pin num packets fetched by fetch_packets, each at its offset. Returns
+** the number pinned; less than num if an exception is pending.
+*/
+static int
+pin_packets(JNIEnv *env, jint *off, int num, jbyteArray *ref,
+    unsigned char **pkt)
+{
+    int i;
+
+    for (i=0; i<num; i++) {
+        pkt[i] = (*env)->GetPrimitiveArrayCritical(env, ref[i], 0);
+        if (pkt[i] == NULL)
+            break;
+        pkt[i] += off[i];
+    }
+    return i;
+}
+
+static void
+unpin_packets(JNIEnv *env, jint *off, int num, jbyteArray *ref,
+    unsigned char **pkt)
+{
+    int i;
+
+    for (i=0; i<num; i++)
+        (*env)->ReleasePrimitiveArrayCritical(env, ref[i], pkt[i] - off[i], 0);
+}
+
+JNIEXPORT jlong JNICALL CAUCHY_METHOD(nativeNewCode)
+  (JNIEnv *env, jclass clz, jint k, jint n) {
+    struct cauchy_code *c = cauchy_new(k, n);
+
+    if (c == NULL)
+        throw_cauchy_error(env, k < 1 || k > n || n > (1 << CAUCHY_W) ?
+            CAUCHY_EINVAL : CAUCHY_ENOMEM);
+    return (jlong)(uintptr_t)c;
+}
+
+JNIEXPORT void JNICALL CAUCHY_METHOD(nativeFreeCode)
+  (JNIEnv *env, jclass clz, jlong code) {
+    cauchy_free((struct cauchy_code *)(uintptr_t)code);
+}
+
+/*
+** Encode the packets listed in index into ret. packetLength must be a
+** multiple of 8; CauchyCode rejects other lengths.
+*/
+JNIEXPORT void JNICALL CAUCHY_METHOD(nativeEncode)
+  (JNIEnv *env, jclass clz, jlong code, jobjectArray src, jintArray srcOff,
+    jintArray index, jobjectArray ret, jintArray retOff, jint k,
+    jint packetLength) {
+
+    jint *localSrcOff = NULL, *localIndex = NULL, *localRetOff = NULL;
+    jbyteArray *inArr = NULL, *retArr = NULL;
+    unsigned char **inarr = NULL, **retarr = NULL;
+    int numRet, nin = 0, nret = 0, err = 0;
+
+    numRet = (*env)->GetArrayLength(env, ret);
+
+    inArr = malloc(sizeof(jbyteArray) * k);
+    retArr = malloc(sizeof(jbyteArray) * numRet);
+    inarr = malloc(sizeof(unsigned char *) * k);
+    retarr = malloc(sizeof(unsigned char *) * numRet);
+    localSrcOff = malloc(sizeof(jint) * k);
+    localIndex = malloc(sizeof(jint) * numRet);
+    localRetOff = malloc(sizeof(jint) * numRet);
+    if (!inArr || !retArr || !inarr || !retarr || !localSrcOff ||
+        !localIndex || !localRetOff) {
+        err = CAUCHY_ENOMEM;
+        goto nativeEncode_cleanup;
+    }
+
+    /* copied, not pinned: no JNI calls are allowed once in a critical */
+    (*env)->GetIntArrayRegion(env, srcOff, 0, k, localSrcOff);
+    (*env)->GetIntArrayRegion(env, index, 0, numRet, localIndex);
+    (*env)->GetIntArrayRegion(env, retOff, 0, numRet, localRetOff);
+    if ((*env)->ExceptionCheck(env))
+        goto nativeEncode_cleanup;
+
+    if ((*env)->PushLocalFrame(env, k + numRet) < 0)
+        goto nativeEncode_cleanup;
+    if (fetch_packets(env, src, k, inArr) == 0 &&
+        fetch_packets(env, ret, numRet, retArr) == 0) {
+        nin = pin_packets(env, localSrcOff, k, inArr, inarr);
+        if (nin == k)
+            nret = pin_packets(env, localRetOff, numRet, retArr, retarr);
+        if (nin == k && nret == numRet)
+            err = cauchy_encode((struct cauchy_code *)(uintptr_t)code, inarr,
+                retarr, (int *)localIndex, numRet, (int)packetLength);
+        unpin_packets(env, localRetOff, nret, retArr, retarr);
+        unpin_packets(env, localSrcOff, nin, inArr, inarr);
+    }
+    (*env)->PopLocalFrame(env, NULL);
+
+    nativeEncode_cleanup:
+    free(localRetOff); free(localIndex); free(localSrcOff);
+    free(retarr); free(inarr); free(retArr); free(inArr);
+    throw_cauchy_error(env, err);
+}
+
+/*
+** The packets must be shuffled (see FECCode.shuffle) before the call,
+** the k received packets are replaced by the source packets in place.
+*/
+JNIEXPORT void JNICALL CAUCHY_METHOD(nativeDecode)
+  (JNIEnv *env, jclass clz, jlong code, jobjectArray data, jintArray dataOff,
+    jintArray whichdata, jint k, jint packetLength) {
+
+    jint *localDataOff = NULL, *localWhich = NULL;
+    jbyteArray *inArr = NULL;
+    unsigned char **inarr = NULL;
+    int nin = 0, err = 0;
+
+    inArr = malloc(sizeof(jbyteArray) * k);
+    inarr = malloc(sizeof(unsigned char *) * 2 * k);
+    localDataOff = malloc(sizeof(jint) * k);
+    localWhich = malloc(sizeof(jint) * k);
+    if (!inArr || !inarr || !localDataOff || !localWhich) {
+        err = CAUCHY_ENOMEM;
+        goto nativeDecode_cleanup;
+    }
+
+    (*env)->GetIntArrayRegion(env, dataOff, 0, k, localDataOff);
+    (*env)->GetIntArrayRegion(env, whichdata, 0, k, localWhich);
+    if ((*env)->ExceptionCheck(env))
+        goto nativeDecode_cleanup;
+
+    if ((*env)->PushLocalFrame(env, k) < 0)
+        goto nativeDecode_cleanup;
+    if (fetch_packets(env, data, k, inArr) == 0) {
+        /* decode swaps the pointers if the packets were not shuffled */
+        nin = pin_packets(env, localDataOff, k, inArr, inarr + k);
+        memcpy(inarr, inarr + k, sizeof(unsigned char *) * nin);
+        if (nin == k)
+            err = cauchy_decode((struct cauchy_code *)(uintptr_t)code, inarr,
+                (int *)localWhich, (int)packetLength);
+        unpin_packets(env, localDataOff, nin, inArr, inarr + k);
+        if (err == 0 && nin == k)
+            (*env)->SetIntArrayRegion(env, whichdata, 0, k, localWhich);
+    }
+    (*env)->PopLocalFrame(env, NULL);
+
+    nativeDecode_cleanup:
+    free(localWhich); free(localDataOff); free(inarr); free(inArr);
+    throw_cauchy_error(env, err);
+}
@@ -0,0 +1,569 @@
+/*
+ * cauchy.c -- Cauchy Reed-Solomon erasure code on a GF(2) bit matrix
+ *
+ * The n-k parity rows of the generator are a Cauchy matrix over
+ * GF(2^8), C[i][j] = 1 / (x_i + y_j) with all the x_i, y_j distinct,
+ * so that every square submatrix is invertible and any k packets
+ * rebuild the source (Blomer et al., "An XOR-based erasure-resilient
+ * coding scheme", 1995). Multiplying by a field element e is a linear
+ * map on the 8 bits of a symbol, an 8x8 bit matrix whose column c is
+ * e * x^c. Splitting every packet in 8 sub-packets, sub-packet c
+ * holding bit c of all its symbols, the product becomes: output
+ * sub-packet r is the XOR of the input sub-packets c where bit (r, c)
+ * is set. A whole row is then a set of XORs of sub-packets, run a word
+ * at a time.
+ *
+ * The cost is the number of ones in the bit matrix, so the matrix is
+ * chosen to have few (Plank and Xu, "Optimizing Cauchy Reed-Solomon
+ * codes", 2006): the columns are scaled so that the first parity row
+ * is all ones (an identity block each, just XORs), and every other row
+ * by whichever of its elements leaves it the fewest ones. Scaling rows
+ * and columns keeps every square submatrix invertible.
+ *
+ * The XORs of a row are then scheduled: each of its 8 output
+ * sub-packets is computed either from the inputs, or from an output
+ * sub-packet already computed plus the inputs where their bit rows
+ * differ, whichever takes fewer XORs, cheapest first (the "smart"
+ * schedule of Plank's jerasure). Schedules of the parity rows are made
+ * once by cauchy_new, those of the decode rows by each decode.
+ *
+ * Encode and decode go through the packets in strips, so that the
+ * outputs stay in the cache while the inputs stream past, as in fec.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__GNUC__) || !defined(_WIN32)
+#include <stdint.h>
+#else
+typedef unsigned __int64 uint64_t;
+#endif
+
+#include "cauchy.h"
+
+#define W		CAUCHY_W
+#define GF_POLY		0x11d		/* x^8+x^4+x^3+x^2+1, as fec.c */
+#define CB_TILE_BYTES	(256*1024)	/* outputs kept in the cache */
+#define CB_MIN_STRIP	256		/* bytes of each sub-packet */
+
+/*
+ * One scheduled XOR: sub-packet dst of the output row gets (or is
+ * XORed with, CB_XOR) sub-packet src of the inputs, or of the output
+ * row itself with CB_OUT.
+ */
+#define CB_XOR	1
+#define CB_OUT	2
+struct cb_op {
+    int dst, src ;
+    int flags ;
+} ;
+
+struct cb_sched {
+    struct cb_op *op ;
+    int nops ;
+} ;
+
+struct cauchy_code {
+    int k, n ;
+    unsigned char *mat ;		/* (n-k) x k parity rows */
+    struct cb_sched *sched ;		/* one per parity row */
+    unsigned char exp[2*255] ;
+    unsigned char log[256] ;
+} ;
+
+static int
+gf_mul(struct cauchy_code *c, int a, int b)
+{
+    if (a == 0 || b == 0)
+	return 0 ;
+    return c->exp[c->log[a] + c->log[b]] ;
+}
+
+static int
+gf_inv(struct cauchy_code *c, int a)
+{
+    return c->exp[255 - c->log[a]] ;
+}
+
+/*
+ * bit rows: one bit per input sub-packet, k*W of them, in 64 bit words
+ */
+#define ROW_WORDS(k)	(((k) * W + 63) / 64)
+
+static int
+popcount64(uint64_t x)
+{
+    int n = 0 ;
+
+    while (x) {
+	x &= x - 1 ;
+	n++ ;
+    }
+    return n ;
+}
+
+static int
+row_ones(const uint64_t *a, int nw)
+{
+    int i, n = 0 ;
+
+    for (i = 0 ; i < nw ; i++)
+	n += popcount64(a[i]) ;
+    return n ;
+}
+
+static int
+row_dist(const uint64_t *a, const uint64_t *b, int nw)
+{
+    int i, n = 0 ;
+
+    for (i = 0 ; i < nw ; i++)
+	n += popcount64(a[i] ^ b[i]) ;
+    return n ;
+}
+
+/*
+ * expand a row of k field elements into its W bit rows
+ */
+static void
+expand_row(struct cauchy_code *c, const unsigned char *e, int k,
+    uint64_t *rows)
+{
+    int nw = ROW_WORDS(k), j, b, r, v ;
+
+    memset(rows, 0, W * nw * sizeof(uint64_t));
+    for (j = 0 ; j < k ; j++)
+	for (b = 0 ; b < W ; b++) {
+	    v = gf_mul(c, e[j], 1 << b) ;	/* column b of the block */
+	    for (r = 0 ; r < W ; r++)
+		if (v & (1 << r))
+		    rows[r * nw + (j * W + b) / 64] |=
+			(uint64_t)1 << ((j * W + b) % 64) ;
+	}
+}
+
+/*
+ * ones in the bit matrix of a row of k elements
+ */
+static int
+ones_of_row(struct cauchy_code *c, const unsigned char *e, int k)
+{
+    int j, b, n = 0 ;
+
+    for (j = 0 ; j < k ; j++)
+	for (b = 0 ; b < W ; b++)
+	    n += popcount64(gf_mul(c, e[j], 1 << b)) ;
+    return n ;
+}
+
+/*
+ * make_sched computes the smart schedule of the W bit rows in rows.
+ * Returns 0 or CAUCHY_ENOMEM.
+ */
+static int
+make_sched(const uint64_t *rows, int k, struct cb_sched *s)
+{
+    int nw = ROW_WORDS(k), cost[W], from[W], done[W] ;
+    int r, i, b, best, n, nops = 0 ;
+
+    s->op = NULL ;
+    s->nops = 0 ;
+    for (r = 0 ; r < W ; r++) {
+	cost[r] = row_ones(rows + r * nw, nw) ;
+	from[r] = -1 ;
+	done[r] = 0 ;
+	nops += cost[r] ;
+    }
+    s->op = malloc((nops + W) * sizeof(struct cb_op)) ;
+    if (s->op == NULL)
+	return CAUCHY_ENOMEM ;
+    for (n = 0 ; n < W ; n++) {
+	best = -1 ;
+	for (r = 0 ; r < W ; r++)
+	    if (!done[r] && (best < 0 || cost[r] < cost[best]))
+		best = r ;
+	done[best] = 1 ;
+	if (from[best] >= 0) {
+	    struct cb_op *op = &s->op[s->nops++] ;
+	    const uint64_t *a = rows + best * nw, *o = rows + from[best] * nw ;
+
+	    op->dst = best ;
+	    op->src = from[best] ;
+	    op->flags = CB_OUT ;
+	    for (b = 0 ; b < k * W ; b++)
+		if ((a[b / 64] ^ o[b / 64]) >> (b % 64) & 1) {
+		    op = &s->op[s->nops++] ;
+		    op->dst = best ;
+		    op->src = b ;
+		    op->flags = CB_XOR ;
+		}
+	} else {
+	    const uint64_t *a = rows + best * nw ;
+	    int first = 1 ;
+
+	    for (b = 0 ; b < k * W ; b++)
+		if (a[b / 64] >> (b % 64) & 1) {
+		    struct cb_op *op = &s->op[s->nops++] ;
+
+		    op->dst = best ;
+		    op->src = b ;
+		    op->flags = first ? 0 : CB_XOR ;
+		    first = 0 ;
+		}
+	    if (first) {			/* all zero, cannot happen */
+		struct cb_op *op = &s->op[s->nops++] ;
+
+		op->dst = best ;
+		op->src = -1 ;
+		op->flags = 0 ;
+	    }
+	}
+	/* the others may now start from this one */
+	for (i = 0 ; i < W ; i++)
+	    if (!done[i]) {
+		int d = 1 + row_dist(rows + i * nw, rows + best * nw, nw) ;
+
+		if (d < cost[i]) {
+		    cost[i] = d ;
+		    from[i] = best ;
+		}
+	    }
+    }
+    return 0 ;
+}
+
+void
+cauchy_free(struct cauchy_code *c)
+{
+    int i ;
+
+    if (c == NULL)
+	return ;
+    if (c->sched != NULL)
+	for (i = 0 ; i < c->n - c->k ; i++)
+	    free(c->sched[i].op);
+    free(c->sched);
+    free(c->mat);
+    free(c);
+}
+
+/*
+ * cauchy_new returns a code for k source and n-k parity packets, or
+ * NULL if 1 <= k <= n <= 256 does not hold or memory ran out.
+ */
+struct cauchy_code *
+cauchy_new(int k, int n)
+{
+    struct cauchy_code *c ;
+    uint64_t *rows = NULL ;
+    unsigned char *row, best_e = 1 ;
+    int m = n - k, i, j, x, best, ones ;
+
+    if (k < 1 || n < k || n > (1 << W)) {
+	fprintf(stderr, "Invalid parameters k %d n %d\n", k, n);
+	return NULL ;
+    }
+    if ((c = calloc(1, sizeof(*c))) == NULL)
+	return NULL ;
+    c->k = k ;
+    c->n = n ;
+    for (i = 0, x = 1 ; i < 255 ; i++) {
+	c->exp[i] = c->exp[i + 255] = x ;
+	c->log[x] = i ;
+	x <<= 1 ;
+	if (x & 0x100)
+	    x ^= GF_POLY ;
+    }
+    c->mat = malloc(m * k + 1) ;
+    c->sched = calloc(m + 1, sizeof(struct cb_sched)) ;
+    rows = malloc(W * ROW_WORDS(k) * sizeof(uint64_t)) ;
+    if (c->mat == NULL || c->sched == NULL || rows == NULL)
+	goto nomem ;
+
+    /* x_i = i, y_j = m + j */
+    for (i = 0 ; i < m ; i++)
+	for (j = 0 ; j < k ; j++)
+	    c->mat[i * k + j] = gf_inv(c, i ^ (m + j)) ;
+    if (m > 0)				/* first row all ones */
+	for (j = 0 ; j < k ; j++) {
+	    int s = gf_inv(c, c->mat[j]) ;
+
+	    for (i = 0 ; i < m ; i++)
+		c->mat[i * k + j] = gf_mul(c, c->mat[i * k + j], s) ;
+	}
+    for (i = 1 ; i < m ; i++) {		/* the other rows, fewest ones */
+	row = c->mat + i * k ;
+	best = ones_of_row(c, row, k) ;
+	for (j = 0 ; j < k ; j++) {
+	    unsigned char tmp[1 << W] ;
+	    int s = gf_inv(c, row[j]), t ;
+
+	    for (t = 0 ; t < k ; t++)
+		tmp[t] = gf_mul(c, row[t], s) ;
+	    ones = ones_of_row(c, tmp, k) ;
+	    if (ones < best) {
+		best = ones ;
+		best_e = s ;
+	    }
+	}
+	if (best_e != 1)
+	    for (j = 0 ; j < k ; j++)
+		row[j] = gf_mul(c, row[j], best_e) ;
+	best_e = 1 ;
+    }
+    for (i = 0 ; i < m ; i++) {
+	expand_row(c, c->mat + i * k, k, rows);
+	if (make_sched(rows, k, &c->sched[i]))
+	    goto nomem ;
+    }
+    free(rows);
+    return c ;
+
+nomem:
+    free(rows);
+    cauchy_free(c);
+    return NULL ;
+}
+
+/*
+ * XOR (or copy) len bytes, a word at a time when both are aligned
+ */
+static void
+xor_bytes(unsigned char *d, const unsigned char *s, int len, int xor)
+{
+    int i = 0 ;
+
+    if (!xor) {
+	memcpy(d, s, len);
+	return ;
+    }
+    if ((((size_t)d | (size_t)s) & 7) == 0) {
+	uint64_t *dw = (uint64_t *)d ;
+	const uint64_t *sw = (const uint64_t *)s ;
+
+	for ( ; i + 32 <= len ; i += 32, dw += 4, sw += 4) {
+	    dw[0] ^= sw[0] ; dw[1] ^= sw[1] ;
+	    dw[2] ^= sw[2] ; dw[3] ^= sw[3] ;
+	}
+	for ( ; i + 8 <= len ; i += 8)
+	    *dw++ ^= *sw++ ;
+    }
+    for ( ; i < len ; i++)
+	d[i] ^= s[i] ;
+}
+
+/*
+ * run_sched computes bytes [off, off+len) of the sub-packets of one
+ * output row, at out with sub-packets ostride bytes apart, from the
+ * inputs in[], whose sub-packets are ssz bytes apart.
+ */
+static void
+run_sched(struct cb_sched *s, unsigned char *in[], int ssz,
+    unsigned char *out, int ostride, int off, int len)
+{
+    struct cb_op *op = s->op, *end = s->op + s->nops ;
+    const unsigned char *src ;
+
+    for ( ; op < end ; op++) {
+	if (op->src < 0) {
+	    memset(out + op->dst * ostride, 0, len);
+	    continue ;
+	}
+	if (op->flags & CB_OUT)
+	    src = out + op->src * ostride ;
+	else
+	    src = in[op->src / W] + (op->src % W) * ssz + off ;
+	xor_bytes(out + op->dst * ostride, src, len, op->flags & CB_XOR);
+    }
+}
+
+static int
+strip_len(int nrows, int ssz)
+{
+    int strip = CB_TILE_BYTES / ((nrows + 1) * W) ;
+
+    if (strip < CB_MIN_STRIP)
+	strip = CB_MIN_STRIP ;
+    strip &= ~63 ;
+    return strip < ssz ? strip : ssz ;
+}
+
+/*
+ * cauchy_encode puts in out[j] the packet with index index[j], for
+ * nout of them. Returns 0 or CAUCHY_EINVAL.
+ */
+int
+cauchy_encode(struct cauchy_code *c, unsigned char *src[],
+    unsigned char *out[], int index[], int nout, int sz)
+{
+    int j, off, len, strip, ssz = sz / W ;
+
+    if (sz % W)
+	return CAUCHY_EINVAL ;
+    for (j = 0 ; j < nout ; j++)
+	if (index[j] < 0 || index[j] >= c->n) {
+	    fprintf(stderr, "Invalid index %d (max %d)\n",
+		index[j], c->n - 1);
+	    return CAUCHY_EINVAL ;
+	}
+    strip = strip_len(nout, ssz) ;
+    for (off = 0 ; off < ssz ; off += strip) {
+	len = ssz - off < strip ? ssz - off : strip ;
+	for (j = 0 ; j < nout ; j++) {
+	    if (index[j] < c->k)
+		continue ;
+	    run_sched(&c->sched[index[j] - c->k], src, ssz, out[j] + off,
+		ssz, off, len);
+	}
+    }
+    for (j = 0 ; j < nout ; j++)
+	if (index[j] < c->k)
+	    memcpy(out[j], src[index[j]], sz);
+    return 0 ;
+}
+
+/*
+ * invert the k x k matrix a in place, Gauss-Jordan. Returns 0, or
+ * CAUCHY_EINVAL if it is singular.
+ */
+static int
+invert(struct cauchy_code *c, unsigned char *a, unsigned char *b, int k)
+{
+    int i, j, r, p, f ;
+
+    memset(b, 0, k * k);
+    for (i = 0 ; i < k ; i++)
+	b[i * k + i] = 1 ;
+    for (i = 0 ; i < k ; i++) {
+	for (p = i ; p < k && a[p * k + i] == 0 ; p++)
+	    ;
+	if (p == k)
+	    return CAUCHY_EINVAL ;
+	if (p != i)
+	    for (j = 0 ; j < k ; j++) {
+		unsigned char t = a[i * k + j] ;
+
+		a[i * k + j] = a[p * k + j] ; a[p * k + j] = t ;
+		t = b[i * k + j] ; b[i * k + j] = b[p * k + j] ;
+		b[p * k + j] = t ;
+	    }
+	f = gf_inv(c, a[i * k + i]) ;
+	for (j = 0 ; j < k ; j++) {
+	    a[i * k + j] = gf_mul(c, a[i * k + j], f) ;
+	    b[i * k + j] = gf_mul(c, b[i * k + j], f) ;
+	}
+	for (r = 0 ; r < k ; r++) {
+	    if (r == i || (f = a[r * k + i]) == 0)
+		continue ;
+	    for (j = 0 ; j < k ; j++) {
+		a[r * k + j] ^= gf_mul(c, a[i * k + j], f) ;
+		b[r * k + j] ^= gf_mul(c, b[i * k + j], f) ;
+	    }
+	}
+    }
+    memcpy(a, b, k * k);
+    return 0 ;
+}
+
+/*
+ * cauchy_decode rebuilds the source packets in place from any k
+ * packets, as fec_decode: pkt[] and index[] are shuffled so that
+ * source packets are in their position, and the missing ones are
+ * written over the parity packets left in their place. Returns 0,
+ * CAUCHY_EINVAL for bad or duplicate indexes or sizes, CAUCHY_ENOMEM.
+ */
+int
+cauchy_decode(struct cauchy_code *c, unsigned char *pkt[], int index[],
+    int sz)
+{
+    int k = c->k, nw = ROW_WORDS(k), ssz = sz / W ;
+    int i, j, r, nmiss = 0, err = CAUCHY_ENOMEM, off, len, strip ;
+    int *miss = NULL ;
+    unsigned char *a = NULL, *b = NULL, *tmp = NULL, *t ;
+    uint64_t *rows = NULL ;
+    struct cb_sched *sched = NULL ;
+
+    if (sz % W)
+	return CAUCHY_EINVAL ;
+    for (i = 0 ; i < k ; i++)
+	if (index[i] < 0 || index[i] >= c->n)
+	    return CAUCHY_EINVAL ;
+    for (i = 0 ; i < k ; ) {		/* shuffle, as fec.c */
+	int x = index[i] ;
+
+	if (x >= k || x == i) {
+	    i++ ;
+	    continue ;
+	}
+	if (index[x] == x)
+	    return CAUCHY_EINVAL ;
+	index[i] = index[x] ; index[x] = x ;
+	t = pkt[i] ; pkt[i] = pkt[x] ; pkt[x] = t ;
+    }
+    for (i = 0 ; i < k ; i++)
+	if (index[i] >= k)
+	    nmiss++ ;
+    if (nmiss == 0)
+	return 0 ;
+
+    miss = malloc(nmiss * sizeof(int)) ;
+    a = malloc(2 * k * k) ;
+    sched = calloc(nmiss, sizeof(struct cb_sched)) ;
+    rows = malloc(W * nw * sizeof(uint64_t)) ;
+    if (miss == NULL || a == NULL || sched == NULL || rows == NULL)
+	goto done ;
+    b = a + k * k ;
+    /* the rows of the generator for the packets we have */
+    for (i = 0, nmiss = 0 ; i < k ; i++) {
+	if (index[i] < k) {
+	    memset(a + i * k, 0, k);
+	    a[i * k + i] = 1 ;
+	} else {
+	    memcpy(a + i * k, c->mat + (index[i] - k) * k, k);
+	    miss[nmiss++] = i ;
+	}
+    }
+    if ((err = invert(c, a, b, k)) != 0)
+	goto done ;
+    err = CAUCHY_ENOMEM ;
+    for (i = 0 ; i < nmiss ; i++) {
+	expand_row(c, a + miss[i] * k, k, rows);
+	if (make_sched(rows, k, &sched[i]))
+	    goto done ;
+    }
+    /*
+     * the missing rows go to a temporary strip first, since their
+     * packets are inputs until the whole strip is done.
+     */
+    strip = strip_len(nmiss, ssz) ;
+    tmp = malloc(nmiss * W * (strip > 0 ? strip : 1)) ;
+    if (tmp == NULL)
+	goto done ;
+    for (off = 0 ; off < ssz ; off += strip) {
+	len = ssz - off < strip ? ssz - off : strip ;
+	for (i = 0 ; i < nmiss ; i++)
+	    run_sched(&sched[i], pkt, ssz, tmp + i * W * strip, strip, off,
+		len);
+	for (i = 0 ; i < nmiss ; i++)
+	    for (r = 0 ; r < W ; r++)
+		memcpy(pkt[miss[i]] + r * ssz + off,
+		    tmp + (i * W + r) * strip, len);
+    }
+    for (i = 0 ; i < nmiss ; i++)
+	index[miss[i]] = miss[i] ;
+    err = 0 ;
+
+done:
+    if (sched != NULL)
+	for (j = 0 ; j < nmiss ; j++)
+	    free(sched[j].op);
+    free(sched);
+    free(rows);
+    free(tmp);
+    free(a);
+    free(miss);
+    return err ;
+}
+
+/* end of file */
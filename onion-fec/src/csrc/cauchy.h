@@ -0,0 +1,28 @@
+/*
+ * cauchy.h -- Cauchy Reed-Solomon erasure code on a GF(2) bit matrix
+ *
+ * Same use as fec.h: k source packets, n encoded ones of which the first
+ * k are the source packets, any k of the n rebuild the source. Encoding
+ * and decoding are XORs of whole words, no multiplications, so this
+ * code does not need pshufb to be fast. Packets are split in 8
+ * sub-packets, so their size must be a multiple of 8 bytes.
+ */
+
+#pragma once
+
+#define CAUCHY_W	8	/* bits per symbol, n <= 2^CAUCHY_W */
+
+/* errors, the same values as in fec.h */
+#define CAUCHY_EINVAL	1	/* bad parameters, indexes or sizes */
+#define CAUCHY_ENOMEM	2	/* out of memory */
+
+struct cauchy_code ;
+
+struct cauchy_code *cauchy_new(int k, int n);
+void cauchy_free(struct cauchy_code *c);
+int cauchy_encode(struct cauchy_code *c, unsigned char *src[],
+    unsigned char *out[], int index[], int nout, int sz);
+int cauchy_decode(struct cauchy_code *c, unsigned char *pkt[], int index[],
+    int sz);
+
+/* end of file */
@@ -0,0 +1,45 @@
+/* DO NOT EDIT THIS FILE - it is machine generated */
+#include <jni.h>
+/* Header for class com_onionnetworks_fec_CauchyCode */
+
+#ifndef _Included_com_onionnetworks_fec_CauchyCode
+#define _Included_com_onionnetworks_fec_CauchyCode
+#ifdef __cplusplus
+extern "C" {
+#endif
+/*
+ * Class:     com_onionnetworks_fec_CauchyCode
+ * Method:    nativeEncode
+ * Signature: (J[[B[I[I[[B[III)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_CauchyCode_nativeEncode
+  (JNIEnv *, jclass, jlong, jobjectArray, jintArray, jintArray, jobjectArray, jintArray, jint, jint);
+
+/*
+ * Class:     com_onionnetworks_fec_CauchyCode
+ * Method:    nativeDecode
+ * Signature: (J[[B[I[III)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_CauchyCode_nativeDecode
+  (JNIEnv *, jclass, jlong, jobjectArray, jintArray, jintArray, jint, jint);
+
+/*
+ * Class:     com_onionnetworks_fec_CauchyCode
+ * Method:    nativeNewCode
+ * Signature: (II)J
+ */
+JNIEXPORT jlong JNICALL Java_com_onionnetworks_fec_CauchyCode_nativeNewCode
+  (JNIEnv *, jclass, jint, jint);
+
+/*
+ * Class:     com_onionnetworks_fec_CauchyCode
+ * Method:    nativeFreeCode
+ * Signature: (J)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_CauchyCode_nativeFreeCode
+  (JNIEnv *, jclass, jlong);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -23,6 +23,150 @@ JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native16Code_nativeEncode
 JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native16Code_nativeDecode
   (JNIEnv *, jobject, jobjectArray, jintArray, jintArray, jint, jint);
 
+/*
+ * Class:     com_onionnetworks_fec_Native16Code
+ * Method:    nativeEncodeDirect
+ * Signature: ([Ljava/nio/ByteBuffer;[I[I[Ljava/nio/ByteBuffer;[III)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native16Code_nativeEncodeDirect
+  (JNIEnv *, jobject, jobjectArray, jintArray, jintArray, jobjectArray, jintArray, jint, jint);
+
+/*
+ * Class:     com_onionnetworks_fec_Native16Code
+ * Method:    nativeEncodeSegment
+ * Signature: (Ljava/nio/ByteBuffer;II[ILjava/nio/ByteBuffer;IIII)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native16Code_nativeEncodeSegment
+  (JNIEnv *, jobject, jobject, jint, jint, jintArray, jobject, jint, jint, jint, jint);
+
+/*
+ * Class:     com_onionnetworks_fec_Native16Code
+ * Method:    nativeDecodeDirect
+ * Signature: ([Ljava/nio/ByteBuffer;[I[III)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native16Code_nativeDecodeDirect
+  (JNIEnv *, jobject, jobjectArray, jintArray, jintArray, jint, jint);
+
+/*
+ * Class:     com_onionnetworks_fec_Native16Code
+ * Method:    nativeDecodeSegment
+ * Signature: (Ljava/nio/ByteBuffer;II[III)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native16Code_nativeDecodeSegment
+  (JNIEnv *, jobject, jobject, jint, jint, jintArray, jint, jint);
+
+/*
+ * Class:     com_onionnetworks_fec_Native16Code
+ * Method:    nativeEncodeBatch
+ * Signature: ([Lcom/onionnetworks/fec/Native16Code;[Ljava/nio/ByteBuffer;[I[I[[I[Ljava/nio/ByteBuffer;[I[I[I)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native16Code_nativeEncodeBatch
+  (JNIEnv *, jclass, jobjectArray, jobjectArray, jintArray, jintArray, jobjectArray, jobjectArray, jintArray, jintArray, jintArray);
+
+/*
+ * Class:     com_onionnetworks_fec_Native16Code
+ * Method:    nativeDecodeBatch
+ * Signature: ([Lcom/onionnetworks/fec/Native16Code;[Ljava/nio/ByteBuffer;[I[I[[I[I)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native16Code_nativeDecodeBatch
+  (JNIEnv *, jclass, jobjectArray, jobjectArray, jintArray, jintArray, jobjectArray, jintArray);
+
+/*
+ * Class:     com_onionnetworks_fec_Native16Code
+ * Method:    nativeSetThreads
+ * Signature: (I)I
+ */
+JNIEXPORT jint JNICALL Java_com_onionnetworks_fec_Native16Code_nativeSetThreads
+  (JNIEnv *, jclass, jint);
+
+/*
+ * Class:     com_onionnetworks_fec_Native16Code
+ * Method:    nativeSubmitEncode
+ * Signature: ([Lcom/onionnetworks/fec/Native16Code;[Ljava/nio/ByteBuffer;[I[I[[I[Ljava/nio/ByteBuffer;[I[I[I)J
+ */
+JNIEXPORT jlong JNICALL Java_com_onionnetworks_fec_Native16Code_nativeSubmitEncode
+  (JNIEnv *, jclass, jobjectArray, jobjectArray, jintArray, jintArray, jobjectArray, jobjectArray, jintArray, jintArray, jintArray);
+
+/*
+ * Class:     com_onionnetworks_fec_Native16Code
+ * Method:    nativeSubmitDecode
+ * Signature: ([Lcom/onionnetworks/fec/Native16Code;[Ljava/nio/ByteBuffer;[I[I[[I[I)J
+ */
+JNIEXPORT jlong JNICALL Java_com_onionnetworks_fec_Native16Code_nativeSubmitDecode
+  (JNIEnv *, jclass, jobjectArray, jobjectArray, jintArray, jintArray, jobjectArray, jintArray);
+
+/*
+ * Class:     com_onionnetworks_fec_Native16Code
+ * Method:    nativeReap
+ * Signature: ()J
+ */
+JNIEXPORT jlong JNICALL Java_com_onionnetworks_fec_Native16Code_nativeReap
+  (JNIEnv *, jclass);
+
+/*
+ * Class:     com_onionnetworks_fec_Native16Code
+ * Method:    nativeFinish
+ * Signature: (J[[I)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native16Code_nativeFinish
+  (JNIEnv *, jclass, jlong, jobjectArray);
+
+/*
+ * Class:     com_onionnetworks_fec_Native16Code
+ * Method:    nativeNewEncoder
+ * Signature: ([II)J
+ */
+JNIEXPORT jlong JNICALL Java_com_onionnetworks_fec_Native16Code_nativeNewEncoder
+  (JNIEnv *, jobject, jintArray, jint);
+
+/*
+ * Class:     com_onionnetworks_fec_Native16Code
+ * Method:    nativeEncoderAdd
+ * Signature: (J[BII)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native16Code_nativeEncoderAdd
+  (JNIEnv *, jclass, jlong, jbyteArray, jint, jint);
+
+/*
+ * Class:     com_onionnetworks_fec_Native16Code
+ * Method:    nativeEncoderFinish
+ * Signature: (J[[B[I)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native16Code_nativeEncoderFinish
+  (JNIEnv *, jclass, jlong, jobjectArray, jintArray);
+
+/*
+ * Class:     com_onionnetworks_fec_Native16Code
+ * Method:    nativeNewDecoder
+ * Signature: (I)J
+ */
+JNIEXPORT jlong JNICALL Java_com_onionnetworks_fec_Native16Code_nativeNewDecoder
+  (JNIEnv *, jobject, jint);
+
+/*
+ * Class:     com_onionnetworks_fec_Native16Code
+ * Method:    nativeDecoderAdd
+ * Signature: (J[BII)I
+ */
+JNIEXPORT jint JNICALL Java_com_onionnetworks_fec_Native16Code_nativeDecoderAdd
+  (JNIEnv *, jclass, jlong, jbyteArray, jint, jint);
+
+/*
+ * Class:     com_onionnetworks_fec_Native16Code
+ * Method:    nativeDecoderFinish
+ * Signature: (J[[B[I)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native16Code_nativeDecoderFinish
+  (JNIEnv *, jclass, jlong, jobjectArray, jintArray);
+
+/*
+ * Class:     com_onionnetworks_fec_Native16Code
+ * Method:    nativeDecodeInPlace
+ * Signature: ([[B[I[III)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native16Code_nativeDecodeInPlace
+  (JNIEnv *, jobject, jobjectArray, jintArray, jintArray, jint, jint);
+
 /*
  * Class:     com_onionnetworks_fec_Native16Code
  * Method:    nativeNewFEC
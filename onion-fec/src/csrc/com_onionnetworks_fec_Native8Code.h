@@ -23,6 +23,150 @@ JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native8Code_nativeEncode
 JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native8Code_nativeDecode
   (JNIEnv *, jobject, jobjectArray, jintArray, jintArray, jint, jint);
 
+/*
+ * Class:     com_onionnetworks_fec_Native8Code
+ * Method:    nativeEncodeDirect
+ * Signature: ([Ljava/nio/ByteBuffer;[I[I[Ljava/nio/ByteBuffer;[III)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native8Code_nativeEncodeDirect
+  (JNIEnv *, jobject, jobjectArray, jintArray, jintArray, jobjectArray, jintArray, jint, jint);
+
+/*
+ * Class:     com_onionnetworks_fec_Native8Code
+ * Method:    nativeEncodeSegment
+ * Signature: (Ljava/nio/ByteBuffer;II[ILjava/nio/ByteBuffer;IIII)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native8Code_nativeEncodeSegment
+  (JNIEnv *, jobject, jobject, jint, jint, jintArray, jobject, jint, jint, jint, jint);
+
+/*
+ * Class:     com_onionnetworks_fec_Native8Code
+ * Method:    nativeDecodeDirect
+ * Signature: ([Ljava/nio/ByteBuffer;[I[III)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native8Code_nativeDecodeDirect
+  (JNIEnv *, jobject, jobjectArray, jintArray, jintArray, jint, jint);
+
+/*
+ * Class:     com_onionnetworks_fec_Native8Code
+ * Method:    nativeDecodeSegment
+ * Signature: (Ljava/nio/ByteBuffer;II[III)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native8Code_nativeDecodeSegment
+  (JNIEnv *, jobject, jobject, jint, jint, jintArray, jint, jint);
+
+/*
+ * Class:     com_onionnetworks_fec_Native8Code
+ * Method:    nativeEncodeBatch
+ * Signature: ([Lcom/onionnetworks/fec/Native8Code;[Ljava/nio/ByteBuffer;[I[I[[I[Ljava/nio/ByteBuffer;[I[I[I)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native8Code_nativeEncodeBatch
+  (JNIEnv *, jclass, jobjectArray, jobjectArray, jintArray, jintArray, jobjectArray, jobjectArray, jintArray, jintArray, jintArray);
+
+/*
+ * Class:     com_onionnetworks_fec_Native8Code
+ * Method:    nativeDecodeBatch
+ * Signature: ([Lcom/onionnetworks/fec/Native8Code;[Ljava/nio/ByteBuffer;[I[I[[I[I)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native8Code_nativeDecodeBatch
+  (JNIEnv *, jclass, jobjectArray, jobjectArray, jintArray, jintArray, jobjectArray, jintArray);
+
+/*
+ * Class:     com_onionnetworks_fec_Native8Code
+ * Method:    nativeSetThreads
+ * Signature: (I)I
+ */
+JNIEXPORT jint JNICALL Java_com_onionnetworks_fec_Native8Code_nativeSetThreads
+  (JNIEnv *, jclass, jint);
+
+/*
+ * Class:     com_onionnetworks_fec_Native8Code
+ * Method:    nativeSubmitEncode
+ * Signature: ([Lcom/onionnetworks/fec/Native8Code;[Ljava/nio/ByteBuffer;[I[I[[I[Ljava/nio/ByteBuffer;[I[I[I)J
+ */
+JNIEXPORT jlong JNICALL Java_com_onionnetworks_fec_Native8Code_nativeSubmitEncode
+  (JNIEnv *, jclass, jobjectArray, jobjectArray, jintArray, jintArray, jobjectArray, jobjectArray, jintArray, jintArray, jintArray);
+
+/*
+ * Class:     com_onionnetworks_fec_Native8Code
+ * Method:    nativeSubmitDecode
+ * Signature: ([Lcom/onionnetworks/fec/Native8Code;[Ljava/nio/ByteBuffer;[I[I[[I[I)J
+ */
+JNIEXPORT jlong JNICALL Java_com_onionnetworks_fec_Native8Code_nativeSubmitDecode
+  (JNIEnv *, jclass, jobjectArray, jobjectArray, jintArray, jintArray, jobjectArray, jintArray);
+
+/*
+ * Class:     com_onionnetworks_fec_Native8Code
+ * Method:    nativeReap
+ * Signature: ()J
+ */
+JNIEXPORT jlong JNICALL Java_com_onionnetworks_fec_Native8Code_nativeReap
+  (JNIEnv *, jclass);
+
+/*
+ * Class:     com_onionnetworks_fec_Native8Code
+ * Method:    nativeFinish
+ * Signature: (J[[I)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native8Code_nativeFinish
+  (JNIEnv *, jclass, jlong, jobjectArray);
+
+/*
+ * Class:     com_onionnetworks_fec_Native8Code
+ * Method:    nativeNewEncoder
+ * Signature: ([II)J
+ */
+JNIEXPORT jlong JNICALL Java_com_onionnetworks_fec_Native8Code_nativeNewEncoder
+  (JNIEnv *, jobject, jintArray, jint);
+
+/*
+ * Class:     com_onionnetworks_fec_Native8Code
+ * Method:    nativeEncoderAdd
+ * Signature: (J[BII)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native8Code_nativeEncoderAdd
+  (JNIEnv *, jclass, jlong, jbyteArray, jint, jint);
+
+/*
+ * Class:     com_onionnetworks_fec_Native8Code
+ * Method:    nativeEncoderFinish
+ * Signature: (J[[B[I)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native8Code_nativeEncoderFinish
+  (JNIEnv *, jclass, jlong, jobjectArray, jintArray);
+
+/*
+ * Class:     com_onionnetworks_fec_Native8Code
+ * Method:    nativeNewDecoder
+ * Signature: (I)J
+ */
+JNIEXPORT jlong JNICALL Java_com_onionnetworks_fec_Native8Code_nativeNewDecoder
+  (JNIEnv *, jobject, jint);
+
+/*
+ * Class:     com_onionnetworks_fec_Native8Code
+ * Method:    nativeDecoderAdd
+ * Signature: (J[BII)I
+ */
+JNIEXPORT jint JNICALL Java_com_onionnetworks_fec_Native8Code_nativeDecoderAdd
+  (JNIEnv *, jclass, jlong, jbyteArray, jint, jint);
+
+/*
+ * Class:     com_onionnetworks_fec_Native8Code
+ * Method:    nativeDecoderFinish
+ * Signature: (J[[B[I)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native8Code_nativeDecoderFinish
+  (JNIEnv *, jclass, jlong, jobjectArray, jintArray);
+
+/*
+ * Class:     com_onionnetworks_fec_Native8Code
+ * Method:    nativeDecodeInPlace
+ * Signature: ([[B[I[III)V
+ */
+JNIEXPORT void JNICALL Java_com_onionnetworks_fec_Native8Code_nativeDecodeInPlace
+  (JNIEnv *, jobject, jobjectArray, jintArray, jintArray, jint, jint);
+
 /*
  * Class:     com_onionnetworks_fec_Native8Code
  * Method:    nativeNewFEC
@@ -0,0 +1,402 @@
+/*
+ * fec-bench.c -- throughput benchmark for the FEC library
+ *
+ * Sweeps k, n, packet size, erasure count, thread count, library pool
+ * size and optionally the multiply kernels, and prints one record per
+ * configuration on stdout, as CSV (default) or JSON:
+ *
+ *   bits kernel matrix k n size erasures threads pool	the configuration
+ *   build_us	fec_new_type(k, n, matrix), microseconds
+ *   invert_us	decode matrix for the erasure pattern, not cached
+ *   encode_MBps	source bytes per second, producing all n-k repair
+ *		packets with fec_encode_multi
+ *   decode_MBps	source bytes per second, rebuilding the first
+ *		`erasures` source packets from repair packets with
+ *		fec_decode. Includes copying the repair packets back
+ *		before each call, since fec_decode works in place.
+ *
+ * Throughputs are summed over the threads, which share one code and
+ * each work on their own packets. pool is fec_set_threads(), the
+ * threads each call may use. Times are from CLOCK_MONOTONIC.
+ *
+ * In fec8bench, -K cauchy measures the XOR-only Cauchy code of
+ * cauchy.c instead (kernel "cauchy", sizes that are multiples of 8,
+ * no pool, invert_us 0 since it is part of each decode).
+ *
+ * -M cauchy uses the Cauchy encoding matrix of fec_new_type() instead
+ * of the Vandermonde one; only build_us should differ.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "fec.h"
+#include "cauchy.h"
+
+#define MAXLIST	32
+#define KERNEL_CAUCHY	(FEC_KERNEL_AVX2 + 1)	/* not a fec.c kernel */
+
+struct list {
+    int n ;
+    int v[MAXLIST] ;
+} ;
+
+static double min_secs = 0.25 ;	/* per measurement */
+static int matrix = FEC_VANDERMONDE ;	/* -M */
+
+static double
+now(void)
+{
+    struct timespec ts ;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9 ;
+}
+
+static void *
+xmalloc(size_t sz)
+{
+    void *p = malloc(sz) ;
+
+    if (p == NULL) {
+	fprintf(stderr, "fec-bench: out of memory (%lu bytes)\n",
+	    (unsigned long)sz);
+	exit(1);
+    }
+    return p ;
+}
+
+static void
+parse_list(struct list *l, const char *s)
+{
+    char *end ;
+
+    l->n = 0 ;
+    while (*s && l->n < MAXLIST) {
+	l->v[l->n++] = strtol(s, &end, 10) ;
+	if (end == s) {
+	    fprintf(stderr, "fec-bench: bad number list '%s'\n", s);
+	    exit(2);
+	}
+	s = *end == ',' ? end + 1 : end ;
+    }
+}
+
+/*
+ * one thread's share of an encode or decode measurement
+ */
+struct job {
+    struct fec_parms *code ;
+    struct cauchy_code *cauchy ;	/* used instead of code if set */
+    int k, n, sz, e ;
+    int decode ;
+    double mbps ;		/* result */
+    int errors ;
+} ;
+
+static int
+job_encode(struct job *j, gf **src, gf **rep, int *idx, int nrep)
+{
+    if (j->cauchy)
+	return cauchy_encode(j->cauchy, (unsigned char **)src,
+	    (unsigned char **)rep, idx, nrep, j->sz) ;
+    return fec_encode_multi(j->code, src, rep, idx, nrep, j->sz) ;
+}
+
+static int
+job_decode(struct job *j, gf **pkt, int *ixs)
+{
+    if (j->cauchy)
+	return cauchy_decode(j->cauchy, (unsigned char **)pkt, ixs, j->sz) ;
+    return fec_decode(j->code, pkt, ixs, j->sz) ;
+}
+
+static void *
+run_job(void *arg)
+{
+    struct job *j = arg ;
+    int k = j->k, nrep = j->n - j->k, i, r ;
+    gf **src, **rep, **work, **pkt ;
+    int *idx, *ixs ;
+    long iters = 0 ;
+    double t0, t ;
+
+    src = xmalloc(k * sizeof(gf *)) ;
+    pkt = xmalloc(k * sizeof(gf *)) ;
+    rep = xmalloc((nrep + 1) * sizeof(gf *)) ;
+    work = xmalloc((j->e + 1) * sizeof(gf *)) ;
+    idx = xmalloc((nrep + 1) * sizeof(int)) ;
+    ixs = xmalloc(k * sizeof(int)) ;
+    for (i = 0 ; i < k ; i++) {
+	src[i] = xmalloc(j->sz) ;
+	for (r = 0 ; r < j->sz ; r++)
+	    ((unsigned char *)src[i])[r] = rand() ;
+    }
+    for (i = 0 ; i < nrep ; i++) {
+	rep[i] = xmalloc(j->sz) ;
+	idx[i] = k + i ;
+    }
+    for (i = 0 ; i < j->e ; i++)
+	work[i] = xmalloc(j->sz) ;
+    if (nrep > 0 && job_encode(j, src, rep, idx, nrep))
+	j->errors++ ;
+
+    t0 = now() ;
+    do {
+	if (!j->decode) {
+	    job_encode(j, src, rep, idx, nrep);
+	} else {
+	    for (i = 0 ; i < k ; i++) {
+		if (i < j->e) {
+		    memcpy(work[i], rep[i], j->sz);
+		    pkt[i] = work[i] ;
+		    ixs[i] = k + i ;
+		} else {
+		    pkt[i] = src[i] ;
+		    ixs[i] = i ;
+		}
+	    }
+	    if (job_decode(j, pkt, ixs))
+		j->errors++ ;
+	    if (iters == 0)
+		for (i = 0 ; i < j->e ; i++)
+		    if (memcmp(work[i], src[i], j->sz))
+			j->errors++ ;
+	}
+	iters++ ;
+    } while ((t = now() - t0) < min_secs) ;
+    j->mbps = (double)iters * k * j->sz / t / 1e6 ;
+
+    for (i = 0 ; i < k ; i++)
+	free(src[i]);
+    for (i = 0 ; i < nrep ; i++)
+	free(rep[i]);
+    for (i = 0 ; i < j->e ; i++)
+	free(work[i]);
+    free(src); free(pkt); free(rep); free(work); free(idx); free(ixs);
+    return NULL ;
+}
+
+/*
+ * aggregate throughput of nthreads running the same job
+ */
+static double
+run_threads(struct job *proto, int nthreads, int *errors)
+{
+    pthread_t *tid = xmalloc(nthreads * sizeof(pthread_t)) ;
+    struct job *jobs = xmalloc(nthreads * sizeof(struct job)) ;
+    double mbps = 0 ;
+    int i ;
+
+    for (i = 0 ; i < nthreads ; i++) {
+	jobs[i] = *proto ;
+	if (pthread_create(&tid[i], NULL, run_job, &jobs[i]) != 0) {
+	    fprintf(stderr, "fec-bench: pthread_create failed\n");
+	    exit(1);
+	}
+    }
+    for (i = 0 ; i < nthreads ; i++) {
+	pthread_join(tid[i], NULL);
+	mbps += jobs[i].mbps ;
+	*errors += jobs[i].errors ;
+    }
+    free(tid);
+    free(jobs);
+    return mbps ;
+}
+
+static double
+time_build(int k, int n, int cauchy)
+{
+    long iters = 0 ;
+    double t0 = now(), t ;
+
+    do {
+	if (cauchy)
+	    cauchy_free(cauchy_new(k, n));
+	else
+	    fec_free(fec_new_type(k, n, matrix));
+	iters++ ;
+    } while ((t = now() - t0) < min_secs / 5) ;
+    return t / iters * 1e6 ;
+}
+
+static double
+time_invert(struct fec_parms *code, int k, int e, int *errors)
+{
+    gf *m = xmalloc(k * k * sizeof(gf)) ;
+    int *ixs = xmalloc(k * sizeof(int)) ;
+    long iters = 0 ;
+    double t0, t ;
+    int i ;
+
+    for (i = 0 ; i < k ; i++)
+	ixs[i] = i < e ? k + i : i ;
+    t0 = now() ;
+    do {
+	if (fec_decode_matrix(code, ixs, m))
+	    (*errors)++ ;
+	iters++ ;
+    } while ((t = now() - t0) < min_secs / 5) ;
+    free(m);
+    free(ixs);
+    return t / iters * 1e6 ;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+	"usage: fec%dbench [-k list] [-n list] [-s list] [-e list] "
+	"[-t list] [-p list]\n"
+	"    [-K scalar|ssse3|avx2|all|cauchy] [-M vandermonde|cauchy]\n"
+	"    [-T secs] [-f csv|json]\n"
+	"lists are comma separated; n = 0 means 2k\n", GF_BITS);
+    exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct list ks, ns, sizes, erasures, threads, pools, kernels ;
+    int json = 0, first = 1, errors = 0 ;
+    int a, ki, ni, si, ei, ti, pi, kk ;
+    const char *mname ;
+
+    parse_list(&ks, "16,32,64,128");
+    parse_list(&ns, "0");
+    parse_list(&sizes, "1024,8192,65536");
+    parse_list(&erasures, "1,4,16");
+    parse_list(&threads, "1");
+    parse_list(&pools, "1");
+    kernels.n = 1 ;
+    kernels.v[0] = fec_get_kernel() ;
+
+    for (a = 1 ; a < argc ; a++) {
+	const char *opt = argv[a], *val = a + 1 < argc ? argv[a + 1] : NULL ;
+
+	if (opt[0] != '-' || opt[1] == '\0' || opt[2] != '\0' || val == NULL)
+	    usage();
+	a++ ;
+	switch (opt[1]) {
+	case 'k': parse_list(&ks, val); break ;
+	case 'n': parse_list(&ns, val); break ;
+	case 's': parse_list(&sizes, val); break ;
+	case 'e': parse_list(&erasures, val); break ;
+	case 't': parse_list(&threads, val); break ;
+	case 'p': parse_list(&pools, val); break ;
+	case 'T': min_secs = atof(val); break ;
+	case 'f':
+	    if (!strcmp(val, "json"))
+		json = 1 ;
+	    else if (strcmp(val, "csv"))
+		usage();
+	    break ;
+	case 'M':
+	    if (!strcmp(val, "cauchy"))
+		matrix = FEC_CAUCHY ;
+	    else if (strcmp(val, "vandermonde"))
+		usage();
+	    break ;
+	case 'K':
+	    kernels.n = 0 ;
+	    if (!strcmp(val, "cauchy") && GF_BITS == 8)
+		kernels.v[kernels.n++] = KERNEL_CAUCHY ;
+	    for (kk = FEC_KERNEL_SCALAR ; kk <= FEC_KERNEL_AVX2 ; kk++)
+		if ((!strcmp(val, "all") || !strcmp(val, fec_kernel_name(kk)))
+		    && fec_set_kernel(kk) == 0)
+		    kernels.v[kernels.n++] = kk ;
+	    if (kernels.n == 0) {
+		fprintf(stderr, "fec-bench: kernel %s not available\n", val);
+		exit(2);
+	    }
+	    break ;
+	default:
+	    usage();
+	}
+    }
+
+    mname = matrix == FEC_CAUCHY ? "cauchy" : "vandermonde" ;
+    if (json)
+	printf("[");
+    else
+	printf("bits,kernel,matrix,k,n,size,erasures,threads,pool,"
+	    "build_us,invert_us,encode_MBps,decode_MBps\n");
+
+    for (kk = 0 ; kk < kernels.n ; kk++)
+    for (ki = 0 ; ki < ks.n ; ki++)
+    for (ni = 0 ; ni < ns.n ; ni++) {
+	int k = ks.v[ki], n = ns.v[ni] ? ns.v[ni] : 2 * k ;
+	struct fec_parms *code ;
+	struct cauchy_code *cauchy = NULL ;
+	int xor = kernels.v[kk] == KERNEL_CAUCHY ;
+	double build_us ;
+
+	if (n > GF_SIZE + 1)
+	    n = GF_SIZE + 1 ;
+	if (k < 1 || k > n)
+	    continue ;
+	if (!xor)
+	    fec_set_kernel(kernels.v[kk]);
+	build_us = time_build(k, n, xor) ;
+	code = fec_new_type(k, n, matrix) ;
+	if (xor)
+	    cauchy = cauchy_new(k, n) ;
+	for (ei = 0 ; ei < erasures.n ; ei++) {
+	    int e = erasures.v[ei] ;
+	    double invert_us ;
+
+	    if (e < 0 || e > k || e > n - k)
+		continue ;
+	    invert_us = xor ? 0 : time_invert(code, k, e, &errors) ;
+	    for (si = 0 ; si < sizes.n ; si++)
+	    for (ti = 0 ; ti < threads.n ; ti++)
+	    for (pi = 0 ; pi < pools.n ; pi++) {
+		struct job j ;
+		double enc, dec ;
+		int sz = sizes.v[si], nt = threads.v[ti], np ;
+
+		if (sz < 1 || nt < 1 || (GF_BITS > 8 && sz % 2) ||
+		    (xor && sz % CAUCHY_W))
+		    continue ;
+		np = xor ? 1 : fec_set_threads(pools.v[pi]) ;
+		j.code = code ;
+		j.cauchy = cauchy ;
+		j.k = k ; j.n = n ; j.sz = sz ; j.e = e ;
+		j.errors = 0 ;
+		j.decode = 0 ;
+		enc = n > k ? run_threads(&j, nt, &errors) : 0 ;
+		j.decode = 1 ;
+		dec = run_threads(&j, nt, &errors) ;
+
+		if (json)
+		    printf("%s\n  {\"bits\": %d, \"kernel\": \"%s\", "
+			"\"matrix\": \"%s\", \"k\": %d, \"n\": %d, \"size\": %d, "
+			"\"erasures\": %d, \"threads\": %d, \"pool\": %d, "
+			"\"build_us\": %.2f, \"invert_us\": %.2f, "
+			"\"encode_MBps\": %.1f, \"decode_MBps\": %.1f}",
+			first ? "" : ",", GF_BITS,
+			xor ? "cauchy" : fec_kernel_name(kernels.v[kk]),
+			mname, k, n, sz, e, nt, np,
+			build_us, invert_us, enc, dec);
+		else
+		    printf("%d,%s,%s,%d,%d,%d,%d,%d,%d,%.2f,%.2f,%.1f,%.1f\n",
+			GF_BITS, xor ? "cauchy" : fec_kernel_name(kernels.v[kk]),
+			mname, k, n, sz, e, nt, np,
+			build_us, invert_us, enc, dec);
+		fflush(stdout);
+		first = 0 ;
+	    }
+	}
+	fec_free(code);
+	if (cauchy)
+	    cauchy_free(cauchy);
+    }
+    if (json)
+	printf("\n]\n");
+    if (errors)
+	fprintf(stderr, "fec-bench: %d encode/decode errors\n", errors);
+    return errors ? 1 : 0 ;
+}
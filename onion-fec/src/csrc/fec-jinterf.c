@@ -38,7 +38,7 @@
 ** @param ENV: JNI environment for setting the pending exception
 */
 #define malloc_or_oom(CLEANUP, PTR, TYPE, NUM, ENV) \
-    PTR = (TYPE *) malloc(sizeof(TYPE) * NUM); \
+    PTR = (TYPE *) malloc(sizeof(TYPE) * (NUM)); \
     if (PTR == NULL) { \
         (*ENV)->ThrowNew(ENV, (*ENV)->FindClass(ENV, "java/lang/OutOfMemoryError"), "malloc failed"); \
         goto CLEANUP; \
@@ -57,6 +57,19 @@
 #define nonnull_or_oom(CLEANUP, PTR) \
     if (PTR == NULL) { goto CLEANUP; } \
 
+/*
+** Set the pending Java exception for an error returned by the fec
+** library. Must not be called while holding a critical array.
+*/
+static void
+throw_fec_error(JNIEnv *env, int err)
+{
+    if (err == FEC_ENOMEM)
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/OutOfMemoryError"), "fec: out of memory");
+    else if (err != 0)
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"), "fec: bad index or packets");
+}
+
 jfieldID codeField;
 JNIEXPORT void JNICALL FEC_METHOD(initFEC)
   (JNIEnv * env, jclass clz) {
@@ -79,16 +92,16 @@ JNIEXPORT void JNICALL FEC_METHOD(nativeEncode)
     jbyte **inarr, **retarr;
     jobject result = NULL;
 
-    int i, numRet;
+    int i, numRet, err;
     jlong code = (*env)->GetLongField(env, obj, codeField);
 
+    numRet = (*env)->GetArrayLength(env, ret);
+
     /* allocate memory for the arrays */
     malloc_or_oom(nativeEncode_cleanup_inArr, inArr, jbyteArray, k, env);
-    malloc_or_oom(nativeEncode_cleanup_retArr, retArr, jbyteArray, k, env);
+    malloc_or_oom(nativeEncode_cleanup_retArr, retArr, jbyteArray, numRet, env);
     malloc_or_oom(nativeEncode_cleanup_inarr, inarr, jbyte *, k, env);
-    malloc_or_oom(nativeEncode_cleanup_retarr, retarr, jbyte *, k, env);
-
-    numRet = (*env)->GetArrayLength(env, ret);
+    malloc_or_oom(nativeEncode_cleanup_retarr, retarr, jbyte *, numRet, env);
 
     /* PushLocalFrame reserves enough space for local variable references
      *
@@ -132,10 +145,9 @@ JNIEXPORT void JNICALL FEC_METHOD(nativeEncode)
         retarr[i] += localRetOff[i];
     }
 
-    for (i=0; i<numRet; i++) {
-        fec_encode((void *)(uintptr_t)code, (gf **)(uintptr_t)inarr, (void *)(uintptr_t)retarr[i],
-                   (int)localIndex[i], (int)packetLength);
-    }
+    /* all repair blocks in one pass over the source blocks */
+    err = fec_encode_multi((void *)(uintptr_t)code, (gf **)(uintptr_t)inarr, (gf **)(uintptr_t)retarr,
+                     (int *)(uintptr_t)localIndex, numRet, (int)packetLength);
 
     for (i=0; i<k; i++) {
         inarr[i] -= localSrcOff[i];
@@ -150,6 +162,7 @@ JNIEXPORT void JNICALL FEC_METHOD(nativeEncode)
     (*env)->ReleaseIntArrayElements(env, srcOff, localSrcOff, 0);
     (*env)->ReleaseIntArrayElements(env, index, localIndex, 0);
     (*env)->ReleaseIntArrayElements(env, retOff, localRetOff, 0);
+    throw_fec_error(env, err);
 
     /* free the memory reserved by PushLocalFrame() */
     result = (*env)->PopLocalFrame(env, result);
@@ -178,7 +191,7 @@ JNIEXPORT void JNICALL FEC_METHOD(nativeDecode)
     jbyte **inarr;
     jobject result = NULL;
 
-    int i;
+    int i, err;
     jlong code = (*env)->GetLongField(env, obj, codeField);
 
     /* allocate memory for the arrays */
@@ -229,7 +242,7 @@ JNIEXPORT void JNICALL FEC_METHOD(nativeDecode)
         inarr[i] += localDataOff[i];
     }
 
-    fec_decode((struct fec_parms *)(intptr_t)code, (gf **)(intptr_t)inarr, (int *)(intptr_t)localWhich, (int)packetLength);
+    err = fec_decode((struct fec_parms *)(intptr_t)code, (gf **)(intptr_t)inarr, (int *)(intptr_t)localWhich, (int)packetLength);
 
     for (i=0; i<k; i++) {
         inarr[i] -= localDataOff[i];
@@ -239,6 +252,7 @@ JNIEXPORT void JNICALL FEC_METHOD(nativeDecode)
 
     (*env)->ReleaseIntArrayElements(env, whichdata, localWhich, 0);
     (*env)->ReleaseIntArrayElements(env, dataOff, localDataOff, 0);
+    throw_fec_error(env, err);
 
     /* free the memory reserved by PushLocalFrame() */
     result = (*env)->PopLocalFrame(env, result);
@@ -250,14 +264,861 @@ JNIEXPORT void JNICALL FEC_METHOD(nativeDecode)
     return;
 }
 
+/*
+** Decode packets given in any order, in place: rather than the byte[]s
+** being shuffled, the data is moved within them by fec_decode_to(), so
+** that data[i] ends up holding packet i, as after FECCode.copyShuffle()
+** and nativeDecode but without copying whole packets around. The
+** indexes come back as 0..k-1. All the references are fetched before
+** the first array is pinned, since no JNI calls may be made until they
+** are released.
+*/
+JNIEXPORT void JNICALL FEC_METHOD(nativeDecodeInPlace)
+    (JNIEnv *env, jobject obj, jobjectArray data, jintArray dataOff,
+     jintArray whichdata, jint k, jint packetLength) {
+
+    jlong code = (*env)->GetLongField(env, obj, codeField);
+    jbyteArray *inArr;
+    gf **inarr;
+    jint *ints;
+    int i, n = 0, err = 0;
+
+    malloc_or_oom(nativeDecodeInPlace_cleanup_inArr, inArr, jbyteArray, k, env);
+    malloc_or_oom(nativeDecodeInPlace_cleanup_inarr, inarr, gf *, k, env);
+    malloc_or_oom(nativeDecodeInPlace_cleanup_ints, ints, jint, 2 * k, env);
+
+    if ((*env)->PushLocalFrame(env, k) < 0)
+        goto nativeDecodeInPlace_cleanup;
+    (*env)->GetIntArrayRegion(env, dataOff, 0, k, ints);
+    (*env)->GetIntArrayRegion(env, whichdata, 0, k, ints + k);
+    for (i = 0; i < k && !(*env)->ExceptionCheck(env); i++) {
+        inArr[i] = (*env)->GetObjectArrayElement(env, data, i);
+        if (inArr[i] == NULL && !(*env)->ExceptionCheck(env))
+            (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/NullPointerException"), "null packet");
+    }
+    if (!(*env)->ExceptionCheck(env)) {
+        for (n = 0; n < k; n++) {
+            inarr[n] = (*env)->GetPrimitiveArrayCritical(env, inArr[n], 0);
+            if (inarr[n] == NULL)
+                break;
+            inarr[n] = (gf *)((jbyte *)inarr[n] + ints[n]);
+        }
+        if (n == k)
+            err = fec_decode_to((struct fec_parms *)(intptr_t)code, inarr,
+                                (int *)ints + k, inarr, (int)packetLength);
+        for (i = 0; i < n; i++)
+            (*env)->ReleasePrimitiveArrayCritical(env, inArr[i],
+                (jbyte *)inarr[i] - ints[i], 0);
+        if (n == k && err == 0) {
+            for (i = 0; i < k; i++)
+                ints[k + i] = i;
+            (*env)->SetIntArrayRegion(env, whichdata, 0, k, ints + k);
+        }
+        if (n == k)
+            throw_fec_error(env, err);
+    }
+    (*env)->PopLocalFrame(env, NULL);
+
+    nativeDecodeInPlace_cleanup:
+    free(ints); nativeDecodeInPlace_cleanup_ints:
+    free(inarr); nativeDecodeInPlace_cleanup_inarr:
+    free(inArr); nativeDecodeInPlace_cleanup_inArr:
+    return;
+}
+
+/*
+** Direct ByteBuffer entry points. The packets are reached through
+** GetDirectBufferAddress, so nothing is copied or pinned and no critical
+** section is entered; the int[] arguments are copied in and out with
+** Get/SetIntArrayRegion. Every packet is bounds checked against the
+** capacity of its buffer, since a bad offset would otherwise let Java
+** code read or write arbitrary memory.
+*/
+
+static void
+throw_iae(JNIEnv *env, const char *msg)
+{
+    (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"), msg);
+}
+
+/*
+** Address of [off, off + len) in the direct buffer buf, or NULL with an
+** exception pending.
+*/
+static char *
+direct_range(JNIEnv *env, jobject buf, jlong off, jlong len)
+{
+    char *p;
+    jlong cap;
+
+    if (buf == NULL) {
+        throw_iae(env, "null buffer");
+        return NULL;
+    }
+    p = (*env)->GetDirectBufferAddress(env, buf);
+    cap = (*env)->GetDirectBufferCapacity(env, buf);
+    if (p == NULL || cap < 0) {
+        throw_iae(env, "not a direct buffer");
+        return NULL;
+    }
+    if (off < 0 || len < 0 || off > cap - len) {
+        throw_iae(env, "packet outside of its buffer");
+        return NULL;
+    }
+    return p + off;
+}
+
+/*
+** Fill ptrs[0..num-1] with the packets of the direct buffers in bufs, at
+** the offsets in offs. Returns non-zero with an exception pending.
+*/
+static int
+direct_packets(JNIEnv *env, jobjectArray bufs, jintArray offs, int num,
+               int packetLength, gf **ptrs, jint *tmpOffs)
+{
+    jobject buf;
+    int i;
+
+    (*env)->GetIntArrayRegion(env, offs, 0, num, tmpOffs);
+    if ((*env)->ExceptionCheck(env))
+        return 1;
+    for (i = 0; i < num; i++) {
+        buf = (*env)->GetObjectArrayElement(env, bufs, i);
+        if (buf == NULL && (*env)->ExceptionCheck(env))
+            return 1;
+        ptrs[i] = (gf *)direct_range(env, buf, tmpOffs[i], packetLength);
+        (*env)->DeleteLocalRef(env, buf);
+        if (ptrs[i] == NULL)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+** Fill ptrs[0..num-1] with num packets laid out stride bytes apart from
+** off in the direct buffer buf.
+*/
+static int
+segment_packets(JNIEnv *env, jobject buf, jint off, jint stride, int num,
+                int packetLength, gf **ptrs)
+{
+    char *base;
+    int i;
+
+    if (stride < packetLength) {
+        throw_iae(env, "stride shorter than a packet");
+        return 1;
+    }
+    base = direct_range(env, buf, off,
+                        num > 0 ? (jlong)(num - 1) * stride + packetLength : 0);
+    if (base == NULL)
+        return 1;
+    for (i = 0; i < num; i++)
+        ptrs[i] = (gf *)(base + (jlong)i * stride);
+    return 0;
+}
+
+/*
+** Common tail of the direct encodes: pointers are set up in inarr and
+** retarr, the indexes still in the Java array.
+*/
+static void
+direct_encode(JNIEnv *env, jlong code, gf **inarr, gf **retarr,
+              jintArray index, int numRet, int packetLength, jint *localIndex)
+{
+    (*env)->GetIntArrayRegion(env, index, 0, numRet, localIndex);
+    if ((*env)->ExceptionCheck(env))
+        return;
+    throw_fec_error(env, fec_encode_multi((struct fec_parms *)(uintptr_t)code,
+        inarr, retarr, (int *)localIndex, numRet, packetLength));
+}
+
+/*
+** Common tail of the direct decodes. The packets are decoded where they
+** are, see nativeDecodeInPlace.
+*/
+static void
+direct_decode(JNIEnv *env, jlong code, gf **pkt, jintArray index, int k,
+              int packetLength, jint *localIndex)
+{
+    int i, err;
+
+    (*env)->GetIntArrayRegion(env, index, 0, k, localIndex);
+    if ((*env)->ExceptionCheck(env))
+        return;
+    err = fec_decode_to((struct fec_parms *)(uintptr_t)code, pkt,
+                        (int *)localIndex, pkt, packetLength);
+    if (err == 0) {
+        for (i = 0; i < k; i++)
+            localIndex[i] = i;
+        (*env)->SetIntArrayRegion(env, index, 0, k, localIndex);
+    }
+    throw_fec_error(env, err);
+}
+
+JNIEXPORT void JNICALL FEC_METHOD(nativeEncodeDirect)
+  (JNIEnv *env, jobject obj, jobjectArray src, jintArray srcOff,
+    jintArray index, jobjectArray ret, jintArray retOff, jint k,
+    jint packetLength) {
+
+    jlong code = (*env)->GetLongField(env, obj, codeField);
+    int numRet = (*env)->GetArrayLength(env, ret);
+    gf **ptrs;
+    jint *ints;
+
+    malloc_or_oom(nativeEncodeDirect_cleanup_ptrs, ptrs, gf *, k + numRet, env);
+    malloc_or_oom(nativeEncodeDirect_cleanup_ints, ints, jint, k + numRet, env);
+
+    if (direct_packets(env, src, srcOff, k, packetLength, ptrs, ints) == 0 &&
+        direct_packets(env, ret, retOff, numRet, packetLength, ptrs + k, ints) == 0)
+        direct_encode(env, code, ptrs, ptrs + k, index, numRet, packetLength, ints);
+
+    free(ints); nativeEncodeDirect_cleanup_ints:
+    free(ptrs); nativeEncodeDirect_cleanup_ptrs:
+    return;
+}
+
+JNIEXPORT void JNICALL FEC_METHOD(nativeEncodeSegment)
+  (JNIEnv *env, jobject obj, jobject src, jint srcOff, jint srcStride,
+    jintArray index, jobject ret, jint retOff, jint retStride, jint k,
+    jint packetLength) {
+
+    jlong code = (*env)->GetLongField(env, obj, codeField);
+    int numRet = (*env)->GetArrayLength(env, index);
+    gf **ptrs;
+    jint *ints;
+
+    malloc_or_oom(nativeEncodeSegment_cleanup_ptrs, ptrs, gf *, k + numRet, env);
+    malloc_or_oom(nativeEncodeSegment_cleanup_ints, ints, jint, numRet, env);
+
+    if (segment_packets(env, src, srcOff, srcStride, k, packetLength, ptrs) == 0 &&
+        segment_packets(env, ret, retOff, retStride, numRet, packetLength, ptrs + k) == 0)
+        direct_encode(env, code, ptrs, ptrs + k, index, numRet, packetLength, ints);
+
+    free(ints); nativeEncodeSegment_cleanup_ints:
+    free(ptrs); nativeEncodeSegment_cleanup_ptrs:
+    return;
+}
+
+JNIEXPORT void JNICALL FEC_METHOD(nativeDecodeDirect)
+    (JNIEnv *env, jobject obj, jobjectArray data, jintArray dataOff,
+     jintArray whichdata, jint k, jint packetLength) {
+
+    jlong code = (*env)->GetLongField(env, obj, codeField);
+    gf **ptrs;
+    jint *ints;
+
+    malloc_or_oom(nativeDecodeDirect_cleanup_ptrs, ptrs, gf *, k, env);
+    malloc_or_oom(nativeDecodeDirect_cleanup_ints, ints, jint, k, env);
+
+    if (direct_packets(env, data, dataOff, k, packetLength, ptrs, ints) == 0)
+        direct_decode(env, code, ptrs, whichdata, k, packetLength, ints);
+
+    free(ints); nativeDecodeDirect_cleanup_ints:
+    free(ptrs); nativeDecodeDirect_cleanup_ptrs:
+    return;
+}
+
+JNIEXPORT void JNICALL FEC_METHOD(nativeDecodeSegment)
+    (JNIEnv *env, jobject obj, jobject data, jint dataOff, jint stride,
+     jintArray whichdata, jint k, jint packetLength) {
+
+    jlong code = (*env)->GetLongField(env, obj, codeField);
+    gf **ptrs;
+    jint *ints;
+
+    malloc_or_oom(nativeDecodeSegment_cleanup_ptrs, ptrs, gf *, k, env);
+    malloc_or_oom(nativeDecodeSegment_cleanup_ints, ints, jint, k, env);
+
+    if (segment_packets(env, data, dataOff, stride, k, packetLength, ptrs) == 0)
+        direct_decode(env, code, ptrs, whichdata, k, packetLength, ints);
+
+    free(ints); nativeDecodeSegment_cleanup_ints:
+    free(ptrs); nativeDecodeSegment_cleanup_ptrs:
+    return;
+}
+
+/*
+** Batches: many segments, each with its own code and packet length, in
+** one call. Every segment is one direct buffer holding its packets a
+** stride apart, as for nativeEncodeSegment. The per-segment int[]s are
+** copied in with one GetIntArrayRegion each.
+*/
+struct batch {
+    struct fec_segment *seg;
+    jint *args;         /* 5 ints per segment, see batch_args */
+    gf **ptrs;
+    jint *ints;
+};
+
+static void
+batch_free(struct batch *b)
+{
+    free(b->seg);
+    free(b->args);
+    free(b->ptrs);
+    free(b->ints);
+}
+
+/*
+** Copy the nargs per-segment int[] arguments into b->args, then look up
+** the codes and size the pointer and index arrays. numRet() of the
+** segment is the length of its index[] for encodes, k for decodes.
+** Returns non-zero with an exception pending.
+*/
+static int
+batch_setup(JNIEnv *env, struct batch *b, jobjectArray codes,
+            jintArray *arrs, int nargs, jobjectArray index, int nseg,
+            int decode)
+{
+    jobject o;
+    struct fec_parms *code;
+    long nptrs = 0, nints = 0;
+    int i;
+
+    b->seg = calloc(nseg > 0 ? nseg : 1, sizeof(struct fec_segment));
+    b->args = malloc(sizeof(jint) * (nargs * nseg + 1));
+    b->ptrs = NULL;
+    b->ints = NULL;
+    if (b->seg == NULL || b->args == NULL)
+        goto oom;
+    for (i = 0; i < nargs; i++) {
+        (*env)->GetIntArrayRegion(env, arrs[i], 0, nseg, b->args + i * nseg);
+        if ((*env)->ExceptionCheck(env))
+            return 1;
+    }
+    for (i = 0; i < nseg; i++) {
+        o = (*env)->GetObjectArrayElement(env, codes, i);
+        if (o == NULL) {
+            if (!(*env)->ExceptionCheck(env))
+                throw_iae(env, "null code in batch");
+            return 1;
+        }
+        code = (struct fec_parms *)(uintptr_t)(*env)->GetLongField(env, o, codeField);
+        (*env)->DeleteLocalRef(env, o);
+        if (code == NULL) {
+            throw_iae(env, "freed code in batch");
+            return 1;
+        }
+        b->seg[i].code = code;
+        if (decode)
+            b->seg[i].nout = 0;
+        else {
+            o = (*env)->GetObjectArrayElement(env, index, i);
+            if (o == NULL) {
+                if (!(*env)->ExceptionCheck(env))
+                    throw_iae(env, "null index in batch");
+                return 1;
+            }
+            b->seg[i].nout = (*env)->GetArrayLength(env, o);
+            (*env)->DeleteLocalRef(env, o);
+        }
+        nptrs += code->k + b->seg[i].nout;
+        nints += decode ? code->k : b->seg[i].nout;
+    }
+    b->ptrs = malloc(sizeof(gf *) * (nptrs + 1));
+    b->ints = malloc(sizeof(jint) * (nints + 1));
+    if (b->ptrs == NULL || b->ints == NULL)
+        goto oom;
+    return 0;
+
+oom:
+    (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/OutOfMemoryError"), "malloc failed");
+    return 1;
+}
+
+/*
+** Copy the index[] of segment i into ints.
+*/
+static int
+batch_index(JNIEnv *env, jobjectArray index, int i, int num, jint *ints)
+{
+    jobject o = (*env)->GetObjectArrayElement(env, index, i);
+
+    if (o == NULL) {
+        if (!(*env)->ExceptionCheck(env))
+            throw_iae(env, "null index in batch");
+        return 1;
+    }
+    (*env)->GetIntArrayRegion(env, o, 0, num, ints);
+    (*env)->DeleteLocalRef(env, o);
+    return (*env)->ExceptionCheck(env);
+}
+
+/*
+** Throw for the first failed segment, if any.
+*/
+static void
+batch_result(JNIEnv *env, struct batch *b, int nseg)
+{
+    int i;
+
+    for (i = 0; i < nseg; i++)
+        if (b->seg[i].err) {
+            throw_fec_error(env, b->seg[i].err);
+            return;
+        }
+}
+
+/*
+** Fill in the segments of an encode batch. Returns non-zero with an
+** exception pending.
+*/
+static int
+encode_batch_args(JNIEnv *env, struct batch *b, jobjectArray codes,
+                  jobjectArray src, jintArray srcOff, jintArray srcStride,
+                  jobjectArray index, jobjectArray ret, jintArray retOff,
+                  jintArray retStride, jintArray packetLength, int nseg) {
+
+    jintArray arrs[5] = { srcOff, srcStride, retOff, retStride, packetLength };
+    struct fec_segment *sg;
+    jobject o;
+    gf **p;
+    jint *q, *a;
+    int i, err;
+
+    if (batch_setup(env, b, codes, arrs, 5, index, nseg, 0))
+        return 1;
+    for (i = 0, p = b->ptrs, q = b->ints; i < nseg; i++) {
+        sg = &b->seg[i];
+        a = b->args;
+        sg->sz = a[4 * nseg + i];
+        sg->pkt = p;
+        sg->out = p + sg->code->k;
+        sg->index = (int *)q;
+        p += sg->code->k + sg->nout;
+        q += sg->nout;
+
+        o = (*env)->GetObjectArrayElement(env, src, i);
+        err = o == NULL && (*env)->ExceptionCheck(env);
+        err = err || segment_packets(env, o, a[i], a[nseg + i],
+                                     sg->code->k, sg->sz, sg->pkt);
+        (*env)->DeleteLocalRef(env, o);
+        if (err)
+            return 1;
+        o = (*env)->GetObjectArrayElement(env, ret, i);
+        err = o == NULL && (*env)->ExceptionCheck(env);
+        err = err || segment_packets(env, o, a[2 * nseg + i],
+                                     a[3 * nseg + i], sg->nout, sg->sz,
+                                     sg->out);
+        (*env)->DeleteLocalRef(env, o);
+        if (err || batch_index(env, index, i, sg->nout, (jint *)sg->index))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+** Fill in the segments of a decode batch, each to be decoded in place
+** by fec_decode_segments_to(), see nativeDecodeInPlace. Returns
+** non-zero with an exception pending.
+*/
+static int
+decode_batch_args(JNIEnv *env, struct batch *b, jobjectArray codes,
+                  jobjectArray data, jintArray dataOff, jintArray stride,
+                  jobjectArray index, jintArray packetLength, int nseg) {
+
+    jintArray arrs[3] = { dataOff, stride, packetLength };
+    struct fec_segment *sg;
+    jobject o;
+    gf **p;
+    jint *q, *a;
+    int i, err;
+
+    if (batch_setup(env, b, codes, arrs, 3, index, nseg, 1))
+        return 1;
+    for (i = 0, p = b->ptrs, q = b->ints; i < nseg; i++) {
+        sg = &b->seg[i];
+        a = b->args;
+        sg->sz = a[2 * nseg + i];
+        sg->pkt = p;
+        sg->out = p;
+        sg->index = (int *)q;
+        p += sg->code->k;
+        q += sg->code->k;
+
+        o = (*env)->GetObjectArrayElement(env, data, i);
+        err = o == NULL && (*env)->ExceptionCheck(env);
+        err = err || segment_packets(env, o, a[i], a[nseg + i],
+                                     sg->code->k, sg->sz, sg->pkt);
+        (*env)->DeleteLocalRef(env, o);
+        if (err || batch_index(env, index, i, sg->code->k, (jint *)sg->index))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+** Hand back the indexes of a decoded batch, as the single segment
+** decodes do: 0..k-1 for the segments that were decoded, the others
+** are left as they were.
+*/
+static void
+batch_indexes_out(JNIEnv *env, struct batch *b, jobjectArray index, int nseg)
+{
+    jobject o;
+    int i, j;
+
+    for (i = 0; i < nseg && !(*env)->ExceptionCheck(env); i++) {
+        if (b->seg[i].err)
+            continue;
+        for (j = 0; j < b->seg[i].code->k; j++)
+            b->seg[i].index[j] = j;
+        o = (*env)->GetObjectArrayElement(env, index, i);
+        (*env)->SetIntArrayRegion(env, o, 0, b->seg[i].code->k, (jint *)b->seg[i].index);
+        (*env)->DeleteLocalRef(env, o);
+    }
+}
+
+JNIEXPORT void JNICALL FEC_METHOD(nativeEncodeBatch)
+  (JNIEnv *env, jclass clz, jobjectArray codes, jobjectArray src,
+    jintArray srcOff, jintArray srcStride, jobjectArray index,
+    jobjectArray ret, jintArray retOff, jintArray retStride,
+    jintArray packetLength) {
+
+    int nseg = (*env)->GetArrayLength(env, codes);
+    struct batch b;
+
+    if (!encode_batch_args(env, &b, codes, src, srcOff, srcStride, index,
+                           ret, retOff, retStride, packetLength, nseg)) {
+        fec_encode_segments(b.seg, nseg);
+        batch_result(env, &b, nseg);
+    }
+    batch_free(&b);
+}
+
+JNIEXPORT void JNICALL FEC_METHOD(nativeDecodeBatch)
+  (JNIEnv *env, jclass clz, jobjectArray codes, jobjectArray data,
+    jintArray dataOff, jintArray stride, jobjectArray index,
+    jintArray packetLength) {
+
+    int nseg = (*env)->GetArrayLength(env, codes);
+    struct batch b;
+
+    if (!decode_batch_args(env, &b, codes, data, dataOff, stride, index,
+                           packetLength, nseg)) {
+        fec_decode_segments_to(b.seg, nseg);
+        batch_indexes_out(env, &b, index, nseg);
+        batch_result(env, &b, nseg);
+    }
+    batch_free(&b);
+}
+
+/*
+** Asynchronous batches. nativeSubmit* queue the batch with fec_submit()
+** and return a handle at once; the Java reaper thread gets the handles
+** of finished batches from nativeReap() and passes each to
+** nativeFinish(), which throws if a segment failed and frees it. The
+** buffers and codes are kept alive on the Java side until then.
+*/
+struct job {
+    struct fec_request req;     /* first, see nativeReap */
+    struct batch b;
+};
+
+static jlong
+job_submit(JNIEnv *env, struct job *j, int nseg, int decode)
+{
+    int err;
+
+    j->req.seg = j->b.seg;
+    j->req.nseg = nseg;
+    j->req.decode = decode;
+    if ((err = fec_submit(&j->req)) != 0) {
+        throw_fec_error(env, err);
+        batch_free(&j->b);
+        free(j);
+        return 0;
+    }
+    return (jlong)(uintptr_t)j;
+}
+
+JNIEXPORT jlong JNICALL FEC_METHOD(nativeSubmitEncode)
+  (JNIEnv *env, jclass clz, jobjectArray codes, jobjectArray src,
+    jintArray srcOff, jintArray srcStride, jobjectArray index,
+    jobjectArray ret, jintArray retOff, jintArray retStride,
+    jintArray packetLength) {
+
+    int nseg = (*env)->GetArrayLength(env, codes);
+    struct job *j;
+
+    malloc_or_oom(oom, j, struct job, 1, env);
+    if (encode_batch_args(env, &j->b, codes, src, srcOff, srcStride, index,
+                          ret, retOff, retStride, packetLength, nseg)) {
+        batch_free(&j->b);
+        free(j);
+        return 0;
+    }
+    return job_submit(env, j, nseg, 0);
+
+    oom:
+    return 0;
+}
+
+JNIEXPORT jlong JNICALL FEC_METHOD(nativeSubmitDecode)
+  (JNIEnv *env, jclass clz, jobjectArray codes, jobjectArray data,
+    jintArray dataOff, jintArray stride, jobjectArray index,
+    jintArray packetLength) {
+
+    int nseg = (*env)->GetArrayLength(env, codes);
+    struct job *j;
+
+    malloc_or_oom(oom, j, struct job, 1, env);
+    if (decode_batch_args(env, &j->b, codes, data, dataOff, stride, index,
+                          packetLength, nseg)) {
+        batch_free(&j->b);
+        free(j);
+        return 0;
+    }
+    return job_submit(env, j, nseg, FEC_DECODE_TO);
+
+    oom:
+    return 0;
+}
+
+/*
+** Blocks until a batch finishes, and returns its handle.
+*/
+JNIEXPORT jlong JNICALL FEC_METHOD(nativeReap)
+  (JNIEnv *env, jclass clz) {
+
+    return (jlong)(uintptr_t)fec_reap(1);
+}
+
+/*
+** Hand back the indexes of a finished decode, throw for the first failed
+** segment of the batch, and free it.
+*/
+JNIEXPORT void JNICALL FEC_METHOD(nativeFinish)
+  (JNIEnv *env, jclass clz, jlong handle, jobjectArray index) {
+
+    struct job *j = (struct job *)(uintptr_t)handle;
+
+    if (j->req.decode && index != NULL)
+        batch_indexes_out(env, &j->b, index, j->req.nseg);
+    batch_result(env, &j->b, j->req.nseg);
+    batch_free(&j->b);
+    free(j);
+}
+
+/*
+** Streaming encoder, see fec_encoder_new(). Java heap arrays cannot be
+** held across calls, so the outputs are accumulated in native memory
+** and copied out by nativeEncoderFinish, which also frees the encoder.
+** A null repair array just frees it.
+*/
+struct stream {
+    struct fec_encoder *enc;
+    int nout, sz;
+    gf *buf;    /* nout packets of sz bytes */
+};
+
+JNIEXPORT jlong JNICALL FEC_METHOD(nativeNewEncoder)
+  (JNIEnv *env, jobject obj, jintArray index, jint packetLength) {
+
+    struct fec_parms *code = (struct fec_parms *)(uintptr_t)
+        (*env)->GetLongField(env, obj, codeField);
+    struct stream *s = NULL;
+    gf **out = NULL;
+    int *idx = NULL;
+    int j, nout = (*env)->GetArrayLength(env, index);
+
+    if (packetLength < 0 || (GF_BITS > 8 && packetLength % 2)) {
+        throw_iae(env, "fec: bad packet length");
+        return 0;
+    }
+    malloc_or_oom(nativeNewEncoder_cleanup, idx, int, nout + 1, env);
+    (*env)->GetIntArrayRegion(env, index, 0, nout, (jint *)idx);
+    for (j=0; j<nout; j++)
+        if (idx[j] < 0 || idx[j] >= code->n) {
+            throw_fec_error(env, FEC_EINVAL);
+            goto nativeNewEncoder_cleanup;
+        }
+    malloc_or_oom(nativeNewEncoder_cleanup, out, gf *, nout + 1, env);
+    malloc_or_oom(nativeNewEncoder_cleanup, s, struct stream, 1, env);
+    s->nout = nout;
+    s->sz = packetLength;
+    s->buf = malloc((size_t)nout * packetLength + 1);
+    for (j=0; s->buf != NULL && j<nout; j++)
+        out[j] = (gf *)((char *)s->buf + (size_t)j * packetLength);
+    if (s->buf == NULL ||
+        (s->enc = fec_encoder_new(code, out, idx, nout, packetLength)) == NULL) {
+        free(s->buf);
+        free(s);
+        s = NULL;
+        throw_fec_error(env, FEC_ENOMEM);
+    }
+
+    nativeNewEncoder_cleanup:
+    free(out);
+    free(idx);
+    return (jlong)(uintptr_t)s;
+}
+
+JNIEXPORT void JNICALL FEC_METHOD(nativeEncoderAdd)
+  (JNIEnv *env, jclass clz, jlong handle, jbyteArray src, jint srcOff,
+    jint i) {
+
+    struct stream *s = (struct stream *)(uintptr_t)handle;
+    jbyte *p;
+    int err;
+
+    if (srcOff < 0 ||
+        (*env)->GetArrayLength(env, src) - srcOff < s->sz) {
+        throw_iae(env, "fec: source packet out of bounds");
+        return;
+    }
+    p = (*env)->GetPrimitiveArrayCritical(env, src, 0);
+    nonnull_or_oom(nativeEncoderAdd_cleanup, p);
+    err = fec_encoder_add(s->enc, (gf *)(p + srcOff), i);
+    (*env)->ReleasePrimitiveArrayCritical(env, src, p, JNI_ABORT);
+    throw_fec_error(env, err);
+
+    nativeEncoderAdd_cleanup:
+    return;
+}
+
+JNIEXPORT void JNICALL FEC_METHOD(nativeEncoderFinish)
+  (JNIEnv *env, jclass clz, jlong handle, jobjectArray repair,
+    jintArray repairOff) {
+
+    struct stream *s = (struct stream *)(uintptr_t)handle;
+    jbyteArray arr;
+    jint off;
+    int j, err = fec_encoder_finish(s->enc);
+
+    if (repair != NULL && err != 0)
+        throw_iae(env, "fec: not all the source packets were added");
+    for (j=0; repair != NULL && err == 0 && j<s->nout; j++) {
+        (*env)->GetIntArrayRegion(env, repairOff, j, 1, &off);
+        arr = (*env)->GetObjectArrayElement(env, repair, j);
+        if (arr == NULL || (*env)->ExceptionCheck(env))
+            break;
+        /* bounds checked by the VM */
+        (*env)->SetByteArrayRegion(env, arr, off, s->sz,
+            (jbyte *)((char *)s->buf + (size_t)j * s->sz));
+        (*env)->DeleteLocalRef(env, arr);
+        if ((*env)->ExceptionCheck(env))
+            break;
+    }
+    free(s->buf);
+    free(s);
+}
+
+/*
+** Online decoder, see fec_decoder_new(). As with the streaming encoder
+** the block is decoded in native memory, copied out and freed by
+** nativeDecoderFinish (or only freed, given a null array).
+*/
+struct online {
+    struct fec_decoder *dec;
+    int k, sz;
+    gf *buf;    /* k packets of sz bytes */
+};
+
+JNIEXPORT jlong JNICALL FEC_METHOD(nativeNewDecoder)
+  (JNIEnv *env, jobject obj, jint packetLength) {
+
+    struct fec_parms *code = (struct fec_parms *)(uintptr_t)
+        (*env)->GetLongField(env, obj, codeField);
+    struct online *o = NULL;
+    gf **dst = NULL;
+    int i;
+
+    if (packetLength < 0 || (GF_BITS > 8 && packetLength % 2)) {
+        throw_iae(env, "fec: bad packet length");
+        return 0;
+    }
+    malloc_or_oom(nativeNewDecoder_cleanup, dst, gf *, code->k, env);
+    malloc_or_oom(nativeNewDecoder_cleanup, o, struct online, 1, env);
+    o->k = code->k;
+    o->sz = packetLength;
+    o->buf = malloc((size_t)code->k * packetLength + 1);
+    for (i=0; o->buf != NULL && i<code->k; i++)
+        dst[i] = (gf *)((char *)o->buf + (size_t)i * packetLength);
+    if (o->buf == NULL ||
+        (o->dec = fec_decoder_new(code, dst, packetLength)) == NULL) {
+        free(o->buf);
+        free(o);
+        o = NULL;
+        throw_fec_error(env, FEC_ENOMEM);
+    }
+
+    nativeNewDecoder_cleanup:
+    free(dst);
+    return (jlong)(uintptr_t)o;
+}
+
+JNIEXPORT jint JNICALL FEC_METHOD(nativeDecoderAdd)
+  (JNIEnv *env, jclass clz, jlong handle, jbyteArray pkt, jint pktOff,
+    jint index) {
+
+    struct online *o = (struct online *)(uintptr_t)handle;
+    jbyte *p;
+    int err;
+
+    if (pktOff < 0 ||
+        (*env)->GetArrayLength(env, pkt) - pktOff < o->sz) {
+        throw_iae(env, "fec: packet out of bounds");
+        return 0;
+    }
+    p = (*env)->GetPrimitiveArrayCritical(env, pkt, 0);
+    if (p == NULL)
+        return 0;
+    err = fec_decoder_add(o->dec, (gf *)(p + pktOff), index);
+    (*env)->ReleasePrimitiveArrayCritical(env, pkt, p, JNI_ABORT);
+    throw_fec_error(env, err);
+    return fec_decoder_needed(o->dec);
+}
+
+JNIEXPORT void JNICALL FEC_METHOD(nativeDecoderFinish)
+  (JNIEnv *env, jclass clz, jlong handle, jobjectArray dst,
+    jintArray dstOff) {
+
+    struct online *o = (struct online *)(uintptr_t)handle;
+    jbyteArray arr;
+    jint off;
+    int i, err = fec_decoder_finish(o->dec);
+
+    if (dst != NULL && err != 0)
+        throw_iae(env, "fec: not enough packets to decode");
+    for (i=0; dst != NULL && err == 0 && i<o->k; i++) {
+        (*env)->GetIntArrayRegion(env, dstOff, i, 1, &off);
+        arr = (*env)->GetObjectArrayElement(env, dst, i);
+        if (arr == NULL || (*env)->ExceptionCheck(env))
+            break;
+        (*env)->SetByteArrayRegion(env, arr, off, o->sz,
+            (jbyte *)((char *)o->buf + (size_t)i * o->sz));
+        (*env)->DeleteLocalRef(env, arr);
+        if ((*env)->ExceptionCheck(env))
+            break;
+    }
+    free(o->buf);
+    free(o);
+}
+
+/*
+** Threads that one call may use, see fec_set_threads().
+*/
+JNIEXPORT jint JNICALL FEC_METHOD(nativeSetThreads)
+  (JNIEnv *env, jclass clz, jint n) {
+
+    return fec_set_threads(n);
+}
+
 JNIEXPORT jlong JNICALL FEC_METHOD(nativeNewFEC)
     (JNIEnv * env, jobject obj, jint k, jint n) {
     // uintptr_t is needed for systems where sizeof(void*) < sizeof(long)
-    return (jlong)(uintptr_t)fec_new(k,n);
+    // codes are shared between all instances with the same k and n
+    struct fec_parms *code = fec_acquire(k,n);
+    if (code == NULL)
+        throw_fec_error(env, k < 1 || k > n || n > GF_SIZE + 1 ?
+            FEC_EINVAL : FEC_ENOMEM);
+    return (jlong)(uintptr_t)code;
 }
 
 JNIEXPORT void JNICALL FEC_METHOD(nativeFreeFEC)
     (JNIEnv * env, jobject obj) {
     jlong code = (*env)->GetLongField(env, obj, codeField);
-    fec_free((void *)(uintptr_t)code);
+    fec_release((void *)(uintptr_t)code);
 }
@@ -59,6 +59,102 @@
 #define bzero(d, siz)       memset((d), '\0', (siz))
 #endif
 
+/*
+ * threads: locking, for state shared by the threads using one code,
+ * one-time initialization, thread-local storage, and the condition
+ * variables and threads of the worker pool.
+ */
+#ifdef WIN32
+#include <windows.h>
+typedef SRWLOCK fec_mutex_t;
+#define FEC_MUTEX_INITIALIZER   SRWLOCK_INIT
+#define fec_mutex_init(m)       InitializeSRWLock(m)
+#define fec_mutex_destroy(m)
+#define fec_mutex_lock(m)       AcquireSRWLockExclusive(m)
+#define fec_mutex_unlock(m)     ReleaseSRWLockExclusive(m)
+typedef INIT_ONCE fec_once_t;
+#define FEC_ONCE_INIT           INIT_ONCE_STATIC_INIT
+static BOOL CALLBACK
+fec_once_cb(PINIT_ONCE once, PVOID fn, PVOID *ctx)
+{
+    ((void (*)(void))fn)();
+    return TRUE;
+}
+#define fec_once(o, fn)         InitOnceExecuteOnce((o), fec_once_cb, (PVOID)(fn), NULL)
+typedef DWORD fec_tls_t;
+#define FEC_TLS_CALLBACK        NTAPI
+#define fec_tls_create(k, dtor) ((*(k) = FlsAlloc(dtor)) == FLS_OUT_OF_INDEXES ? -1 : 0)
+#define fec_tls_get(k)          FlsGetValue(k)
+#define fec_tls_set(k, v)       (FlsSetValue((k), (v)) ? 0 : -1)
+typedef CONDITION_VARIABLE fec_cond_t;
+#define FEC_COND_INITIALIZER    CONDITION_VARIABLE_INIT
+#define fec_cond_wait(c, m)     SleepConditionVariableSRW((c), (m), INFINITE, 0)
+#define fec_cond_broadcast(c)   WakeAllConditionVariable(c)
+#define FEC_THREAD_FN           DWORD WINAPI
+static int
+fec_thread_start(FEC_THREAD_FN (*fn)(void *), void *arg)
+{
+    HANDLE h = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)fn, arg, 0, NULL);
+
+    if (h == NULL)
+    return -1 ;
+    CloseHandle(h);
+    return 0 ;
+}
+#else
+#include <pthread.h>
+typedef pthread_mutex_t fec_mutex_t;
+#define FEC_MUTEX_INITIALIZER   PTHREAD_MUTEX_INITIALIZER
+#define fec_mutex_init(m)       pthread_mutex_init((m), NULL)
+#define fec_mutex_destroy(m)    pthread_mutex_destroy(m)
+#define fec_mutex_lock(m)       pthread_mutex_lock(m)
+#define fec_mutex_unlock(m)     pthread_mutex_unlock(m)
+typedef pthread_once_t fec_once_t;
+#define FEC_ONCE_INIT           PTHREAD_ONCE_INIT
+#define fec_once(o, fn)         pthread_once((o), (fn))
+typedef pthread_key_t fec_tls_t;
+#define FEC_TLS_CALLBACK
+#define fec_tls_create(k, dtor) pthread_key_create((k), (dtor))
+#define fec_tls_get(k)          pthread_getspecific(k)
+#define fec_tls_set(k, v)       pthread_setspecific((k), (v))
+typedef pthread_cond_t fec_cond_t;
+#define FEC_COND_INITIALIZER    PTHREAD_COND_INITIALIZER
+#define fec_cond_wait(c, m)     pthread_cond_wait((c), (m))
+#define fec_cond_broadcast(c)   pthread_cond_broadcast(c)
+#define FEC_THREAD_FN           void *
+static int
+fec_thread_start(FEC_THREAD_FN (*fn)(void *), void *arg)
+{
+    pthread_t t ;
+
+    if (pthread_create(&t, NULL, fn, arg) != 0)
+    return -1 ;
+    pthread_detach(t);
+    return 0 ;
+}
+#endif
+
+/*
+ * SIMD support. On x86 we build SSSE3 and AVX2 versions of the inner
+ * loops and pick one at runtime (see init_kernels()), so the library
+ * still runs on CPUs without them. gcc and clang need the target
+ * attribute to emit the instructions without a global -m flag; MSVC
+ * compiles the intrinsics unconditionally. Define FEC_NO_SIMD to get
+ * the plain C code only.
+ */
+#if !defined(FEC_NO_SIMD) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define FEC_X86_SIMD
+#define FEC_TARGET(t) __attribute__((target(t)))
+#include <immintrin.h>
+#elif !defined(FEC_NO_SIMD) && defined(_MSC_VER) && \
+    (defined(_M_X64) || defined(_M_IX86))
+#define FEC_X86_SIMD
+#define FEC_TARGET(t)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
 /*
  * stuff used for testing purposes only
  */
@@ -120,6 +216,7 @@ unsigned long ticks[10];    /* vars for timekeeping */
  * Primitive polynomials - see Lin & Costello, Appendix A,
  * and  Lee & Messerschmitt, p. 453.
  */
+#ifndef FEC_STATIC_TABLES
 static const char * const allPp[] = {    /* GF_BITS    polynomial        */
     NULL,                   /*  0    no code            */
     NULL,                   /*  1    no code            */
@@ -139,6 +236,7 @@ static const char * const allPp[] = {    /* GF_BITS    polynomial        */
     "1100000000000001",     /* 15    1+x+x^15           */
     "11010000000010001"     /* 16    1+x+x^3+x^12+x^16  */
 };
+#endif
 
 
 /*
@@ -148,12 +246,28 @@ static const char * const allPp[] = {    /* GF_BITS    polynomial        */
  * especially because it can be pre-initialized an put into a ROM!),
  * otherwhise we use a table of logarithms.
  * In any case the macro gf_mul(x,y) takes care of multiplications.
+ *
+ * With FEC_STATIC_TABLES the tables are not computed at all: the
+ * Makefile runs this file built with FEC_GENTAB, which prints them
+ * as const initializers to fec8-tables.h / fec16-tables.h, and the
+ * library includes that instead. They then live in .rodata, are
+ * shared between processes and cost nothing at startup.
  */
 
+#ifdef FEC_STATIC_TABLES
+#if (GF_BITS == 8)
+#include "fec8-tables.h"
+#elif (GF_BITS == 16)
+#include "fec16-tables.h"
+#else
+#error FEC_STATIC_TABLES needs GF_BITS 8 or 16
+#endif
+#else
 static gf gf_exp[2*GF_SIZE];        /* index->poly form conversion table    */
 static int gf_log[GF_SIZE + 1];     /* Poly->index form conversion table    */
 static gf inverse[GF_SIZE+1];       /* inverse of field elem.               */
                                     /* inv[\alpha**i]=\alpha**(GF_SIZE-i-1) */
+#endif
 
 /*
  * modnn(x) computes x % GF_SIZE, where GF_SIZE is 2**GF_BITS - 1,
@@ -182,14 +296,31 @@ modnn(int x)
  * declared with USE_GF_MULC . See usage in addmul1().
  */
 #if (GF_BITS <= 8)
+#ifndef FEC_STATIC_TABLES
 static gf gf_mul_table[GF_SIZE + 1][GF_SIZE + 1];
+#endif
 
 #define gf_mul(x,y) gf_mul_table[x][y]
 
-#define USE_GF_MULC register gf * __gf_mulc_
+#define USE_GF_MULC register const gf * __gf_mulc_
 #define GF_MULC0(c) __gf_mulc_ = gf_mul_table[c]
 #define GF_ADDMULC(dst, x) dst ^= __gf_mulc_[x]
 
+#if (GF_BITS == 8)
+/*
+ * gf_nib_table[c] holds c*x for the 16 values of the low nibble of x
+ * followed by c*x for the 16 values of the high nibble. Since
+ * c*x = c*(x & 0x0f) ^ c*(x & 0xf0), these are the only lookups the
+ * SIMD kernels need.
+ */
+#ifndef FEC_STATIC_TABLES
+static gf gf_nib_table[GF_SIZE + 1][32];
+#endif
+#endif
+
+#ifdef FEC_STATIC_TABLES
+#define init_mul_table()
+#else
 static void
 init_mul_table()
 {
@@ -200,7 +331,15 @@ init_mul_table()
 
     for (j=0; j< GF_SIZE+1; j++)
         gf_mul_table[0][j] = gf_mul_table[j][0] = 0;
+#if (GF_BITS == 8)
+    for (i=0; i< GF_SIZE+1; i++)
+    for (j=0; j< 16; j++) {
+        gf_nib_table[i][j] = gf_mul_table[i][j] ;
+        gf_nib_table[i][16 + j] = gf_mul_table[i][j << 4] ;
+    }
+#endif
 }
+#endif /* FEC_STATIC_TABLES */
 #else    /* GF_BITS > 8 */
 static inline gf
 gf_mul(int x, int y)
@@ -211,7 +350,7 @@ gf_mul(int x, int y)
 }
 #define init_mul_table()
 
-#define USE_GF_MULC register gf * __gf_mulc_
+#define USE_GF_MULC register const gf * __gf_mulc_
 #define GF_MULC0(c) __gf_mulc_ = &gf_exp[ gf_log[c] ]
 #define GF_ADDMULC(dst, x) { if (x) dst ^= __gf_mulc_[ gf_log[x] ] ; }
 #endif
@@ -228,26 +367,146 @@ gf_mul(int x, int y)
  */
 
 /*
- * i use malloc so many times, it is easier to put checks all in
- * one place.
+ * Memory. The library lives inside long running processes (a JVM),
+ * so running out of memory is reported to the caller (FEC_ENOMEM, or
+ * NULL from fec_new) and never ends the process.
+ *
+ * Temporary buffers come from a per-thread arena rather than malloc:
+ * one block per thread, grown to the most the thread has needed at
+ * once (up to FEC_ARENA_KEEP) and reused, so that the encode and
+ * decode paths neither call malloc in steady state nor contend with
+ * other threads. Allocations are released in LIFO order back to an
+ * arena_mark(). Whatever does not fit in the block is malloc'ed and
+ * freed on release.
+ */
+#define FEC_ARENA_ALIGN	64		/* also rounds sizes to cache lines */
+#define FEC_ARENA_MIN	(64*1024)
+#define FEC_ARENA_KEEP	(4*1024*1024)
+
+struct arena_big {			/* header of an overflow allocation */
+    struct arena_big *next ;
+} ;
+
+struct fec_arena {
+    char *base ;			/* the reusable block */
+    size_t size, used ;
+    size_t big_bytes ;
+    struct arena_big *big ;		/* overflow, most recent first */
+    size_t peak ;			/* most ever in use */
+} ;
+
+struct arena_mark {
+    size_t used, big_bytes ;
+    struct arena_big *big ;
+} ;
+
+static fec_tls_t arena_key ;
+static int arena_key_ok ;
+
+static void FEC_TLS_CALLBACK
+arena_destroy(void *arg)
+{
+    struct fec_arena *a = arg ;
+    struct arena_big *b ;
+
+    if (a == NULL)
+    return ;
+    while ((b = a->big) != NULL) {
+    a->big = b->next ;
+    free(b);
+    }
+    free(a->base);
+    free(a);
+}
+
+/*
+ * get_arena returns the calling thread's arena, NULL if out of memory.
  */
+static struct fec_arena *
+get_arena(void)
+{
+    struct fec_arena *a ;
+
+    if (!arena_key_ok)
+    return NULL ;
+    a = fec_tls_get(arena_key) ;
+    if (a == NULL) {
+    a = calloc(1, sizeof(*a)) ;
+    if (a != NULL && fec_tls_set(arena_key, a) != 0) {
+        free(a);
+        a = NULL ;
+    }
+    }
+    return a ;
+}
+
+static void
+arena_mark(struct fec_arena *a, struct arena_mark *m)
+{
+    m->used = a->used ;
+    m->big_bytes = a->big_bytes ;
+    m->big = a->big ;
+}
+
 static void *
-my_malloc(int sz, char *err_string)
+arena_alloc(struct fec_arena *a, size_t sz)
 {
-    void *p = malloc( sz );
-    if (p == NULL) {
-    fprintf(stderr, "-- malloc failure allocating %s\n", err_string);
-    exit(1) ;
+    struct arena_big *b ;
+    char *p ;
+
+    sz = (sz + FEC_ARENA_ALIGN - 1) & ~(size_t)(FEC_ARENA_ALIGN - 1) ;
+    if (a->used + sz <= a->size) {
+    p = a->base + a->used ;
+    a->used += sz ;
+    } else {
+    b = malloc(FEC_ARENA_ALIGN + sz) ;
+    if (b == NULL)
+        return NULL ;
+    b->next = a->big ;
+    a->big = b ;
+    a->big_bytes += sz ;
+    p = (char *)b + FEC_ARENA_ALIGN ;
     }
+    if (a->used + a->big_bytes > a->peak)
+    a->peak = a->used + a->big_bytes ;
     return p ;
 }
 
-#define NEW_GF_MATRIX(rows, cols) \
-    (gf *)my_malloc(rows * cols * sizeof(gf), " ## __LINE__ ## " )
+static void
+arena_release(struct fec_arena *a, struct arena_mark *m)
+{
+    struct arena_big *b ;
+    size_t want ;
+    char *p ;
+
+    while ((b = a->big) != m->big) {
+    a->big = b->next ;
+    free(b);
+    }
+    a->used = m->used ;
+    a->big_bytes = m->big_bytes ;
+    /*
+     * once nothing is in use, grow the block so that next time
+     * everything fits
+     */
+    if (a->used == 0 && a->big == NULL && a->peak > a->size) {
+    want = a->peak < FEC_ARENA_MIN ? FEC_ARENA_MIN : a->peak ;
+    if (want > FEC_ARENA_KEEP)
+        want = FEC_ARENA_KEEP ;
+    if (want > a->size && (p = malloc(want)) != NULL) {
+        free(a->base);
+        a->base = p ;
+        a->size = want ;
+    }
+    }
+}
 
 /*
  * initialize the data structures used for computations in GF.
  */
+#ifdef FEC_STATIC_TABLES
+#define generate_gf()
+#else
 static void
 generate_gf(void)
 {
@@ -310,6 +569,7 @@ generate_gf(void)
     for (i=2; i<=GF_SIZE; i++)
     inverse[i] = gf_exp[GF_SIZE-gf_log[i]];
 }
+#endif /* FEC_STATIC_TABLES */
 
 /*
  * Various linear algebra operations that i use often.
@@ -323,9 +583,13 @@ generate_gf(void)
  * calls are unfrequent in my typical apps so I did not bother.
  *
  * Note that gcc on
+ *
+ * addmul1() is the portable version and the reference for the SIMD
+ * kernels below; the macro goes through addmul_kernel, which
+ * init_kernels() points at the fastest one the CPU supports.
  */
 #define addmul(dst, src, c, sz) \
-    if (c != 0) addmul1(dst, src, c, sz)
+    if (c != 0) addmul_kernel(dst, src, c, sz)
 
 static void
 addmul1(gf *dst1, gf *src1, gf c, int sz)
@@ -340,6 +604,290 @@ addmul1(gf *dst1, gf *src1, gf c, int sz)
     GF_ADDMULC( *dst , *src );
 }
 
+#if defined(FEC_X86_SIMD) && (GF_BITS == 8)
+/*
+ * Split-nibble kernels: the two halves of gf_nib_table[c] are loaded
+ * into registers and pshufb looks up 16 (or 32) products at once.
+ * Unaligned loads are used throughout, callers pass packets at
+ * arbitrary offsets. The tail shorter than a vector goes to addmul1().
+ */
+FEC_TARGET("ssse3") static void
+addmul_ssse3(gf *dst, gf *src, gf c, int sz)
+{
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    const __m128i tlo = _mm_loadu_si128((const __m128i *)&gf_nib_table[c][0]);
+    const __m128i thi = _mm_loadu_si128((const __m128i *)&gf_nib_table[c][16]);
+    __m128i x, l, h ;
+
+    for (; sz >= 16; sz -= 16, dst += 16, src += 16) {
+    x = _mm_loadu_si128((const __m128i *)src);
+    l = _mm_shuffle_epi8(tlo, _mm_and_si128(x, mask));
+    h = _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(x, 4), mask));
+    x = _mm_xor_si128(l, h);
+    _mm_storeu_si128((__m128i *)dst,
+        _mm_xor_si128(x, _mm_loadu_si128((const __m128i *)dst)));
+    }
+    if (sz > 0)
+    addmul1(dst, src, c, sz);
+}
+
+FEC_TARGET("avx2") static void
+addmul_avx2(gf *dst, gf *src, gf c, int sz)
+{
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    const __m256i tlo = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)&gf_nib_table[c][0]));
+    const __m256i thi = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)&gf_nib_table[c][16]));
+    __m256i x0, x1, l0, l1, h0, h1 ;
+
+    /* two vectors per round hides most of the pshufb latency */
+    for (; sz >= 64; sz -= 64, dst += 64, src += 64) {
+    x0 = _mm256_loadu_si256((const __m256i *)src);
+    x1 = _mm256_loadu_si256((const __m256i *)(src + 32));
+    l0 = _mm256_shuffle_epi8(tlo, _mm256_and_si256(x0, mask));
+    l1 = _mm256_shuffle_epi8(tlo, _mm256_and_si256(x1, mask));
+    h0 = _mm256_shuffle_epi8(thi,
+        _mm256_and_si256(_mm256_srli_epi64(x0, 4), mask));
+    h1 = _mm256_shuffle_epi8(thi,
+        _mm256_and_si256(_mm256_srli_epi64(x1, 4), mask));
+    x0 = _mm256_xor_si256(_mm256_xor_si256(l0, h0),
+        _mm256_loadu_si256((const __m256i *)dst));
+    x1 = _mm256_xor_si256(_mm256_xor_si256(l1, h1),
+        _mm256_loadu_si256((const __m256i *)(dst + 32)));
+    _mm256_storeu_si256((__m256i *)dst, x0);
+    _mm256_storeu_si256((__m256i *)(dst + 32), x1);
+    }
+    for (; sz >= 32; sz -= 32, dst += 32, src += 32) {
+    x0 = _mm256_loadu_si256((const __m256i *)src);
+    l0 = _mm256_shuffle_epi8(tlo, _mm256_and_si256(x0, mask));
+    h0 = _mm256_shuffle_epi8(thi,
+        _mm256_and_si256(_mm256_srli_epi64(x0, 4), mask));
+    x0 = _mm256_xor_si256(_mm256_xor_si256(l0, h0),
+        _mm256_loadu_si256((const __m256i *)dst));
+    _mm256_storeu_si256((__m256i *)dst, x0);
+    }
+    if (sz > 0)
+    addmul1(dst, src, c, sz);
+}
+#endif /* FEC_X86_SIMD && GF_BITS == 8 */
+
+#if defined(FEC_X86_SIMD) && (GF_BITS == 16)
+/*
+ * For 16 bit symbols the same split works on four nibbles:
+ * c*x = c*n0 ^ c*(n1 << 4) ^ c*(n2 << 8) ^ c*(n3 << 12), and each
+ * product has a low and a high byte, so a constant needs eight 16-byte
+ * tables. They are built per call, since a precomputed set would take
+ * 8 MB: the product is linear in the other operand, so 16 gf_mul, one
+ * per bit, and XORs of those. This matters for short rows, such as
+ * those of invert_blocked(), where it is a good part of the call.
+ *
+ * The kernels split 16 symbols into a vector of low bytes and one of
+ * high bytes (packus), look up both result bytes for each nibble and
+ * interleave them back (unpacklo/hi). The AVX2 pack and unpack work
+ * within 128 bit lanes, which is fine since one undoes the other.
+ */
+#define GF16_MIN_SIMD 32	/* below this the tables cost too much */
+
+static void
+gf16_nib_tables(gf c, uint8_t t[8][16])
+{
+    int i, v ;
+    gf p[16], bit[4] ;
+
+    for (i = 0 ; i < 4 ; i++) {
+    for (v = 0 ; v < 4 ; v++)
+        bit[v] = gf_mul(c, 1 << (4*i + v)) ;
+    p[0] = 0 ;
+    for (v = 1 ; v < 16 ; v++)	/* the product is linear in v */
+        p[v] = p[v & (v - 1)] ^ bit[v & 1 ? 0 : v & 2 ? 1 : v & 4 ? 2 : 3] ;
+    for (v = 0 ; v < 16 ; v++) {
+        t[i][v] = p[v] & 0xff ;
+        t[4 + i][v] = p[v] >> 8 ;
+    }
+    }
+}
+
+FEC_TARGET("ssse3") static void
+addmul16_ssse3(gf *dst, gf *src, gf c, int sz)
+{
+    uint8_t t[8][16] ;
+    __m128i tl[4], th[4], a, b, lo, hi, n, rl, rh ;
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    const __m128i low = _mm_set1_epi16(0x00ff);
+    int i ;
+
+    if (sz < GF16_MIN_SIMD) {
+    addmul1(dst, src, c, sz);
+    return ;
+    }
+    gf16_nib_tables(c, t);
+    for (i = 0 ; i < 4 ; i++) {
+    tl[i] = _mm_loadu_si128((const __m128i *)t[i]);
+    th[i] = _mm_loadu_si128((const __m128i *)t[4 + i]);
+    }
+    for (; sz >= 16; sz -= 16, dst += 16, src += 16) {
+    a = _mm_loadu_si128((const __m128i *)src);
+    b = _mm_loadu_si128((const __m128i *)(src + 8));
+    lo = _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low));
+    hi = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+
+    n = _mm_and_si128(lo, mask);
+    rl = _mm_shuffle_epi8(tl[0], n);
+    rh = _mm_shuffle_epi8(th[0], n);
+    n = _mm_and_si128(_mm_srli_epi64(lo, 4), mask);
+    rl = _mm_xor_si128(rl, _mm_shuffle_epi8(tl[1], n));
+    rh = _mm_xor_si128(rh, _mm_shuffle_epi8(th[1], n));
+    n = _mm_and_si128(hi, mask);
+    rl = _mm_xor_si128(rl, _mm_shuffle_epi8(tl[2], n));
+    rh = _mm_xor_si128(rh, _mm_shuffle_epi8(th[2], n));
+    n = _mm_and_si128(_mm_srli_epi64(hi, 4), mask);
+    rl = _mm_xor_si128(rl, _mm_shuffle_epi8(tl[3], n));
+    rh = _mm_xor_si128(rh, _mm_shuffle_epi8(th[3], n));
+
+    _mm_storeu_si128((__m128i *)dst, _mm_xor_si128(
+        _mm_unpacklo_epi8(rl, rh), _mm_loadu_si128((const __m128i *)dst)));
+    _mm_storeu_si128((__m128i *)(dst + 8), _mm_xor_si128(
+        _mm_unpackhi_epi8(rl, rh),
+        _mm_loadu_si128((const __m128i *)(dst + 8))));
+    }
+    if (sz > 0)
+    addmul1(dst, src, c, sz);
+}
+
+FEC_TARGET("avx2") static void
+addmul16_avx2(gf *dst, gf *src, gf c, int sz)
+{
+    uint8_t t[8][16] ;
+    __m256i tl[4], th[4], a, b, lo, hi, n, rl, rh ;
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    const __m256i low = _mm256_set1_epi16(0x00ff);
+    int i ;
+
+    if (sz < GF16_MIN_SIMD) {
+    addmul1(dst, src, c, sz);
+    return ;
+    }
+    gf16_nib_tables(c, t);
+    for (i = 0 ; i < 4 ; i++) {
+    tl[i] = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)t[i]));
+    th[i] = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)t[4 + i]));
+    }
+    for (; sz >= 32; sz -= 32, dst += 32, src += 32) {
+    a = _mm256_loadu_si256((const __m256i *)src);
+    b = _mm256_loadu_si256((const __m256i *)(src + 16));
+    lo = _mm256_packus_epi16(_mm256_and_si256(a, low),
+        _mm256_and_si256(b, low));
+    hi = _mm256_packus_epi16(_mm256_srli_epi16(a, 8),
+        _mm256_srli_epi16(b, 8));
+
+    n = _mm256_and_si256(lo, mask);
+    rl = _mm256_shuffle_epi8(tl[0], n);
+    rh = _mm256_shuffle_epi8(th[0], n);
+    n = _mm256_and_si256(_mm256_srli_epi64(lo, 4), mask);
+    rl = _mm256_xor_si256(rl, _mm256_shuffle_epi8(tl[1], n));
+    rh = _mm256_xor_si256(rh, _mm256_shuffle_epi8(th[1], n));
+    n = _mm256_and_si256(hi, mask);
+    rl = _mm256_xor_si256(rl, _mm256_shuffle_epi8(tl[2], n));
+    rh = _mm256_xor_si256(rh, _mm256_shuffle_epi8(th[2], n));
+    n = _mm256_and_si256(_mm256_srli_epi64(hi, 4), mask);
+    rl = _mm256_xor_si256(rl, _mm256_shuffle_epi8(tl[3], n));
+    rh = _mm256_xor_si256(rh, _mm256_shuffle_epi8(th[3], n));
+
+    _mm256_storeu_si256((__m256i *)dst, _mm256_xor_si256(
+        _mm256_unpacklo_epi8(rl, rh),
+        _mm256_loadu_si256((const __m256i *)dst)));
+    _mm256_storeu_si256((__m256i *)(dst + 16), _mm256_xor_si256(
+        _mm256_unpackhi_epi8(rl, rh),
+        _mm256_loadu_si256((const __m256i *)(dst + 16))));
+    }
+    if (sz > 0)
+    addmul1(dst, src, c, sz);
+}
+#endif /* FEC_X86_SIMD && GF_BITS == 16 */
+
+typedef void addmul_fn(gf *dst, gf *src, gf c, int sz);
+
+static addmul_fn *addmul_kernel = addmul1 ;
+static int fec_kernel = FEC_KERNEL_SCALAR ;
+
+/*
+ * kernel_fn() returns the implementation of a kernel, or NULL if it
+ * was not compiled in.
+ */
+static addmul_fn *
+kernel_fn(int kernel)
+{
+    switch (kernel) {
+    case FEC_KERNEL_SCALAR:
+    return addmul1 ;
+#if defined(FEC_X86_SIMD) && (GF_BITS == 8)
+    case FEC_KERNEL_SSSE3:
+    return addmul_ssse3 ;
+    case FEC_KERNEL_AVX2:
+    return addmul_avx2 ;
+#elif defined(FEC_X86_SIMD) && (GF_BITS == 16)
+    case FEC_KERNEL_SSSE3:
+    return addmul16_ssse3 ;
+    case FEC_KERNEL_AVX2:
+    return addmul16_avx2 ;
+#endif
+    default:
+    return NULL ;
+    }
+}
+
+/*
+ * cpu_has() tells whether the running CPU (and OS, for AVX2, which
+ * needs the upper halves of the ymm registers saved) can run a kernel.
+ */
+static int
+cpu_has(int kernel)
+{
+#if defined(FEC_X86_SIMD) && defined(__GNUC__)
+    __builtin_cpu_init();
+    switch (kernel) {
+    case FEC_KERNEL_SSSE3:
+    return __builtin_cpu_supports("ssse3") ;
+    case FEC_KERNEL_AVX2:
+    return __builtin_cpu_supports("avx2") ;
+    }
+#elif defined(FEC_X86_SIMD)
+    int r[4] ;
+
+    __cpuid(r, 1);
+    switch (kernel) {
+    case FEC_KERNEL_SSSE3:
+    return (r[2] >> 9) & 1 ;
+    case FEC_KERNEL_AVX2:
+    /* osxsave and avx, then ymm state enabled in xcr0 */
+    if (((r[2] >> 27) & 3) != 3 || (_xgetbv(0) & 6) != 6)
+        return 0 ;
+    __cpuidex(r, 7, 0);
+    return (r[1] >> 5) & 1 ;
+    }
+#endif
+    return kernel == FEC_KERNEL_SCALAR ;
+}
+
+/*
+ * pick the best kernel. Must run after init_mul_table(), which builds
+ * the tables the kernels read.
+ */
+static void
+init_kernels(void)
+{
+    int kernel ;
+
+    for (kernel = FEC_KERNEL_AVX2 ; kernel > FEC_KERNEL_SCALAR ; kernel--)
+    if (kernel_fn(kernel) != NULL && cpu_has(kernel))
+        break ;
+    addmul_kernel = kernel_fn(kernel) ;
+    fec_kernel = kernel ;
+}
+
 /*
  * computes C = AB where A is n*k, B is k*m, C is n*m
  */
@@ -384,8 +932,12 @@ is_identity(gf *m, int k)
  * invert_mat() takes a matrix and produces its inverse
  * k is the size of the matrix.
  * (Gauss-Jordan, adapted from Numerical Recipes in C)
- * Return non-zero if singular.
+ * Return FEC_EINVAL if singular, FEC_ENOMEM if out of memory.
+ * Matrices of FEC_INV_MIN rows or more go to invert_blocked().
  */
+#define FEC_INV_MIN	128
+static int invert_blocked(gf *src, int k);
+
 DEB( int pivloops=0; int pivswaps=0 ; /* diagnostic */)
 static int
 invert_mat(gf *src, int k)
@@ -393,12 +945,25 @@ invert_mat(gf *src, int k)
     gf c, *p ;
     int irow, icol, row, col, i, ix ;
 
-    int error = 1 ;
-    int *indxc = my_malloc(k*sizeof(int), "indxc");
-    int *indxr = my_malloc(k*sizeof(int), "indxr");
-    int *ipiv = my_malloc(k*sizeof(int), "ipiv");
-    gf *id_row = NEW_GF_MATRIX(1, k);
-    gf *temp_row = NEW_GF_MATRIX(1, k);
+    int error = FEC_EINVAL ;
+    struct fec_arena *a ;
+    struct arena_mark m ;
+    int *indxc, *indxr, *ipiv ;
+    gf *id_row ;
+
+    if (k >= FEC_INV_MIN)
+    return invert_blocked(src, k) ;
+    if ((a = get_arena()) == NULL)
+    return FEC_ENOMEM ;
+    arena_mark(a, &m);
+    indxc = arena_alloc(a, k*sizeof(int));
+    indxr = arena_alloc(a, k*sizeof(int));
+    ipiv = arena_alloc(a, k*sizeof(int));
+    id_row = arena_alloc(a, k*sizeof(gf));
+    if (indxc == NULL || indxr == NULL || ipiv == NULL || id_row == NULL) {
+    error = FEC_ENOMEM ;
+    goto fail ;
+    }
 
     bzero(id_row, k*sizeof(gf));
     DEB( pivloops=0; pivswaps=0 ; /* diagnostic */ )
@@ -505,11 +1070,7 @@ found_piv:
     }
     error = 0 ;
 fail:
-    free(indxc);
-    free(indxr);
-    free(ipiv);
-    free(id_row);
-    free(temp_row);
+    arena_release(a, &m);
     return error ;
 }
 
@@ -531,17 +1092,26 @@ invert_vdm(gf *src, int k)
     int i, j, row, col ;
     gf *b, *c, *p;
     gf t, xx ;
+    struct fec_arena *a ;
+    struct arena_mark m ;
 
     if (k == 1)     /* degenerate case, matrix must be p^0 = 1 */
     return 0 ;
+    if ((a = get_arena()) == NULL)
+    return FEC_ENOMEM ;
+    arena_mark(a, &m);
     /*
      * c holds the coefficient of P(x) = Prod (x - p_i), i=0..k-1
      * b holds the coefficient for the matrix inversion
      */
-    c = NEW_GF_MATRIX(1, k);
-    b = NEW_GF_MATRIX(1, k);
+    c = arena_alloc(a, k*sizeof(gf));
+    b = arena_alloc(a, k*sizeof(gf));
 
-    p = NEW_GF_MATRIX(1, k);
+    p = arena_alloc(a, k*sizeof(gf));
+    if (c == NULL || b == NULL || p == NULL) {
+    arena_release(a, &m);
+    return FEC_ENOMEM ;
+    }
 
     for ( j=1, i = 0 ; i < k ; i++, j+=k ) {
     c[i] = 0 ;
@@ -575,15 +1145,14 @@ invert_vdm(gf *src, int k)
     for (col = 0 ; col < k ; col++ )
         src[col*k + row] = gf_mul(inverse[t], b[col] );
     }
-    free(c) ;
-    free(b) ;
-    free(p) ;
+    arena_release(a, &m);
     return 0 ;
 }
 
-static int fec_initialized = 0 ;
+static fec_once_t fec_init_once = FEC_ONCE_INIT ;
 
-void init_fec()
+static void
+do_init_fec(void)
 {
     TICK(ticks[0]);
     generate_gf();
@@ -593,7 +1162,56 @@ void init_fec()
     init_mul_table();
     TOCK(ticks[0]);
     DDB(fprintf(stderr, "init_mul_table took %ldus\n", ticks[0]);)
-    fec_initialized = 1 ;
+    init_kernels();
+    arena_key_ok = fec_tls_create(&arena_key, arena_destroy) == 0 ;
+}
+
+/*
+ * init_fec() builds the tables on first use. It is cheap to call again
+ * and safe to call from several threads at once.
+ */
+void init_fec()
+{
+    fec_once(&fec_init_once, do_init_fec);
+}
+
+/*
+ * fec_set_kernel() forces one of the FEC_KERNEL_* implementations of
+ * the inner loop, mostly for testing and benchmarking. Returns 0 on
+ * success, -1 if the kernel is not compiled in or the CPU lacks it.
+ * fec_get_kernel() returns the one in use.
+ */
+int
+fec_set_kernel(int kernel)
+{
+    init_fec();
+    if (kernel_fn(kernel) == NULL || !cpu_has(kernel))
+    return -1 ;
+    addmul_kernel = kernel_fn(kernel) ;
+    fec_kernel = kernel ;
+    return 0 ;
+}
+
+int
+fec_get_kernel(void)
+{
+    init_fec();
+    return fec_kernel ;
+}
+
+const char *
+fec_kernel_name(int kernel)
+{
+    switch (kernel) {
+    case FEC_KERNEL_SCALAR:
+    return "scalar" ;
+    case FEC_KERNEL_SSSE3:
+    return "ssse3" ;
+    case FEC_KERNEL_AVX2:
+    return "avx2" ;
+    default:
+    return "unknown" ;
+    }
 }
 
 /*
@@ -604,6 +1222,9 @@ void init_fec()
 
 #define FEC_MAGIC    0xFECC0DEC
 
+static struct fec_dcache *dcache_new(void);
+static void dcache_free(struct fec_dcache *c);
+
 void
 fec_free(struct fec_parms *p)
 {
@@ -612,38 +1233,34 @@ fec_free(struct fec_parms *p)
     fprintf(stderr, "bad parameters to fec_free\n");
     return ;
     }
+    dcache_free(p->dcache);
     free(p->enc_matrix);
     free(p);
 }
 
 /*
- * create a new encoder, returning a descriptor. This contains k,n and
- * the encoding matrix.
+ * systematic matrix from a Vandermonde one: fill the n*k matrix with
+ * powers of field elements, invert the top k*k part and multiply the
+ * bottom n-k rows by the inverse. O((n-k)*k^2). Only the bottom n-k
+ * rows of enc are written. Returns 0 or FEC_ENOMEM.
  */
-struct fec_parms *
-fec_new(int k, int n)
+static int
+build_vandermonde(gf *enc, int k, int n)
 {
-    int row, col ;
+    int row, col, err = 0 ;
     gf *p, *tmp_m ;
-
-    struct fec_parms *retval ;
-
-    if (fec_initialized == 0)
-    init_fec();
-
-    if (k > GF_SIZE + 1 || n > GF_SIZE + 1 || k > n ) {
-    fprintf(stderr, "Invalid parameters k %d n %d GF_SIZE %d\n",
-        k, n, GF_SIZE );
-    return NULL ;
+    struct fec_arena *a ;
+    struct arena_mark m ;
+
+    if ((a = get_arena()) == NULL)
+    return FEC_ENOMEM ;
+    arena_mark(a, &m);
+    tmp_m = arena_alloc(a, n * k * sizeof(gf));
+    if (tmp_m == NULL) {
+    arena_release(a, &m);
+    return FEC_ENOMEM ;
     }
-    retval = my_malloc(sizeof(struct fec_parms), "new_code");
-    retval->k = k ;
-    retval->n = n ;
-    retval->enc_matrix = NEW_GF_MATRIX(n, k);
-    retval->magic = ( ( FEC_MAGIC ^ k) ^ n) ^ (long)(retval->enc_matrix) ;
-    tmp_m = NEW_GF_MATRIX(n, k);
     /*
-     * fill the matrix with powers of field elements, starting from 0.
      * The first row is special, cannot be computed with exp. table.
      */
     tmp_m[0] = 1 ;
@@ -654,35 +1271,208 @@ fec_new(int k, int n)
         p[col] = gf_exp[modnn(row*col)];
     }
 
-    /*
-     * quick code to build systematic matrix: invert the top
-     * k*k vandermonde matrix, multiply right the bottom n-k rows
-     * by the inverse, and construct the identity matrix at the top.
-     */
+    if (invert_vdm(tmp_m, k)) /* much faster than invert_mat */
+    err = FEC_ENOMEM ;
+    else
+    matmul(tmp_m + k*k, tmp_m, enc + k*k, n - k, k, k);
+    arena_release(a, &m);
+    return err ;
+}
+
+/*
+ * systematic matrix with a Cauchy matrix below the identity: row k+r
+ * column c is 1/(x_r + y_c), with x_r = r and y_c = n-k+c, n distinct
+ * field elements. Every square submatrix of a Cauchy matrix is
+ * nonsingular, so any k rows of the whole matrix are too and the code
+ * is MDS. O((n-k)*k), one table lookup per entry.
+ */
+static void
+build_cauchy(gf *enc, int k, int n)
+{
+    int row, col ;
+    gf *p = enc + k*k ;
+
+    for (row = 0 ; row < n - k ; row++, p += k)
+    for (col = 0 ; col < k ; col++)
+        p[col] = inverse[row ^ (n - k + col)] ;
+}
+
+/*
+ * create a new encoder, returning a descriptor. This contains k,n and
+ * the encoding matrix, of the given type: FEC_VANDERMONDE, the
+ * original code, or FEC_CAUCHY, much faster to build for large k but
+ * producing different repair packets.
+ */
+struct fec_parms *
+fec_new_type(int k, int n, int type)
+{
+    int col ;
+    gf *p ;
+    struct fec_parms *retval ;
+
+    init_fec();
+
+    if (k > GF_SIZE + 1 || n > GF_SIZE + 1 || k > n ||
+        (type != FEC_VANDERMONDE && type != FEC_CAUCHY)) {
+    fprintf(stderr, "Invalid parameters k %d n %d type %d GF_SIZE %d\n",
+        k, n, type, GF_SIZE );
+    return NULL ;
+    }
+    retval = malloc(sizeof(struct fec_parms));
+    if (retval == NULL)
+    return NULL ;
+    retval->k = k ;
+    retval->n = n ;
+    retval->type = type ;
+    retval->enc_matrix = malloc(n * k * sizeof(gf));
+    retval->dcache = dcache_new() ;
+    if (retval->enc_matrix == NULL)
+    goto nomem ;
+    retval->magic = ( ( FEC_MAGIC ^ k) ^ n) ^ (long)(retval->enc_matrix) ;
+    retval->refs = 0 ;
+    retval->next_shared = NULL ;
+
     TICK(ticks[3]);
-    invert_vdm(tmp_m, k); /* much faster than invert_mat */
-    matmul(tmp_m + k*k, tmp_m, retval->enc_matrix + k*k, n - k, k, k);
+    if (type == FEC_CAUCHY)
+    build_cauchy(retval->enc_matrix, k, n);
+    else if (build_vandermonde(retval->enc_matrix, k, n))
+    goto nomem ;
     /*
      * the upper matrix is I so do not bother with a slow multiply
      */
     bzero(retval->enc_matrix, k*k*sizeof(gf) );
     for (p = retval->enc_matrix, col = 0 ; col < k ; col++, p += k+1 )
     *p = 1 ;
-    free(tmp_m);
     TOCK(ticks[3]);
 
     DDB(fprintf(stderr, "--- %ld us to build encoding matrix\n",
         ticks[3]);)
     DEB(pr_matrix(retval->enc_matrix, n, k, "encoding_matrix");)
     return retval ;
+
+nomem:
+    dcache_free(retval->dcache);
+    free(retval->enc_matrix);
+    free(retval);
+    return NULL ;
+}
+
+struct fec_parms *
+fec_new(int k, int n)
+{
+    return fec_new_type(k, n, FEC_VANDERMONDE) ;
+}
+
+/*
+ * Shared codes.
+ *
+ * Building the encoding matrix is expensive (milliseconds for k=128
+ * in the 16 bit field) and the result only depends on k, n and the
+ * type, so
+ * callers that create a code per segment should use fec_acquire()
+ * and fec_release() instead of fec_new() and fec_free(). Codes are
+ * reference counted and shared process-wide; encode and decode do not
+ * modify a code, so threads can use one concurrently. The last
+ * FEC_SHARED_IDLE released codes are kept around for the next
+ * fec_acquire() with the same parameters.
+ */
+#define FEC_SHARED_IDLE	8
+
+static fec_mutex_t shared_lock = FEC_MUTEX_INITIALIZER ;
+static struct fec_parms *shared_codes ;	/* most recently used first */
+static int shared_idle ;		/* codes in the list with refs == 0 */
+
+/*
+ * look up (k, n, type) and take a reference. Caller holds shared_lock.
+ */
+static struct fec_parms *
+shared_find(int k, int n, int type)
+{
+    struct fec_parms *p, **pp ;
+
+    for (pp = &shared_codes ; (p = *pp) != NULL ; pp = &p->next_shared) {
+    if (p->k == k && p->n == n && p->type == type) {
+        if (p->refs++ == 0)
+        shared_idle-- ;
+        *pp = p->next_shared ;
+        p->next_shared = shared_codes ;
+        shared_codes = p ;
+        return p ;
+    }
+    }
+    return NULL ;
+}
+
+struct fec_parms *
+fec_acquire_type(int k, int n, int type)
+{
+    struct fec_parms *p, *q ;
+
+    fec_mutex_lock(&shared_lock);
+    p = shared_find(k, n, type) ;
+    fec_mutex_unlock(&shared_lock);
+    if (p != NULL)
+    return p ;
+
+    /* build it unlocked, fec_new can take a while */
+    p = fec_new_type(k, n, type) ;
+    if (p == NULL)
+    return NULL ;
+    fec_mutex_lock(&shared_lock);
+    q = shared_find(k, n, type) ;
+    if (q == NULL) {
+    p->refs = 1 ;
+    p->next_shared = shared_codes ;
+    shared_codes = p ;
+    }
+    fec_mutex_unlock(&shared_lock);
+    if (q != NULL) {	/* lost the race, use the other one */
+    fec_free(p);
+    p = q ;
+    }
+    return p ;
+}
+
+struct fec_parms *
+fec_acquire(int k, int n)
+{
+    return fec_acquire_type(k, n, FEC_VANDERMONDE) ;
+}
+
+void
+fec_release(struct fec_parms *p)
+{
+    struct fec_parms *q, **pp, *victim = NULL, **vp = NULL ;
+
+    if (p == NULL)
+    return ;
+    fec_mutex_lock(&shared_lock);
+    if (p->refs <= 0) {
+    fec_mutex_unlock(&shared_lock);
+    fprintf(stderr, "bad parameters to fec_release\n");
+    return ;
+    }
+    if (--p->refs == 0 && ++shared_idle > FEC_SHARED_IDLE) {
+    /* drop the least recently used idle code */
+    for (pp = &shared_codes ; (q = *pp) != NULL ; pp = &q->next_shared)
+        if (q->refs == 0) {
+        victim = q ;
+        vp = pp ;
+        }
+    *vp = victim->next_shared ;
+    shared_idle-- ;
+    }
+    fec_mutex_unlock(&shared_lock);
+    if (victim != NULL)
+    fec_free(victim);
 }
 
 /*
  * fec_encode accepts as input pointers to n data packets of size sz,
  * and produces as output a packet pointed to by fec, computed
- * with index "index".
+ * with index "index". Returns 0, or FEC_EINVAL for a bad index.
  */
-void
+int
 fec_encode(struct fec_parms *code, gf *src[], gf *fec, int index, int sz)
 {
     int i, k = code->k ;
@@ -698,9 +1488,721 @@ fec_encode(struct fec_parms *code, gf *src[], gf *fec, int index, int sz)
         bzero(fec, sz*sizeof(gf));
     for (i = 0; i < k ; i++)
             addmul(fec, src[i], p[i], sz ) ;
-    } else
+    } else {
     fprintf(stderr, "Invalid index %d (max %d)\n",
         index, code->n - 1 );
+    return FEC_EINVAL ;
+    }
+    return 0 ;
+}
+
+/*
+ * Packets are processed in strips small enough that the current strip
+ * of every output stays in the cache while the strips of the k source
+ * packets stream past it. FEC_TILE_BYTES is the budget for the outputs
+ * (a typical L2), FEC_MIN_STRIP keeps the per-call overhead of the
+ * kernels (notably the 16 bit table setup) in check. Both in bytes.
+ */
+#define FEC_TILE_BYTES	(256*1024)
+#define FEC_MIN_STRIP	1024
+
+/*
+ * strip_len() returns the strip length, in symbols, for nbuf buffers
+ * live at once out of packets of sz symbols.
+ */
+static int
+strip_len(int nbuf, int sz)
+{
+    int strip = FEC_TILE_BYTES / ((nbuf + 1) * sizeof(gf)) ;
+
+    if (strip < FEC_MIN_STRIP / (int)sizeof(gf))
+    strip = FEC_MIN_STRIP / sizeof(gf) ;
+    strip &= ~(64 / sizeof(gf) - 1) ;	/* whole cache lines */
+    return strip < sz ? strip : sz ;
+}
+
+/*
+ * Parallel engine.
+ *
+ * Off by default; fec_set_threads(n) with n > 1 lets a single encode or
+ * decode, or a batch of segments, use up to n threads: the caller and
+ * n-1 workers of a pool started on first use. The work of a call is cut
+ * into tasks, each a strip of the packets of one segment (and, for
+ * encodes with few strips, a group of the output rows), so that tasks
+ * write disjoint memory and need no locking. Each participant starts
+ * with an equal range of task numbers and, once done with its own,
+ * steals the upper half of the range of another one. Workers take the
+ * scratch memory of a job from their own arenas, and sit it out if
+ * they cannot get it; the caller's share is allocated before anything
+ * is touched, so that running out of memory leaves the packets alone.
+ *
+ * The pool runs one call at a time; other callers meanwhile run their
+ * tasks themselves, serially. Calls that are too small to amortize
+ * waking the workers (FEC_PAR_MIN symbol multiplications) are always
+ * serial.
+ */
+#define FEC_MAX_THREADS	64
+#define FEC_PAR_MIN	(1 << 21)
+#define FEC_PAR_TASKS	4		/* tasks per participant, at least */
+
+struct fec_range {			/* tasks [lo, hi) of a participant */
+    fec_mutex_t lock ;
+    int lo, hi ;
+    char pad[64] ;			/* keep them on separate lines */
+} ;
+
+struct par_seg {			/* how a segment is cut in tasks */
+    int first ;				/* number of its first task */
+    int strip, nstrips ;		/* in symbols */
+    int group ;				/* output rows per task */
+    int *miss, nmiss ;			/* decode: rows to rebuild */
+    gf *m_dec ;				/* decode: inverse of its erased
+					   submatrix, nmiss^2 */
+    gf **out ;				/* decode_to: where source i goes,
+					   NULL for fec_decode */
+    int *sidx ;				/* decode_to: the indexes as if
+					   shuffled, for m_dec */
+    gf **src, **rep ;			/* decode_to: source i or NULL, and
+					   the repair packet for miss[r] */
+    int *mv, nmv ;			/* decode_to: positions of the
+					   sources to move or copy */
+} ;
+
+struct fec_job {
+    void (*run)(struct fec_job *job, int task, gf *tmp) ;
+    struct fec_segment *seg ;
+    struct par_seg *ps ;
+    int nseg, ntasks ;
+    size_t scratch ;			/* bytes of tmp each participant needs */
+    void *arg ;				/* for jobs that are not segments */
+    int nparts ;			/* participants */
+    struct fec_range range[FEC_MAX_THREADS] ;
+} ;
+
+static struct {
+    fec_mutex_t lock ;			/* protects all of the pool */
+    fec_cond_t wake, done ;
+    int nthreads ;			/* configured, 1 = serial */
+    int nworkers ;			/* started */
+    int busy ;				/* a job is running */
+    int active ;			/* workers still on it */
+    unsigned long gen ;			/* bumped for each job */
+    unsigned long born[FEC_MAX_THREADS] ;	/* gen when a worker started */
+    struct fec_job *job ;
+} pool = { FEC_MUTEX_INITIALIZER, FEC_COND_INITIALIZER,
+    FEC_COND_INITIALIZER, 1 } ;
+
+/*
+ * fec_set_threads sets the number of threads (including the caller)
+ * that a call may use. 1 turns the parallel engine off. Returns the
+ * number actually set.
+ */
+int
+fec_set_threads(int n)
+{
+    if (n < 1)
+    n = 1 ;
+    if (n > FEC_MAX_THREADS)
+    n = FEC_MAX_THREADS ;
+    fec_mutex_lock(&pool.lock);
+    pool.nthreads = n ;
+    fec_mutex_unlock(&pool.lock);
+    return n ;
+}
+
+int
+fec_get_threads(void)
+{
+    int n ;
+
+    fec_mutex_lock(&pool.lock);
+    n = pool.nthreads ;
+    fec_mutex_unlock(&pool.lock);
+    return n ;
+}
+
+/*
+ * threads to plan a call of the given work for
+ */
+static int
+par_threads(double work)
+{
+    return work < FEC_PAR_MIN ? 1 : fec_get_threads() ;
+}
+
+static int
+range_take(struct fec_range *r)
+{
+    int t = -1 ;
+
+    fec_mutex_lock(&r->lock);
+    if (r->lo < r->hi)
+    t = r->lo++ ;
+    fec_mutex_unlock(&r->lock);
+    return t ;
+}
+
+/*
+ * steal the upper half of the tasks left to another participant, keep
+ * the first of them for immediate use and the rest as our range.
+ */
+static int
+range_steal(struct fec_job *job, int me)
+{
+    struct fec_range *r ;
+    int i, n, lo, hi ;
+
+    for (i = 1 ; i < job->nparts ; i++) {
+    r = &job->range[(me + i) % job->nparts] ;
+    fec_mutex_lock(&r->lock);
+    n = r->hi - r->lo ;
+    if (n > 0) {
+        hi = r->hi ;
+        lo = r->hi = hi - (n + 1) / 2 ;
+        fec_mutex_unlock(&r->lock);
+        r = &job->range[me] ;
+        fec_mutex_lock(&r->lock);
+        r->lo = lo + 1 ;
+        r->hi = hi ;
+        fec_mutex_unlock(&r->lock);
+        return lo ;
+    }
+    fec_mutex_unlock(&r->lock);
+    }
+    return -1 ;
+}
+
+static void
+job_work(struct fec_job *job, int me, gf *tmp)
+{
+    int t ;
+
+    while ((t = range_take(&job->range[me])) >= 0 ||
+        (t = range_steal(job, me)) >= 0)
+    job->run(job, t, tmp);
+}
+
+static FEC_THREAD_FN
+pool_worker(void *arg)
+{
+    int id = (int)(intptr_t)arg ;
+    unsigned long seen ;
+    struct fec_job *job ;
+    struct fec_arena *a ;
+    struct arena_mark m ;
+    gf *tmp ;
+
+    fec_mutex_lock(&pool.lock);
+    seen = pool.born[id] ;
+    for (;;) {
+    while (pool.gen == seen)
+        fec_cond_wait(&pool.wake, &pool.lock);
+    seen = pool.gen ;
+    job = pool.job ;
+    if (job == NULL || id >= job->nparts)
+        continue ;
+    fec_mutex_unlock(&pool.lock);
+    tmp = NULL ;
+    if ((a = get_arena()) != NULL) {
+        arena_mark(a, &m);
+        if (job->scratch == 0 ||
+        (tmp = arena_alloc(a, job->scratch)) != NULL)
+        job_work(job, id, tmp);
+        arena_release(a, &m);
+    }
+    fec_mutex_lock(&pool.lock);
+    if (--pool.active == 0)
+        fec_cond_broadcast(&pool.done);
+    }
+    return 0 ;
+}
+
+/*
+ * job_run runs all the tasks of job, on the pool if it is free and
+ * enabled, otherwise in the calling thread. tmp is the caller's
+ * scratch.
+ */
+static void
+job_run(struct fec_job *job, gf *tmp)
+{
+    int i, n ;
+
+    job->nparts = 1 ;
+    if (job->ntasks > 1) {
+    fec_mutex_lock(&pool.lock);
+    if (!pool.busy && pool.nthreads > 1) {
+        while (pool.nworkers < pool.nthreads - 1) {
+        pool.born[pool.nworkers + 1] = pool.gen ;
+        if (fec_thread_start(pool_worker,
+            (void *)(intptr_t)(pool.nworkers + 1)) != 0)
+            break ;
+        pool.nworkers++ ;
+        }
+        n = pool.nthreads < pool.nworkers + 1 ?
+        pool.nthreads : pool.nworkers + 1 ;
+        job->nparts = n < job->ntasks ? n : job->ntasks ;
+    }
+    if (job->nparts > 1) {
+        for (i = 0 ; i < job->nparts ; i++) {
+        fec_mutex_init(&job->range[i].lock);
+        job->range[i].lo = (long)job->ntasks * i / job->nparts ;
+        job->range[i].hi = (long)job->ntasks * (i + 1) / job->nparts ;
+        }
+        pool.busy = 1 ;
+        pool.job = job ;
+        pool.active = job->nparts - 1 ;
+        pool.gen++ ;
+        fec_cond_broadcast(&pool.wake);
+    }
+    fec_mutex_unlock(&pool.lock);
+    }
+    if (job->nparts == 1) {
+    for (i = 0 ; i < job->ntasks ; i++)
+        job->run(job, i, tmp);
+    return ;
+    }
+    job_work(job, 0, tmp);
+    fec_mutex_lock(&pool.lock);
+    while (pool.active > 0)
+    fec_cond_wait(&pool.done, &pool.lock);
+    pool.job = NULL ;
+    pool.busy = 0 ;
+    fec_mutex_unlock(&pool.lock);
+    for (i = 0 ; i < job->nparts ; i++)
+    fec_mutex_destroy(&job->range[i].lock);
+}
+
+/*
+ * job_task maps a task number to its segment, and the number of the
+ * task within the segment.
+ */
+static int
+job_task(struct fec_job *job, int task, int *t)
+{
+    int lo = 0, hi = job->nseg - 1, mid ;
+
+    while (lo < hi) {
+    mid = (lo + hi + 1) / 2 ;
+    if (job->ps[mid].first <= task)
+        lo = mid ;
+    else
+        hi = mid - 1 ;
+    }
+    *t = task - job->ps[lo].first ;
+    return lo ;
+}
+
+/*
+ * Blocked Gauss-Jordan for large matrices, e.g. the erased submatrix
+ * of a 16 bit code with k in the thousands.
+ *
+ * invert_mat updates the whole matrix once per column, k passes over
+ * k^2 symbols that do not fit in the cache. Here the columns are
+ * taken FEC_INV_BLOCK at a time. For a panel J of b columns, with B
+ * the b x b block in the panel rows (rows swapped so that they are
+ * j0..j1-1), elimination on J alone gives, in place, W[i] =
+ * S[i][J] B^-1 for the other rows and W = B^-1 in the panel rows, as
+ * in invert_mat but on k x b symbols only; this is also where pivots
+ * are chosen, among the rows below. The whole panel step is then
+ *
+ *	S[i] = (i not in panel ? S[i] : 0) + sum over s of W[i][s] P[s]
+ *
+ * with P a copy of the b panel rows, and W[i] in columns J. Each row
+ * is read and written once per panel, the b rows of P stay in the
+ * cache, the multiply-accumulates are whole rows through addmul(),
+ * and rows are independent, so the update runs on the pool cut in
+ * groups of rows. Rows are swapped, not columns, so the inverse comes
+ * out with its columns permuted, and is put right at the end as in
+ * invert_mat.
+ */
+#define FEC_INV_BLOCK	32
+
+struct inv_panel {
+    gf *src, *w, *p ;
+    int k, j0, b ;			/* panel columns [j0, j0 + b) */
+    int rows ;				/* per task */
+} ;
+
+static void
+invert_task(struct fec_job *job, int task, gf *tmp)
+{
+    struct inv_panel *ip = job->arg ;
+    int i, s, k = ip->k, b = ip->b ;
+    int i1 = (task + 1) * ip->rows < k ? (task + 1) * ip->rows : k ;
+    gf *row, *w ;
+
+    for (i = task * ip->rows ; i < i1 ; i++) {
+    row = ip->src + i*k ;
+    if (i >= ip->j0 && i < ip->j0 + b)
+        bzero(row, k*sizeof(gf));
+    for (s = 0, w = ip->w + i ; s < b ; s++, w += k)
+        addmul(row, ip->p + s*k, *w, k);
+    for (s = 0, w = ip->w + i ; s < b ; s++, w += k)
+        row[ip->j0 + s] = *w ;
+    }
+}
+
+static int
+invert_blocked(gf *src, int k)
+{
+    struct fec_arena *a ;
+    struct arena_mark m ;
+    struct fec_job job ;
+    struct inv_panel ip ;
+    int *perm, i, j, jj, x, b, nthreads, error = FEC_EINVAL ;
+    gf c, piv, *w, *col ;
+
+    if ((a = get_arena()) == NULL)
+    return FEC_ENOMEM ;
+    arena_mark(a, &m);
+    perm = arena_alloc(a, k*sizeof(int));
+    ip.w = arena_alloc(a, k*FEC_INV_BLOCK*sizeof(gf));
+    ip.p = arena_alloc(a, k*FEC_INV_BLOCK*sizeof(gf));
+    if (perm == NULL || ip.w == NULL || ip.p == NULL) {
+    error = FEC_ENOMEM ;
+    goto fail ;
+    }
+    ip.src = src ;
+    ip.k = k ;
+    for (ip.j0 = 0 ; ip.j0 < k ; ip.j0 += b) {
+    b = ip.b = k - ip.j0 < FEC_INV_BLOCK ? k - ip.j0 : FEC_INV_BLOCK ;
+    w = ip.w ;			/* by columns, to use addmul on them */
+    for (i = 0 ; i < k ; i++)
+        for (x = 0 ; x < b ; x++)
+        w[x*k + i] = src[i*k + ip.j0 + x] ;
+    for (jj = 0 ; jj < b ; jj++) {
+        j = ip.j0 + jj ;
+        col = w + jj*k ;
+        for (i = j ; i < k && col[i] == 0 ; i++)
+        ;
+        if (i == k) {
+        fprintf(stderr, "singular matrix\n");
+        goto fail ;
+        }
+        perm[j] = i ;
+        if (i != j) {
+        for (x = 0 ; x < b ; x++)
+            SWAP(w[x*k + i], w[x*k + j], gf) ;
+        for (x = 0 ; x < k ; x++)
+            SWAP(src[i*k + x], src[j*k + x], gf) ;
+        }
+        /*
+         * as in invert_mat: scale the pivot row by c = 1/pivot, with
+         * c in column jj, and add col[i] times it to each other row i,
+         * which leaves col[i] * c in column jj.
+         */
+        c = inverse[col[j]] ;
+        for (x = 0 ; x < b ; x++) {
+        if (x == jj)
+            continue ;
+        piv = gf_mul(c, w[x*k + j]) ;
+        addmul(w + x*k, col, piv, k);
+        w[x*k + j] = piv ;
+        }
+        for (i = 0 ; i < k ; i++)
+        col[i] = gf_mul(c, col[i]) ;
+        col[j] = c ;
+    }
+    bcopy(src + ip.j0*k, ip.p, b*k*sizeof(gf));
+
+    nthreads = par_threads((double)k * k * b) ;
+    ip.rows = (k + nthreads * FEC_PAR_TASKS - 1) / (nthreads * FEC_PAR_TASKS) ;
+    job.run = invert_task ;
+    job.seg = NULL ;
+    job.ps = NULL ;
+    job.nseg = 0 ;
+    job.ntasks = (k + ip.rows - 1) / ip.rows ;
+    job.scratch = 0 ;
+    job.arg = &ip ;
+    job_run(&job, NULL);
+    }
+    for (j = k-1 ; j >= 0 ; j--)
+    if (perm[j] != j)
+        for (i = 0 ; i < k ; i++)
+        SWAP(src[i*k + j], src[i*k + perm[j]], gf) ;
+    error = 0 ;
+fail:
+    arena_release(a, &m);
+    return error ;
+}
+
+/*
+ * par_plan cuts a segment of nrows output rows of sz symbols into
+ * strips, and the rows into groups if there are not enough strips to
+ * keep nthreads busy (only when rows may be split). Returns the number
+ * of tasks.
+ */
+static int
+par_plan(struct par_seg *ps, int nrows, int sz, int nthreads, int split)
+{
+    int want = nthreads * FEC_PAR_TASKS, ngroups, min ;
+
+    ps->group = nrows > 0 ? nrows : 1 ;
+    ps->strip = strip_len(nrows, sz) ;
+    if (nthreads > 1 && ps->strip > 0 && (sz + ps->strip - 1) / ps->strip < want) {
+    min = FEC_MIN_STRIP / sizeof(gf) ;
+    ps->strip = (sz + want - 1) / want ;
+    ps->strip = (ps->strip + 64 / sizeof(gf) - 1) & ~(64 / sizeof(gf) - 1) ;
+    if (ps->strip < min)
+        ps->strip = min < sz ? min : sz ;
+    }
+    ps->nstrips = ps->strip > 0 ? (sz + ps->strip - 1) / ps->strip : 0 ;
+    if (split && nthreads > 1 && ps->nstrips > 0 && ps->nstrips < want) {
+    ngroups = (want + ps->nstrips - 1) / ps->nstrips ;
+    if (ngroups > nrows)
+        ngroups = nrows ;
+    ps->group = (nrows + ngroups - 1) / ngroups ;
+    }
+    return ps->nstrips * ((nrows + ps->group - 1) / ps->group) ;
+}
+
+/*
+ * encode_strip computes symbols [off, off+len) of outputs j0..j1-1.
+ * Each strip of a source packet is read once and accumulated into all
+ * the outputs, while their strips stay in the cache.
+ */
+static void
+encode_strip(struct fec_parms *code, gf *src[], gf *out[], int index[],
+    int j0, int j1, int off, int len)
+{
+    int i, j, k = code->k ;
+    gf *p ;
+
+    for (j = j0 ; j < j1 ; j++) {
+    if (index[j] < k)
+        bcopy(src[index[j]] + off, out[j] + off, len*sizeof(gf) ) ;
+    else
+        bzero(out[j] + off, len*sizeof(gf) ) ;
+    }
+    for (i = 0 ; i < k ; i++) {
+    for (j = j0 ; j < j1 ; j++) {
+        if (index[j] < k)
+        continue ;
+        p = &(code->enc_matrix[index[j]*k] );
+        addmul(out[j] + off, src[i] + off, p[i], len ) ;
+    }
+    }
+}
+
+static void
+encode_task(struct fec_job *job, int task, gf *tmp)
+{
+    int t, s = job_task(job, task, &t) ;
+    struct fec_segment *sg = &job->seg[s] ;
+    struct par_seg *ps = &job->ps[s] ;
+    int sz = GF_BITS > 8 ? sg->sz / 2 : sg->sz ;
+    int j0 = t / ps->nstrips * ps->group ;
+    int off = t % ps->nstrips * ps->strip ;
+    int j1 = j0 + ps->group < sg->nout ? j0 + ps->group : sg->nout ;
+
+    encode_strip(sg->code, sg->pkt, sg->out, sg->index, j0, j1, off,
+    sz - off < ps->strip ? sz - off : ps->strip);
+}
+
+static int
+check_encode(struct fec_segment *sg)
+{
+    int j ;
+
+    for (j = 0 ; j < sg->nout ; j++)
+    if (sg->index[j] < 0 || sg->index[j] >= sg->code->n) {
+        fprintf(stderr, "Invalid index %d (max %d)\n",
+        sg->index[j], sg->code->n - 1 );
+        return FEC_EINVAL ;
+    }
+    return 0 ;
+}
+
+/*
+ * fail_segments marks as out of memory the segments that had no error
+ * yet, and returns the new number of failed ones.
+ */
+static int
+fail_segments(struct fec_segment *seg, int nseg, int failed)
+{
+    int i ;
+
+    for (i = 0 ; i < nseg ; i++)
+    if (seg[i].err == 0) {
+        seg[i].err = FEC_ENOMEM ;
+        failed++ ;
+    }
+    return failed ;
+}
+
+/*
+ * fec_encode_segments and fec_decode_segments do what fec_encode_multi
+ * and fec_decode do, for each of nseg segments, so that callers with
+ * many segments (e.g. a whole file) cross into the library once and
+ * the parallel engine can spread all of them over the threads. The
+ * result of each segment goes to its err field; a failed segment does
+ * not stop the others. Return the number of segments that failed.
+ */
+int
+fec_encode_segments(struct fec_segment *seg, int nseg)
+{
+    struct fec_arena *a ;
+    struct arena_mark mark ;
+    struct fec_job job ;
+    double work = 0 ;
+    int i, nthreads, failed = 0 ;
+
+    for (i = 0 ; i < nseg ; i++) {
+    seg[i].err = check_encode(&seg[i]) ;
+    if (seg[i].err)
+        failed++ ;
+    else
+        work += (double)seg[i].code->k * seg[i].nout * seg[i].sz ;
+    }
+    if ((a = get_arena()) == NULL)
+    return fail_segments(seg, nseg, failed) ;
+    arena_mark(a, &mark);
+    if ((job.ps = arena_alloc(a, nseg * sizeof(struct par_seg))) == NULL) {
+    arena_release(a, &mark);
+    return fail_segments(seg, nseg, failed) ;
+    }
+    nthreads = par_threads(work) ;
+    job.run = encode_task ;
+    job.scratch = 0 ;
+    job.seg = seg ;
+    job.nseg = nseg ;
+    job.ntasks = 0 ;
+    for (i = 0 ; i < nseg ; i++) {
+    job.ps[i].first = job.ntasks ;
+    if (seg[i].err == 0)
+        job.ntasks += par_plan(&job.ps[i], seg[i].nout,
+        GF_BITS > 8 ? seg[i].sz / 2 : seg[i].sz, nthreads, 1) ;
+    }
+    job_run(&job, NULL);
+    arena_release(a, &mark);
+    return failed ;
+}
+
+/*
+ * fec_encode_multi produces nout packets in one pass over the source:
+ * out[j] gets the packet with index index[j]. Each strip of a source
+ * packet is read once and accumulated into all the outputs, instead of
+ * once per output as with repeated fec_encode calls.
+ * Returns 0, or FEC_EINVAL if any index is bad (nothing is written),
+ * or FEC_ENOMEM.
+ */
+int
+fec_encode_multi(struct fec_parms *code, gf *src[], gf *out[], int index[],
+    int nout, int sz)
+{
+    struct fec_segment seg ;
+
+    seg.code = code ;
+    seg.pkt = src ;
+    seg.out = out ;
+    seg.index = index ;
+    seg.nout = nout ;
+    seg.sz = sz ;
+    fec_encode_segments(&seg, 1);
+    return seg.err ;
+}
+
+/*
+ * Streaming encoder: the same outputs as fec_encode_multi, but the
+ * source packets are given one at a time, in any order, as they become
+ * available, and can be dropped as soon as fec_encoder_add returns.
+ * Each one is folded into every output right away, so only the outputs
+ * are ever held.
+ */
+struct fec_encoder {
+    struct fec_parms *code ;
+    gf **out ;
+    int *index ;
+    int nout, sz ;	/* sz in symbols */
+    int added ;		/* number of sources folded in */
+    unsigned char *seen ;	/* seen[i] once source i is */
+} ;
+
+/*
+ * fec_encoder_new starts encoding the packets listed in index[] into
+ * out[], like fec_encode_multi. out[] and index[] are copied, the
+ * packets themselves are cleared here and complete only once all k
+ * sources have been added. code must outlive the encoder. Returns NULL
+ * for a bad index (FEC_EINVAL) or no memory.
+ */
+struct fec_encoder *
+fec_encoder_new(struct fec_parms *code, gf *out[], int index[], int nout,
+    int sz)
+{
+    struct fec_encoder *e ;
+    struct fec_segment seg ;
+    int j ;
+
+    seg.code = code ;
+    seg.index = index ;
+    seg.nout = nout ;
+    if (nout < 0 || check_encode(&seg))
+    return NULL ;
+    e = malloc(sizeof(struct fec_encoder) + nout * (sizeof(gf *) +
+    sizeof(int)) + code->k) ;
+    if (e == NULL)
+    return NULL ;
+    e->code = code ;
+    e->out = (gf **)(e + 1) ;
+    e->index = (int *)(e->out + nout) ;
+    e->seen = (unsigned char *)(e->index + nout) ;
+    e->nout = nout ;
+    e->sz = GF_BITS > 8 ? sz / 2 : sz ;
+    e->added = 0 ;
+    bzero(e->seen, code->k);
+    for (j = 0 ; j < nout ; j++) {
+    e->out[j] = out[j] ;
+    e->index[j] = index[j] ;
+    bzero(out[j], e->sz * sizeof(gf));
+    }
+    return e ;
+}
+
+/*
+ * fec_encoder_add folds source packet i (0 <= i < k) into the outputs:
+ * copied to the ones with index i, accumulated into the repair ones.
+ * Strips of src stay in the cache while they are applied to all the
+ * outputs. Returns 0, or FEC_EINVAL if i is bad or was already added.
+ */
+int
+fec_encoder_add(struct fec_encoder *e, gf *src, int i)
+{
+    int j, off, len, k = e->code->k ;
+    int strip = strip_len(1, e->sz) ;
+    gf *p ;
+
+    if (i < 0 || i >= k || e->seen[i]) {
+    fprintf(stderr, "fec_encoder_add: bad or repeated source %d\n", i);
+    return FEC_EINVAL ;
+    }
+    e->seen[i] = 1 ;
+    e->added++ ;
+    for (off = 0 ; off < e->sz ; off += strip) {
+    len = e->sz - off < strip ? e->sz - off : strip ;
+    for (j = 0 ; j < e->nout ; j++) {
+        if (e->index[j] == i)
+        bcopy(src + off, e->out[j] + off, len*sizeof(gf) ) ;
+        else if (e->index[j] >= k) {
+        p = &(e->code->enc_matrix[e->index[j]*k] );
+        addmul(e->out[j] + off, src + off, p[i], len ) ;
+        }
+    }
+    }
+    return 0 ;
+}
+
+/*
+ * fec_encoder_finish frees the encoder. Returns 0 if all the sources
+ * were added and the outputs are complete, FEC_EINVAL otherwise (e.g.
+ * to abandon an encode).
+ */
+int
+fec_encoder_finish(struct fec_encoder *e)
+{
+    int err = e->added == e->code->k ? 0 : FEC_EINVAL ;
+
+    free(e);
+    return err ;
 }
 
 /*
@@ -711,6 +2213,9 @@ shuffle(gf *pkt[], int index[], int k)
 {
     int i;
 
+    for ( i = 0 ; i < k ; i++ )
+    if (index[i] < 0)
+        return 1 ;
     for ( i = 0 ; i < k ; ) {
     if (index[i] >= k || index[i] == i)
         i++ ;
@@ -742,40 +2247,599 @@ shuffle(gf *pkt[], int index[], int k)
 }
 
 /*
- * build_decode_matrix constructs the encoding matrix given the
- * indexes. The matrix must be already allocated as
- * a vector of k*k elements, in row-major order
+ * Erasure decoding. After the shuffle, every known column c holds
+ * source packet x_c, and the e rows miss[] hold repair packets
+ * y_r = sum over all c of G[j_r][c] x_c, with j_r = index[miss[r]] and
+ * G the encoding matrix. Adding the known columns in (subtraction is
+ * addition in GF(2^m)),
+ *	z_r = y_r + sum over known c of G[j_r][c] x_c
+ * leaves the e x e system A x_miss = z, A[r][i] = G[j_r][miss[i]].
+ * Only A is inverted, O(e^3) instead of O(k^3) for the whole k x k
+ * decode matrix, and in closed form for one or two erasures, which
+ * are the common case. The payload work, e*k multiply-accumulates, is
+ * the same as with the whole matrix.
+ *
+ * erasure_matrix puts the inverse of A in m, e*e symbols. Returns 0,
+ * or FEC_EINVAL for a bad index or a singular A (repeated indexes).
  */
-static gf *
-build_decode_matrix(struct fec_parms *code, gf *pkt[], int index[])
+static int
+erasure_matrix(struct fec_parms *code, int index[], int miss[], int e,
+    gf *m)
 {
-    int i , k = code->k ;
-    gf *p, *matrix = NEW_GF_MATRIX(k, k);
+    int r, i, k = code->k ;
+    gf det, a, *g ;
 
     TICK(ticks[9]);
-    for (i = 0, p = matrix ; i < k ; i++, p += k ) {
-#if 1 /* this is simply an optimization, not very useful indeed */
-    if (index[i] < k) {
-        bzero(p, k*sizeof(gf) );
-        p[i] = 1 ;
-    } else
-#endif
-    if (index[i] < code->n )
-        bcopy( &(code->enc_matrix[index[i]*k]), p, k*sizeof(gf) );
-    else {
+    for (r = 0 ; r < e ; r++) {
+    if (index[miss[r]] >= code->n) {
         fprintf(stderr, "decode: invalid index %d (max %d)\n",
-        index[i], code->n - 1 );
-        free(matrix) ;
-        return NULL ;
+        index[miss[r]], code->n - 1 );
+        return FEC_EINVAL ;
     }
+    g = &(code->enc_matrix[index[miss[r]]*k]) ;
+    for (i = 0 ; i < e ; i++)
+        m[r*e + i] = g[miss[i]] ;
     }
-    TICK(ticks[9]);
-    if (invert_mat(matrix, k)) {
-    free(matrix);
-    matrix = NULL ;
+    switch (e) {
+    case 1:
+    if (m[0] == 0)
+        return FEC_EINVAL ;
+    m[0] = inverse[m[0]] ;
+    break ;
+    case 2:		/* [a b ; c d]^-1 = [d b ; c a] / (ad + bc) */
+    det = gf_mul(m[0], m[3]) ^ gf_mul(m[1], m[2]) ;
+    if (det == 0)
+        return FEC_EINVAL ;
+    det = inverse[det] ;
+    a = m[0] ;
+    m[0] = gf_mul(m[3], det) ;
+    m[1] = gf_mul(m[1], det) ;
+    m[2] = gf_mul(m[2], det) ;
+    m[3] = gf_mul(a, det) ;
+    break ;
+    default:
+    if (invert_mat(m, e))
+        return FEC_EINVAL ;	/* or out of memory, rare */
     }
     TOCK(ticks[9]);
-    return matrix ;
+    return 0 ;
+}
+
+/*
+ * build_decode_matrix constructs the whole k x k decoding matrix given
+ * the (shuffled) indexes, from the inverse of the erased submatrix:
+ * row miss[i] has inv(A)[i][r] in column miss[r] and
+ * sum over r of inv(A)[i][r] G[j_r][c] in each known column c.
+ * Returns 0, or FEC_EINVAL / FEC_ENOMEM.
+ */
+static int
+build_decode_matrix(struct fec_parms *code, int index[], gf *matrix)
+{
+    int i, r, c, e = 0, k = code->k, err = FEC_ENOMEM ;
+    struct fec_arena *a = get_arena() ;
+    struct arena_mark mark ;
+    int *miss ;
+    gf *inv, *g, *p ;
+
+    if (a == NULL)
+    return FEC_ENOMEM ;
+    arena_mark(a, &mark);
+    miss = arena_alloc(a, k * sizeof(int)) ;
+    inv = arena_alloc(a, k * k * sizeof(gf)) ;
+    if (miss == NULL || inv == NULL)
+    goto done ;
+    err = FEC_EINVAL ;
+    bzero(matrix, k * k * sizeof(gf));
+    for (i = 0 ; i < k ; i++) {
+    if (index[i] < 0 || (index[i] < k && index[i] != i))
+        goto done ;
+    if (index[i] < k)
+        matrix[i*k + i] = 1 ;
+    else
+        miss[e++] = i ;
+    }
+    if (e > 0 && (err = erasure_matrix(code, index, miss, e, inv)) != 0)
+    goto done ;
+    for (i = 0 ; i < e ; i++) {
+    p = &matrix[miss[i]*k] ;
+    for (r = 0 ; r < e ; r++) {
+        p[miss[r]] = inv[i*e + r] ;
+        g = &(code->enc_matrix[index[miss[r]]*k]) ;
+        for (c = 0 ; c < k ; c++)
+        if (index[c] < k)
+            p[c] ^= gf_mul(inv[i*e + r], g[c]) ;
+    }
+    }
+    err = 0 ;
+done:
+    arena_release(a, &mark);
+    return err ;
+}
+
+/*
+ * Decode matrix cache.
+ *
+ * The decode matrix only depends on the indexes of the received
+ * packets (after shuffle), and in practice the same few erasure
+ * patterns come back all the time, so each code keeps the inverses
+ * (of the erased submatrix, see erasure_matrix) of the last
+ * FEC_DCACHE_ENTRIES patterns, most recently used first. One or two
+ * erasures are solved in closed form and not cached, nor are
+ * matrices larger than FEC_DCACHE_MAX_BYTES. Lookups copy the matrix out under the
+ * lock, so an entry may be evicted while a decode still runs.
+ */
+#define FEC_DCACHE_ENTRIES	16
+#define FEC_DCACHE_MAX_BYTES	(1024*1024)
+
+struct dcache_entry {
+    struct dcache_entry *next ;
+    unsigned long hash ;
+    int *key ;			/* k indexes */
+    gf *matrix ;		/* e*e inverse */
+} ;
+
+struct fec_dcache {
+    fec_mutex_t lock ;
+    struct dcache_entry *head ;	/* LRU list */
+    int count ;
+    unsigned long hits, misses ;
+} ;
+
+static struct fec_dcache *
+dcache_new(void)
+{
+    struct fec_dcache *c = malloc(sizeof(struct fec_dcache)) ;
+
+    if (c == NULL)
+    return NULL ;
+    fec_mutex_init(&c->lock);
+    c->head = NULL ;
+    c->count = 0 ;
+    c->hits = c->misses = 0 ;
+    return c ;
+}
+
+static void
+dcache_free(struct fec_dcache *c)
+{
+    struct dcache_entry *e ;
+
+    if (c == NULL)
+    return ;
+    while ((e = c->head) != NULL) {
+    c->head = e->next ;
+    free(e);
+    }
+    fec_mutex_destroy(&c->lock);
+    free(c);
+}
+
+static unsigned long
+dcache_hash(int index[], int k)
+{
+    unsigned long h = 5381 ;
+    int i ;
+
+    for (i = 0 ; i < k ; i++)
+    h = h * 33 + index[i] ;
+    return h ;
+}
+
+/*
+ * look up the pattern in index[] and move it to the front of the list.
+ * The caller holds the lock.
+ */
+static struct dcache_entry *
+dcache_find(struct fec_dcache *c, int index[], int k, unsigned long hash)
+{
+    struct dcache_entry *e, **pe ;
+
+    for (pe = &c->head ; (e = *pe) != NULL ; pe = &e->next) {
+    if (e->hash == hash && !bcmp(e->key, index, k*sizeof(int))) {
+        *pe = e->next ;
+        e->next = c->head ;
+        c->head = e ;
+        return e ;
+    }
+    }
+    return NULL ;
+}
+
+/*
+ * dcache_get copies the cached matrix for index[], msz symbols, to m;
+ * returns 0 if there is none.
+ */
+static int
+dcache_get(struct fec_dcache *c, int index[], int k, gf *m, int msz)
+{
+    struct dcache_entry *e ;
+    unsigned long hash = dcache_hash(index, k) ;
+
+    if (c == NULL)
+    return 0 ;
+    fec_mutex_lock(&c->lock);
+    e = dcache_find(c, index, k, hash) ;
+    if (e != NULL) {
+    bcopy(e->matrix, m, msz*sizeof(gf));
+    c->hits++ ;
+    } else
+    c->misses++ ;
+    fec_mutex_unlock(&c->lock);
+    return e != NULL ;
+}
+
+/*
+ * dcache_put remembers m as the matrix for index[], evicting the least
+ * recently used entry if the cache is full. Failing to allocate is not
+ * an error, the matrix is just not cached.
+ */
+static void
+dcache_put(struct fec_dcache *c, int index[], int k, gf *m, int msz)
+{
+    struct dcache_entry *e, **pe ;
+    unsigned long hash = dcache_hash(index, k) ;
+
+    if (c == NULL || msz*sizeof(gf) > FEC_DCACHE_MAX_BYTES)
+    return ;
+    e = malloc(sizeof(*e) + k*sizeof(int) + msz*sizeof(gf)) ;
+    if (e == NULL)
+    return ;
+    e->hash = hash ;
+    e->key = (int *)(e + 1) ;
+    e->matrix = (gf *)(e->key + k) ;
+    bcopy(index, e->key, k*sizeof(int));
+    bcopy(m, e->matrix, msz*sizeof(gf));
+
+    fec_mutex_lock(&c->lock);
+    if (dcache_find(c, index, k, hash) != NULL) {
+    /* another thread got there first */
+    fec_mutex_unlock(&c->lock);
+    free(e);
+    return ;
+    }
+    e->next = c->head ;
+    c->head = e ;
+    if (++c->count > FEC_DCACHE_ENTRIES) {
+    for (pe = &c->head ; (*pe)->next != NULL ; pe = &(*pe)->next)
+        ;
+    free(*pe);
+    *pe = NULL ;
+    c->count-- ;
+    }
+    fec_mutex_unlock(&c->lock);
+}
+
+/*
+ * get_erasure_matrix is erasure_matrix, from the cache if possible.
+ */
+static int
+get_erasure_matrix(struct fec_parms *code, int index[], int miss[], int e,
+    gf *m)
+{
+    int k = code->k, err, cached = e > 2 &&
+    e*e*sizeof(gf) <= FEC_DCACHE_MAX_BYTES ;
+
+    if (cached && dcache_get(code->dcache, index, k, m, e*e))
+    return 0 ;
+    err = erasure_matrix(code, index, miss, e, m) ;
+    if (err == 0 && cached)
+    dcache_put(code->dcache, index, k, m, e*e);
+    return err ;
+}
+
+/*
+ * fec_decode_matrix computes, without the cache, the k*k decode matrix
+ * for the indexes of the received packets, laid out as fec_decode
+ * expects after shuffling (index[i] == i for source packets). Used to
+ * time the inversion. Returns 0 or an error.
+ */
+int
+fec_decode_matrix(struct fec_parms *code, int index[], gf *matrix)
+{
+    return build_decode_matrix(code, index, matrix) ;
+}
+
+/*
+ * fec_decode_cache_stats returns the number of decodes that found
+ * their matrix in the cache, and of those that had to invert it.
+ * Either pointer may be NULL.
+ */
+void
+fec_decode_cache_stats(struct fec_parms *code, unsigned long *hits,
+    unsigned long *misses)
+{
+    struct fec_dcache *c = code->dcache ;
+    unsigned long h = 0, m = 0 ;
+
+    if (c != NULL) {
+    fec_mutex_lock(&c->lock);
+    h = c->hits ;
+    m = c->misses ;
+    fec_mutex_unlock(&c->lock);
+    }
+    if (hits != NULL)
+    *hits = h ;
+    if (misses != NULL)
+    *misses = m ;
+}
+
+/*
+ * decode_to_strip is decode_task for fec_decode_to: the packets are
+ * where the caller put them, with their indexes in any order. z is
+ * built in tmp from the repair packets, inv(A) z goes to a second set
+ * of strips and from there to out[], and the received source strips
+ * are copied to out[] (in place, through a third set, since their
+ * slots may hold each other). Every packet strip is read before any
+ * is written, and while it is in the cache.
+ */
+static void
+decode_to_strip(struct fec_segment *sg, struct par_seg *ps, int off,
+    int len, gf *tmp)
+{
+    int i, r, k = sg->code->k, e = ps->nmiss, strip = ps->strip ;
+    int *miss = ps->miss ;
+    gf *z = tmp, *x = tmp + e * strip, *mv = x + e * strip, *p ;
+
+    if (e > 0) {	/* else only copies, and tmp may be NULL */
+    for (r = 0 ; r < e ; r++)
+    bcopy(ps->rep[r] + off, z + r * strip, len*sizeof(gf));
+    for (i = 0 ; i < k ; i++) {
+    if (ps->src[i] == NULL)
+        continue ;
+    for (r = 0 ; r < e ; r++)
+        addmul(z + r * strip, ps->src[i] + off,
+        sg->code->enc_matrix[ps->sidx[miss[r]]*k + i], len) ;
+    }
+    bzero(x, e * strip * sizeof(gf));
+    for (r = 0 ; r < e ; r++)
+    for (i = 0, p = x ; i < e ; i++, p += strip)
+        addmul(p, z + r * strip, ps->m_dec[i*e + r], len) ;
+    }
+
+    if (ps->out == sg->pkt) {
+    for (i = 0, p = mv ; i < ps->nmv ; i++, p += strip)
+        bcopy(sg->pkt[ps->mv[i]] + off, p, len*sizeof(gf));
+    for (i = 0, p = mv ; i < ps->nmv ; i++, p += strip)
+        bcopy(p, ps->out[sg->index[ps->mv[i]]] + off, len*sizeof(gf));
+    } else {
+    for (i = 0 ; i < k ; i++)
+        if (ps->src[i] != NULL && ps->src[i] != ps->out[i])
+        bcopy(ps->src[i] + off, ps->out[i] + off, len*sizeof(gf));
+    }
+    for (i = 0, p = x ; i < e ; i++, p += strip)
+    bcopy(p, ps->out[miss[i]] + off, len*sizeof(gf));
+}
+
+/*
+ * decode_task rebuilds one strip of the missing rows of a segment.
+ * Each strip of a known source packet is read once and added into the
+ * repair packets in the missing rows, turning them into z (see
+ * erasure_matrix) in place; then inv(A) z goes through strip-sized
+ * temporaries back to the missing rows. Since the received packets
+ * are overwritten strip by strip, a task may not be split by rows.
+ */
+static void
+decode_task(struct fec_job *job, int task, gf *tmp)
+{
+    int t, s = job_task(job, task, &t) ;
+    struct fec_segment *sg = &job->seg[s] ;
+    struct par_seg *ps = &job->ps[s] ;
+    int sz = GF_BITS > 8 ? sg->sz / 2 : sg->sz ;
+    int k = sg->code->k, e = ps->nmiss, strip = ps->strip, off = t * strip ;
+    int len = sz - off < strip ? sz - off : strip ;
+    int i, r, col, *miss = ps->miss ;
+    gf **pkt = sg->pkt, *m_dec = ps->m_dec, *p ;
+
+    if (ps->out != NULL) {
+    if (sg->err == 0)
+        decode_to_strip(sg, ps, off, len, tmp);
+    return ;
+    }
+    for (col = 0 ; col < k ; col++ ) {
+    if (sg->index[col] >= k)
+        continue ;
+    for (r = 0 ; r < e ; r++)
+        addmul(pkt[miss[r]] + off, pkt[col] + off,
+        sg->code->enc_matrix[sg->index[miss[r]]*k + col], len) ;
+    }
+    bzero(tmp, e * strip * sizeof(gf) ) ;
+    for (r = 0 ; r < e ; r++ )
+    for (i = 0, p = tmp ; i < e ; i++, p += strip)
+        addmul(p, pkt[miss[r]] + off, m_dec[i*e + r], len) ;
+    /*
+     * move the strips to their final destination
+     */
+    for (i = 0, p = tmp ; i < ps->nmiss ; i++, p += strip)
+    bcopy(p, pkt[miss[i]] + off, len*sizeof(gf));
+}
+
+/*
+ * decode_to_prepare is decode_prepare for fec_decode_to: the packets
+ * are not shuffled, the indexes they would have once shuffled go to
+ * ps->sidx, from which the decode matrix is found as usual.
+ */
+static int
+decode_to_prepare(struct fec_arena *a, struct fec_segment *sg,
+    struct par_seg *ps)
+{
+    int p, c, e = 0, k = sg->code->k, err ;
+
+    ps->src = arena_alloc(a, k * sizeof(gf *));
+    ps->rep = arena_alloc(a, k * sizeof(gf *));
+    ps->sidx = arena_alloc(a, k * sizeof(int));
+    ps->miss = arena_alloc(a, k * sizeof(int));
+    ps->mv = arena_alloc(a, k * sizeof(int));
+    if (ps->src == NULL || ps->rep == NULL || ps->sidx == NULL ||
+        ps->miss == NULL || ps->mv == NULL)
+    return FEC_ENOMEM ;
+    bzero(ps->src, k * sizeof(gf *));
+    ps->nmv = 0 ;
+    for (p = 0 ; p < k ; p++) {
+    c = sg->index[p] ;
+    if (c < 0 || c >= sg->code->n) {
+        fprintf(stderr, "decode: invalid index %d (max %d)\n",
+        c, sg->code->n - 1 );
+        return FEC_EINVAL ;
+    }
+    if (c >= k)
+        continue ;
+    if (ps->src[c] != NULL)
+        return FEC_EINVAL ;		/* duplicate */
+    ps->src[c] = sg->pkt[p] ;
+    ps->sidx[c] = c ;
+    if (ps->out == sg->pkt ? c != p : ps->out[c] != sg->pkt[p])
+        ps->mv[ps->nmv++] = p ;
+    }
+    for (c = 0 ; c < k ; c++)
+    if (ps->src[c] == NULL)
+        ps->miss[e++] = c ;
+    for (p = 0, c = 0 ; p < k ; p++)
+    if (sg->index[p] >= k) {
+        ps->rep[c] = sg->pkt[p] ;
+        ps->sidx[ps->miss[c++]] = sg->index[p] ;
+    }
+    if (e == 0)
+    return 0 ;
+    ps->m_dec = arena_alloc(a, e * e * sizeof(gf));
+    if (ps->m_dec == NULL)
+    return FEC_ENOMEM ;
+    err = get_erasure_matrix(sg->code, ps->sidx, ps->miss, e, ps->m_dec) ;
+    if (err == 0)
+    ps->nmiss = e ;
+    return err ;
+}
+
+/*
+ * decode_prepare shuffles the packets of a segment, and finds the rows
+ * to reconstruct and their decode matrix. Returns 0 or an error.
+ */
+static int
+decode_prepare(struct fec_arena *a, struct fec_segment *sg,
+    struct par_seg *ps)
+{
+    int row, k = sg->code->k, err ;
+
+    ps->nmiss = 0 ;
+    ps->nmv = 0 ;
+    if (ps->out != NULL) {
+    err = decode_to_prepare(a, sg, ps) ;
+    if (err != 0)
+        ps->nmv = 0 ;
+    return err ;
+    }
+    if (shuffle(sg->pkt, sg->index, k))    /* error if true */
+    return FEC_EINVAL ;
+    /*
+     * after the shuffle, the rows still holding a packet with
+     * index >= k are the ones to reconstruct.
+     */
+    ps->miss = arena_alloc(a, k * sizeof(int));
+    if (ps->miss == NULL)
+    return FEC_ENOMEM ;
+    for (row = 0 ; row < k ; row++ )
+    if (sg->index[row] >= k)
+        ps->miss[ps->nmiss++] = row ;
+    if (ps->nmiss == 0)
+    return 0 ;
+    ps->m_dec = arena_alloc(a, ps->nmiss * ps->nmiss * sizeof(gf));
+    if (ps->m_dec == NULL) {
+    ps->nmiss = 0 ;
+    return FEC_ENOMEM ;
+    }
+    err = get_erasure_matrix(sg->code, sg->index, ps->miss, ps->nmiss,
+    ps->m_dec) ;
+    if (err != 0)
+    ps->nmiss = 0 ;
+    return err ;
+}
+
+/*
+ * decode_segments is fec_decode_segments, or fec_decode_segments_to
+ * (and fec_decode_to, with one segment) when to is set.
+ */
+static int
+decode_segments(struct fec_segment *seg, int nseg, int to)
+{
+    struct fec_arena *a ;
+    struct arena_mark mark ;
+    struct fec_job job ;
+    struct par_seg *ps ;
+    double work = 0 ;
+    size_t scratch = 0 ;
+    int i, j, rows, nthreads, failed = 0 ;
+    gf *tmp = NULL ;
+
+    for (i = 0 ; i < nseg ; i++)
+    seg[i].err = 0 ;
+    if ((a = get_arena()) == NULL)
+    return fail_segments(seg, nseg, 0) ;
+    arena_mark(a, &mark);
+    if ((job.ps = arena_alloc(a, nseg * sizeof(struct par_seg))) == NULL) {
+    arena_release(a, &mark);
+    return fail_segments(seg, nseg, 0) ;
+    }
+    for (i = 0 ; i < nseg ; i++) {
+    job.ps[i].out = to ? seg[i].out : NULL ;
+    seg[i].err = decode_prepare(a, &seg[i], &job.ps[i]) ;
+    if (seg[i].err)
+        failed++ ;
+    work += (double)seg[i].code->k * job.ps[i].nmiss * seg[i].sz ;
+    }
+    nthreads = par_threads(work) ;
+    job.run = decode_task ;
+    job.seg = seg ;
+    job.nseg = nseg ;
+    job.ntasks = 0 ;
+    for (i = 0 ; i < nseg ; i++) {
+    ps = &job.ps[i] ;
+    ps->first = job.ntasks ;
+    /*
+     * strips per task: z, inv(A) z and the moves or copies for
+     * decode_to, so that one that only copies still gets tasks.
+     * Copies to separate outputs go straight there, not through tmp.
+     */
+    rows = ps->out != NULL ? 2 * ps->nmiss + ps->nmv : ps->nmiss ;
+    job.ntasks += par_plan(ps, rows,
+        GF_BITS > 8 ? seg[i].sz / 2 : seg[i].sz, nthreads, 0) ;
+    if (ps->out != NULL && ps->out != seg[i].pkt)
+        rows = 2 * ps->nmiss ;
+    if (rows * ps->strip * sizeof(gf) > scratch)
+        scratch = rows * ps->strip * sizeof(gf) ;
+    }
+    job.scratch = scratch ;
+    if (scratch > 0 && (tmp = arena_alloc(a, scratch)) == NULL) {
+    /* nothing written yet, only shuffled */
+    for (i = 0 ; i < nseg ; i++)
+        if (job.ps[i].nmiss > 0 || job.ps[i].nmv > 0) {
+        seg[i].err = FEC_ENOMEM ;
+        failed++ ;
+        }
+    } else {
+    job_run(&job, tmp);
+    for (i = 0 ; i < nseg ; i++)
+        for (ps = &job.ps[i], j = 0 ; ps->out == NULL &&
+        j < ps->nmiss ; j++)
+        seg[i].index[ps->miss[j]] = ps->miss[j] ;
+    }
+    arena_release(a, &mark);
+    return failed ;
+}
+
+int
+fec_decode_segments(struct fec_segment *seg, int nseg)
+{
+    return decode_segments(seg, nseg, 0) ;
+}
+
+/*
+ * fec_decode_segments_to is fec_decode_to for each segment, source
+ * packet i of which goes to its out[i]; out may be pkt to decode in
+ * place. The pkt and index arrays are not changed.
+ */
+int
+fec_decode_segments_to(struct fec_segment *seg, int nseg)
+{
+    return decode_segments(seg, nseg, 1) ;
 }
 
 /*
@@ -788,49 +2852,438 @@ build_decode_matrix(struct fec_parms *code, gf *pkt[], int index[])
  *          to store the output packets (in place)
  *    index: pointer to packet indexes (modified)
  *    sz:    size of each packet
+ *
+ * Returns 0, FEC_EINVAL for bad or duplicate indexes, FEC_ENOMEM.
  */
 int
 fec_decode(struct fec_parms *code, gf *pkt[], int index[], int sz)
 {
-    gf *m_dec ;
-    gf **new_pkt ;
-    int row, col , k = code->k ;
+    struct fec_segment seg ;
+
+    seg.code = code ;
+    seg.pkt = pkt ;
+    seg.out = NULL ;
+    seg.index = index ;
+    seg.nout = 0 ;
+    seg.sz = sz ;
+    fec_decode_segments(&seg, 1);
+    return seg.err ;
+}
 
-    if (GF_BITS > 8)
-    sz /= 2 ;
+/*
+ * fec_decode_to is fec_decode for packets that must stay where they
+ * are: pkt[] and index[] are not changed, the packets may come in any
+ * order, and source packet i is written to out[i]. out may be pkt
+ * itself, to decode in place: the data then moves instead of the
+ * pointers, so that pkt[i] ends up holding packet i, with no full
+ * packet copies (see decode_to_strip). Otherwise out[i] must not
+ * overlap the packets, except for being the received source packet i
+ * itself, and the packets are left alone.
+ */
+int
+fec_decode_to(struct fec_parms *code, gf *pkt[], int index[], gf *out[],
+    int sz)
+{
+    struct fec_segment seg ;
+
+    seg.code = code ;
+    seg.pkt = pkt ;
+    seg.out = out ;
+    seg.index = index ;
+    seg.nout = 0 ;
+    seg.sz = sz ;
+    decode_segments(&seg, 1, 1);
+    return seg.err ;
+}
 
-    if (shuffle(pkt, index, k))    /* error if true */
-    return 1 ;
-    m_dec = build_decode_matrix(code, pkt, index);
+/*
+ * Online decoder: the packets of a block are given as they arrive and
+ * eliminated right away, so that there is little left to do when the
+ * last one comes in.
+ *
+ * Column i of the k x k system is source packet i. Each column is
+ * free, holds a source packet, or is the pivot of a repair packet. The
+ * rows of the repair packets are kept fully reduced: zero in every
+ * column that is not free, except 1 at their own pivot. The payload of
+ * the row pivoted on q lives in dst[q], so once no column is free
+ * every dst[q] is source packet q. A repair packet is reduced by the
+ * packets already there (O(k) multiply-accumulates of its payload) and
+ * then eliminated from the other repair rows; a source packet only
+ * needs eliminating from the repair rows, O(missing). Rows are only
+ * in the cache while they are worked on, but the whole of dst[] may
+ * be touched by each packet.
+ */
+#define DEC_FREE	0
+#define DEC_SOURCE	1
+#define DEC_REPAIR	2
+
+struct fec_decoder {
+    struct fec_parms *code ;
+    int sz ;		/* in symbols */
+    int have ;		/* columns that are not free */
+    gf **dst ;
+    gf **coef ;		/* coef[q]: the row pivoted on q, k symbols */
+    gf **op_src ;	/* scratch, k+1 payload terms */
+    gf *op_c ;
+    gf *row ;		/* scratch row */
+    unsigned char *kind ;	/* of each column */
+    unsigned char *seen ;	/* the n indexes used */
+} ;
 
-    if (m_dec == NULL)
-    return 1 ; /* error */
-    /*
-     * do the actual decoding
-     */
-    new_pkt = my_malloc (k * sizeof (gf * ), "new pkt pointers" );
-    for (row = 0 ; row < k ; row++ ) {
-    if (index[row] >= k) {
-        new_pkt[row] = my_malloc (sz * sizeof (gf), "new pkt buffer" );
-        bzero(new_pkt[row], sz * sizeof(gf) ) ;
-        for (col = 0 ; col < k ; col++ )
-        addmul(new_pkt[row], pkt[col], m_dec[row*k + col], sz) ;
+/*
+ * fec_decoder_new starts decoding a block into dst[0..k-1], which will
+ * hold the k source packets of sz bytes. Until then dst[] is the working
+ * memory of the decoder, holding repair payloads as well: the caller must
+ * not write into it. code must outlive the decoder. Returns NULL if out
+ * of memory.
+ */
+struct fec_decoder *
+fec_decoder_new(struct fec_parms *code, gf *dst[], int sz)
+{
+    struct fec_decoder *d ;
+    int k = code->k ;
+
+    d = malloc(sizeof(struct fec_decoder) + (3 * k + 1) * sizeof(gf *) +
+    (2 * k + 1) * sizeof(gf) + k + code->n) ;
+    if (d == NULL)
+    return NULL ;
+    d->code = code ;
+    d->sz = GF_BITS > 8 ? sz / 2 : sz ;
+    d->have = 0 ;
+    d->dst = (gf **)(d + 1) ;
+    d->coef = d->dst + k ;
+    d->op_src = d->coef + k ;
+    d->op_c = (gf *)(d->op_src + k + 1) ;
+    d->row = d->op_c + k + 1 ;
+    d->kind = (unsigned char *)(d->row + k) ;
+    d->seen = d->kind + k ;
+    bcopy(dst, d->dst, k * sizeof(gf *));
+    bzero(d->coef, k * sizeof(gf *));
+    bzero(d->kind, k);
+    bzero(d->seen, code->n);
+    return d ;
+}
+
+/*
+ * dst = sum of c[j] * src[j], strip by strip so that dst stays in the
+ * cache. dst must not be one of the src.
+ */
+static void
+dec_combine(gf *dst, gf *src[], gf c[], int nsrc, int sz)
+{
+    int j, off, len, strip = strip_len(1, sz) ;
+
+    for (off = 0 ; off < sz ; off += strip) {
+    len = sz - off < strip ? sz - off : strip ;
+    bzero(dst + off, len * sizeof(gf));
+    for (j = 0 ; j < nsrc ; j++)
+        addmul(dst + off, src[j] + off, c[j], len ) ;
+    }
+}
+
+/*
+ * the row pivoted on q is new: clear column q from the other repair
+ * rows.
+ */
+static void
+dec_eliminate(struct fec_decoder *d, int q)
+{
+    int r, col, k = d->code->k ;
+    gf m, *p = d->coef[q] ;
+
+    for (r = 0 ; r < k ; r++) {
+    if (r == q || d->kind[r] != DEC_REPAIR || (m = d->coef[r][q]) == 0)
+        continue ;
+    for (col = 0 ; col < k ; col++)
+        d->coef[r][col] ^= gf_mul(m, p[col]) ;
+    addmul(d->dst[r], d->dst[q], m, d->sz ) ;
+    }
+}
+
+/*
+ * pivot row (zero in all the columns that are not free) on its first
+ * nonzero column, which gets the payload sum(c[j] * src[j]) scaled to
+ * match. Returns the column, -1 if the row is zero.
+ */
+static int
+dec_pivot(struct fec_decoder *d, gf *row, gf *src[], gf c[], int nsrc)
+{
+    int j, q, k = d->code->k ;
+    gf inv ;
+
+    for (q = 0 ; q < k && row[q] == 0 ; q++)
+    ;
+    if (q == k)
+    return -1 ;
+    inv = inverse[row[q]] ;
+    for (j = 0 ; j < k ; j++)
+    row[j] = gf_mul(row[j], inv) ;
+    for (j = 0 ; j < nsrc ; j++)
+    c[j] = gf_mul(c[j], inv) ;
+    dec_combine(d->dst[q], src, c, nsrc, d->sz);
+    d->coef[q] = row ;
+    d->kind[q] = DEC_REPAIR ;
+    dec_eliminate(d, q);
+    return q ;
+}
+
+/*
+ * fec_decoder_add gives the decoder packet index of the block, in any
+ * order. pkt is only read, and may be reused when the call returns; it
+ * must not be one of the dst[] packets, whose slot may hold the payload
+ * of a repair packet. Packets beyond the k needed are ignored. Returns
+ * 0, FEC_EINVAL for a bad or repeated index or a pkt in dst[], or
+ * FEC_ENOMEM (the decoder is unchanged).
+ */
+int
+fec_decoder_add(struct fec_decoder *d, gf *pkt, int index)
+{
+    int p, j, q, nop = 0, k = d->code->k ;
+    gf m, *row ;
+
+    if (index < 0 || index >= d->code->n || d->seen[index]) {
+    fprintf(stderr, "fec_decoder_add: bad or repeated index %d\n", index);
+    return FEC_EINVAL ;
     }
+    for (j = 0 ; j < k ; j++)
+    if (pkt == d->dst[j]) {
+        fprintf(stderr, "fec_decoder_add: packet %d is in dst[]\n", index);
+        return FEC_EINVAL ;
+    }
+    if (d->have == k)
+    return 0 ;
+    if (index < k && d->kind[index] == DEC_FREE) {
+    d->seen[index] = 1 ;
+    d->kind[index] = DEC_SOURCE ;
+    d->have++ ;
+    bcopy(pkt, d->dst[index], d->sz * sizeof(gf) ) ;
+    for (j = 0 ; j < k ; j++) {	/* now a known column */
+        if (d->kind[j] != DEC_REPAIR || (m = d->coef[j][index]) == 0)
+        continue ;
+        d->coef[j][index] = 0 ;
+        addmul(d->dst[j], d->dst[index], m, d->sz ) ;
     }
+    return 0 ;
+    }
+    if (index < k) {
     /*
-     * move pkts to their final destination
+     * column index is the pivot of a repair row, which must move to
+     * another column: row - e_index, with payload dst[index] + pkt,
+     * is zero in all the columns that are not free.
      */
-    for (row = 0 ; row < k ; row++ ) {
-    if (index[row] >= k) {
-        bcopy(new_pkt[row], pkt[row], sz*sizeof(gf));
-        free(new_pkt[row]);
-            index[row] = row;
+    row = d->coef[index] ;
+    row[index] = 0 ;
+    d->op_src[0] = d->dst[index] ; d->op_c[0] = 1 ;
+    d->op_src[1] = pkt ; d->op_c[1] = 1 ;
+    d->coef[index] = NULL ;
+    d->kind[index] = DEC_FREE ;
+    q = dec_pivot(d, row, d->op_src, d->op_c, 2) ;
+    if (q < 0) {		/* not with distinct indexes */
+        free(row);
+        d->have-- ;
+    }
+    d->seen[index] = 1 ;
+    d->kind[index] = DEC_SOURCE ;
+    d->have++ ;
+    bcopy(pkt, d->dst[index], d->sz * sizeof(gf) ) ;
+    return 0 ;
+    }
+
+    if ((row = malloc(k * sizeof(gf))) == NULL)
+    return FEC_ENOMEM ;
+    bcopy(&(d->code->enc_matrix[index*k]), row, k * sizeof(gf));
+    d->op_src[nop] = pkt ;
+    d->op_c[nop++] = 1 ;
+    for (p = 0 ; p < k ; p++) {	/* reduce by the rows we have */
+    if (d->kind[p] == DEC_FREE || (m = row[p]) == 0)
+        continue ;
+    d->op_src[nop] = d->dst[p] ;
+    d->op_c[nop++] = m ;
+    if (d->kind[p] == DEC_SOURCE)
+        row[p] = 0 ;
+    else
+        for (j = 0 ; j < k ; j++)
+        row[j] ^= gf_mul(m, d->coef[p][j]) ;
+    }
+    if (dec_pivot(d, row, d->op_src, d->op_c, nop) < 0) {
+    free(row);
+    return FEC_EINVAL ;
+    }
+    d->seen[index] = 1 ;
+    d->have++ ;
+    return 0 ;
+}
+
+/*
+ * fec_decoder_needed returns how many more packets the decoder needs.
+ */
+int
+fec_decoder_needed(struct fec_decoder *d)
+{
+    return d->code->k - d->have ;
+}
+
+/*
+ * fec_decoder_finish frees the decoder. Returns 0 if dst[] holds the
+ * source packets, FEC_EINVAL if packets were missing.
+ */
+int
+fec_decoder_finish(struct fec_decoder *d)
+{
+    int q, err = d->have == d->code->k ? 0 : FEC_EINVAL ;
+
+    for (q = 0 ; q < d->code->k ; q++)
+    free(d->coef[q]);
+    free(d);
+    return err ;
+}
+
+/*
+ * Asynchronous requests.
+ *
+ * fec_submit queues a request (a batch of segments to encode or decode)
+ * and returns at once; runner threads, started as needed up to the
+ * fec_set_threads() count, take requests in order and run them with
+ * fec_encode_segments, fec_decode_segments or, if decode is
+ * FEC_DECODE_TO, fec_decode_segments_to. A finished request is
+ * handed back exactly once, either by fec_wait on it or by fec_reap,
+ * which returns finished requests in the order they finished. The
+ * request and everything it points to belong to the caller, and must
+ * stay untouched until then.
+ */
+#define FEC_REQ_QUEUED	1
+#define FEC_REQ_DONE	2
+
+static struct {
+    fec_mutex_t lock ;
+    fec_cond_t work, done ;
+    struct fec_request *head, *tail ;	/* queued */
+    struct fec_request *fin, *fin_tail ;	/* finished, not handed back */
+    int nqueued ;
+    int nrunners, idle ;
+} async = { FEC_MUTEX_INITIALIZER, FEC_COND_INITIALIZER,
+    FEC_COND_INITIALIZER } ;
+
+static FEC_THREAD_FN
+async_runner(void *arg)
+{
+    struct fec_request *r ;
+
+    fec_mutex_lock(&async.lock);
+    for (;;) {
+    async.idle++ ;
+    while (async.head == NULL)
+        fec_cond_wait(&async.work, &async.lock);
+    async.idle-- ;
+    r = async.head ;
+    if ((async.head = r->next) == NULL)
+        async.tail = NULL ;
+    async.nqueued-- ;
+    fec_mutex_unlock(&async.lock);
+
+    if (r->decode == FEC_DECODE_TO)
+        r->failed = fec_decode_segments_to(r->seg, r->nseg) ;
+    else if (r->decode)
+        r->failed = fec_decode_segments(r->seg, r->nseg) ;
+    else
+        r->failed = fec_encode_segments(r->seg, r->nseg) ;
+
+    fec_mutex_lock(&async.lock);
+    r->state = FEC_REQ_DONE ;
+    r->next = NULL ;
+    if (async.fin_tail != NULL)
+        async.fin_tail->next = r ;
+    else
+        async.fin = r ;
+    async.fin_tail = r ;
+    fec_cond_broadcast(&async.done);
     }
+    return 0 ;
+}
+
+/*
+ * fec_submit queues r. Returns 0, or FEC_ENOMEM if there is no thread
+ * to run it and none could be started.
+ */
+int
+fec_submit(struct fec_request *r)
+{
+    int max = fec_get_threads() ;
+
+    fec_mutex_lock(&async.lock);
+    r->state = FEC_REQ_QUEUED ;
+    r->failed = 0 ;
+    r->next = NULL ;
+    if (async.tail != NULL)
+    async.tail->next = r ;
+    else
+    async.head = r ;
+    async.tail = r ;
+    async.nqueued++ ;
+    if (async.nqueued > async.idle && async.nrunners < max &&
+        fec_thread_start(async_runner, NULL) == 0)
+    async.nrunners++ ;
+    if (async.nrunners == 0) {		/* nobody to run it */
+    async.head = async.tail = NULL ;
+    async.nqueued = 0 ;
+    fec_mutex_unlock(&async.lock);
+    return FEC_ENOMEM ;
+    }
+    fec_cond_broadcast(&async.work);
+    fec_mutex_unlock(&async.lock);
+    return 0 ;
+}
+
+/*
+ * unlink r from the finished list, with the lock held
+ */
+static void
+async_unlink(struct fec_request *r)
+{
+    struct fec_request **p, *prev = NULL ;
+
+    for (p = &async.fin ; *p != NULL ; prev = *p, p = &(*p)->next)
+    if (*p == r) {
+        *p = r->next ;
+        if (async.fin_tail == r)
+        async.fin_tail = prev ;
+        r->state = 0 ;
+        return ;
     }
-    free(new_pkt);
-    free(m_dec);
+}
 
-    return 0;
+/*
+ * fec_wait waits for r to finish, and returns the number of its
+ * segments that failed.
+ */
+int
+fec_wait(struct fec_request *r)
+{
+    fec_mutex_lock(&async.lock);
+    while (r->state == FEC_REQ_QUEUED)
+    fec_cond_wait(&async.done, &async.lock);
+    async_unlink(r);
+    fec_mutex_unlock(&async.lock);
+    return r->failed ;
+}
+
+/*
+ * fec_reap returns the request that finished first among those not yet
+ * handed back. If there is none it waits for one, or returns NULL if
+ * block is 0.
+ */
+struct fec_request *
+fec_reap(int block)
+{
+    struct fec_request *r ;
+
+    fec_mutex_lock(&async.lock);
+    while (async.fin == NULL && block)
+    fec_cond_wait(&async.done, &async.lock);
+    if ((r = async.fin) != NULL)
+    async_unlink(r);
+    fec_mutex_unlock(&async.lock);
+    return r ;
 }
 
 /*********** end of FEC code -- beginning of test code ************/
@@ -858,3 +3311,49 @@ test_gf()
     }
 }
 #endif /* TEST */
+
+#ifdef FEC_GENTAB
+/*
+ * Table generator, see FEC_STATIC_TABLES. Prints the tables computed
+ * by generate_gf() and init_mul_table() on stdout.
+ */
+static void
+gentab_row(const char *type, const char *name, const char *dims,
+    const void *t, int is_int, int count, int cols)
+{
+    int i ;
+
+    printf("static const %s %s%s = {", type, name, dims);
+    for (i = 0 ; i < count ; i++) {
+    if (cols && i % cols == 0)
+        printf("\n  {");
+    printf("%s%d,", i % 16 ? " " : "\n    ",
+        is_int ? ((const int *)t)[i] : ((const gf *)t)[i]);
+    if (cols && i % cols == cols - 1)
+        printf("\n  },");
+    }
+    printf("\n};\n\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    generate_gf();
+    init_mul_table();
+
+    printf("/* generated by fec.c with FEC_GENTAB, GF_BITS %d */\n\n",
+    GF_BITS);
+    gentab_row("gf", "gf_exp", "[2*GF_SIZE]", gf_exp, 0, 2*GF_SIZE, 0);
+    gentab_row("int", "gf_log", "[GF_SIZE + 1]", gf_log, 1, GF_SIZE + 1, 0);
+    gentab_row("gf", "inverse", "[GF_SIZE+1]", inverse, 0, GF_SIZE + 1, 0);
+#if (GF_BITS <= 8)
+    gentab_row("gf", "gf_mul_table", "[GF_SIZE + 1][GF_SIZE + 1]",
+    gf_mul_table, 0, (GF_SIZE + 1) * (GF_SIZE + 1), GF_SIZE + 1);
+#endif
+#if (GF_BITS == 8)
+    gentab_row("gf", "gf_nib_table", "[GF_SIZE + 1][32]",
+    gf_nib_table, 0, (GF_SIZE + 1) * 32, 32);
+#endif
+    return ferror(stdout) ? 1 : 0 ;
+}
+#endif /* FEC_GENTAB */
@@ -65,17 +65,113 @@ typedef uint8_t gf;
 typedef uint16_t gf;
 #endif
 
+struct fec_dcache ;
+
 struct fec_parms {
     unsigned long magic ;
     int k, n ;		/* parameters of the code */
+    int type ;		/* FEC_VANDERMONDE or FEC_CAUCHY */
     gf *enc_matrix ;
+    struct fec_dcache *dcache ;	/* recently used decode matrices */
+    int refs ;			/* users of a shared code, see fec_acquire */
+    struct fec_parms *next_shared ;
 } ;
 
+/*
+ * errors returned by the functions that return int. fec_new and
+ * fec_acquire return NULL instead.
+ */
+#define FEC_EINVAL	1	/* bad parameters, indexes, or singular */
+#define FEC_ENOMEM	2	/* out of memory */
+
+/*
+ * encoding matrices, see fec_new_type. Codes of different types are
+ * not compatible: they produce different repair packets.
+ */
+#define FEC_VANDERMONDE	0	/* the original code, fec_new */
+#define FEC_CAUCHY	1	/* built in O(n*k) instead of O(n*k^2) */
+
 #define	GF_SIZE ((1 << GF_BITS) - 1)	/* powers of \alpha */
 void fec_free(struct fec_parms *p);
 struct fec_parms * fec_new(int k, int n);
+struct fec_parms * fec_new_type(int k, int n, int type);
+struct fec_parms * fec_acquire(int k, int n);
+struct fec_parms * fec_acquire_type(int k, int n, int type);
+void fec_release(struct fec_parms *p);
 void init_fec();
-void fec_encode(struct fec_parms *code, gf *src[], gf *fec, int index, int sz);
+int fec_encode(struct fec_parms *code, gf *src[], gf *fec, int index, int sz);
+int fec_encode_multi(struct fec_parms *code, gf *src[], gf *out[],
+    int index[], int nout, int sz);
+struct fec_encoder ;	/* fec_encode_multi, one source at a time */
+struct fec_encoder *fec_encoder_new(struct fec_parms *code, gf *out[],
+    int index[], int nout, int sz);
+int fec_encoder_add(struct fec_encoder *e, gf *src, int i);
+int fec_encoder_finish(struct fec_encoder *e);
 int fec_decode(struct fec_parms *code, gf *pkt[], int index[], int sz);
+int fec_decode_to(struct fec_parms *code, gf *pkt[], int index[],
+    gf *out[], int sz);
+struct fec_decoder ;	/* fec_decode, eliminating as packets arrive */
+struct fec_decoder *fec_decoder_new(struct fec_parms *code, gf *dst[],
+    int sz);
+int fec_decoder_add(struct fec_decoder *d, gf *pkt, int index);
+int fec_decoder_needed(struct fec_decoder *d);
+int fec_decoder_finish(struct fec_decoder *d);
+void fec_decode_cache_stats(struct fec_parms *code, unsigned long *hits,
+    unsigned long *misses);
+int fec_decode_matrix(struct fec_parms *code, int index[], gf *matrix);
+
+/*
+ * A batch of segments, each with its own code and packets, processed
+ * by one call. See fec_encode_segments().
+ */
+struct fec_segment {
+    struct fec_parms *code ;
+    gf **pkt ;		/* the k source (encode) or received (decode) packets */
+    gf **out ;		/* encode: the nout packets to produce,
+			   fec_decode_segments_to: where source i goes */
+    int *index ;	/* encode: nout indexes, decode: k indexes */
+    int nout ;
+    int sz ;		/* packet size in bytes */
+    int err ;		/* result of this segment */
+} ;
+int fec_encode_segments(struct fec_segment *seg, int nseg);
+int fec_decode_segments(struct fec_segment *seg, int nseg);
+int fec_decode_segments_to(struct fec_segment *seg, int nseg);
+
+/*
+ * An asynchronous fec_encode_segments or fec_decode_segments(_to), see
+ * fec_submit().
+ */
+struct fec_request {
+    struct fec_segment *seg ;
+    int nseg ;
+    int decode ;	/* decode rather than encode the segments, see
+			   FEC_DECODE_TO */
+    int failed ;	/* result: the number of failed segments */
+    int state ;		/* private */
+    struct fec_request *next ;
+} ;
+#define FEC_DECODE_TO	2	/* decode with fec_decode_segments_to */
+int fec_submit(struct fec_request *r);
+int fec_wait(struct fec_request *r);
+struct fec_request *fec_reap(int block);
+
+/*
+ * Number of threads (including the caller) an encode or decode may
+ * use; 1, the default, disables the worker pool.
+ */
+int fec_set_threads(int n);
+int fec_get_threads(void);
+
+/*
+ * Implementations of the multiply-accumulate inner loop. The best one
+ * for the CPU is chosen by init_fec(); the others are for testing.
+ */
+#define FEC_KERNEL_SCALAR	0	/* table lookup, always available */
+#define FEC_KERNEL_SSSE3	1	/* pshufb on nibble tables */
+#define FEC_KERNEL_AVX2		2	/* same, 256 bit vectors */
+int fec_set_kernel(int kernel);
+int fec_get_kernel(void);
+const char *fec_kernel_name(int kernel);
 
 /* end of file */
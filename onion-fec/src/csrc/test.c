@@ -7,7 +7,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "fec.h"
+#include "cauchy.h"
 
 /*
  * compatibility stuff
@@ -199,6 +201,1037 @@ test_gf()
 }
 #endif
 
+/*
+ * Check every SIMD kernel the CPU supports against the scalar table
+ * lookup: encode all repair packets with each and compare. Buffers
+ * are misaligned on purpose (by one symbol, so that gf stays aligned)
+ * and sizes are chosen to exercise the scalar tails.
+ */
+int
+test_kernels(void)
+{
+    static const int sizes[] = { 2, 16, 30, 32, 34, 64, 98, 1024, 4100 };
+    int k = 32, n = GF_SIZE + 1 ;
+    int kernel, s, i, j, errors = 0 ;
+    int saved = fec_get_kernel() ;
+    void *code ;
+    gf *src[32] ;
+    unsigned char *ref, *out ;
+
+    if (n > 256)
+	n = 256 ;
+    code = fec_new(k, n);
+    for (i = 0 ; i < k ; i++)
+	src[i] = my_malloc(4100 + sizeof(gf), "kernel src") ;
+    ref = my_malloc(4100 + sizeof(gf), "kernel ref") ;
+    out = my_malloc(4100 + sizeof(gf), "kernel out") ;
+
+    srand(1);
+    for (i = 0 ; i < k ; i++) {
+	src[i] = (gf *)((char *)src[i] + sizeof(gf)) ;
+	for (j = 0 ; j < 4100 ; j++)
+	    ((unsigned char *)src[i])[j] = rand() & 0xff ;
+    }
+
+    for (kernel = FEC_KERNEL_SCALAR + 1 ; kernel <= FEC_KERNEL_AVX2 ; kernel++) {
+	if (fec_set_kernel(kernel) != 0) {
+	    fprintf(stderr, "kernel %s: not supported, skipped\n",
+		fec_kernel_name(kernel));
+	    continue ;
+	}
+	for (s = 0 ; s < sizeof(sizes)/sizeof(sizes[0]) ; s++) {
+	    for (i = k ; i < n ; i++) {
+		fec_set_kernel(FEC_KERNEL_SCALAR);
+		fec_encode(code, src, (gf *)(ref + sizeof(gf)), i, sizes[s]);
+		fec_set_kernel(kernel);
+		fec_encode(code, src, (gf *)(out + sizeof(gf)), i, sizes[s]);
+		if (bcmp(ref + sizeof(gf), out + sizeof(gf), sizes[s])) {
+		    fprintf(stderr, "kernel %s: mismatch, index %d size %d\n",
+			fec_kernel_name(kernel), i, sizes[s]);
+		    errors++ ;
+		    break ;
+		}
+	    }
+	}
+	fprintf(stderr, "kernel %s: %s\n", fec_kernel_name(kernel),
+	    errors ? "FAILED" : "ok");
+    }
+    fec_set_kernel(saved);
+
+    for (i = 0 ; i < k ; i++)
+	free((char *)src[i] - sizeof(gf));
+    free(ref);
+    free(out);
+    fec_free(code);
+    return errors ;
+}
+
+/*
+ * fec_encode_multi must produce the same packets as one fec_encode
+ * per index, including source indexes, for sizes that are not a
+ * multiple of the strip length. So must a streaming encoder fed the
+ * sources out of order, which must also refuse repeated sources and
+ * report an unfinished encode.
+ */
+int
+test_encode_multi(void)
+{
+    static const int sizes[] = { 2, 1000, 4096, 70000 };
+    int k = 20, n = 60, nout = n, s, i, errors = 0 ;
+    void *code ;
+    struct fec_encoder *e ;
+    gf *src[20], *ref[60], *out[60] ;
+    int index[60] ;
+
+    code = fec_new(k, n);
+    for (i = 0 ; i < k ; i++)
+	src[i] = my_malloc(70000, "multi src") ;
+    for (i = 0 ; i < nout ; i++) {
+	ref[i] = my_malloc(70000, "multi ref") ;
+	out[i] = my_malloc(70000, "multi out") ;
+	index[i] = (i * 7) % n ;	/* mixed order, some < k */
+    }
+    srand(2);
+    for (i = 0 ; i < k ; i++) {
+	int j ;
+	for (j = 0 ; j < 70000 ; j++)
+	    ((unsigned char *)src[i])[j] = rand() & 0xff ;
+    }
+    for (s = 0 ; s < sizeof(sizes)/sizeof(sizes[0]) ; s++) {
+	for (i = 0 ; i < nout ; i++)
+	    fec_encode(code, src, ref[i], index[i], sizes[s]);
+	fec_encode_multi(code, src, out, index, nout, sizes[s]);
+	for (i = 0 ; i < nout ; i++)
+	    if (bcmp(ref[i], out[i], sizes[s])) {
+		fprintf(stderr, "encode_multi: mismatch, index %d size %d\n",
+		    index[i], sizes[s]);
+		errors++ ;
+	    }
+	e = fec_encoder_new(code, out, index, nout, sizes[s]) ;
+	for (i = 0 ; i < k ; i++)	/* 7 is prime to 20 */
+	    if (e == NULL || fec_encoder_add(e, src[i * 7 % k], i * 7 % k))
+		errors++ ;
+	if (e == NULL || fec_encoder_add(e, src[3], 3) == 0 ||
+		fec_encoder_finish(e) != 0)
+	    errors++ ;
+	for (i = 0 ; i < nout ; i++)
+	    if (bcmp(ref[i], out[i], sizes[s])) {
+		fprintf(stderr, "encoder: mismatch, index %d size %d\n",
+		    index[i], sizes[s]);
+		errors++ ;
+	    }
+    }
+    e = fec_encoder_new(code, out, index, nout, 1000) ;
+    if (e == NULL || fec_encoder_add(e, src[0], 0) ||
+	    fec_encoder_add(e, src[0], k) == 0 || fec_encoder_finish(e) == 0)
+	errors++ ;
+    index[0] = n ;
+    if (fec_encoder_new(code, out, index, nout, 1000) != NULL)
+	errors++ ;
+    fprintf(stderr, "encode_multi: %s\n", errors ? "FAILED" : "ok");
+
+    for (i = 0 ; i < k ; i++)
+	free(src[i]);
+    for (i = 0 ; i < nout ; i++) {
+	free(ref[i]);
+	free(out[i]);
+    }
+    fec_free(code);
+    return errors ;
+}
+
+/*
+ * The online decoder, fed k of the n packets in a random order, must
+ * end with the source packets in dst[], whether the repair packets come
+ * before or after the sources they stand in for. It must refuse repeated
+ * packets and report a block that is not complete.
+ */
+int
+test_decoder(void)
+{
+    int k = 24, n = 48, sz = 3000, t, i, j, errors = 0 ;
+    void *code = fec_new(k, n) ;
+    gf *src[24], *enc[48], *dst[24] ;
+    int order[48], idx[24], x ;
+    struct fec_decoder *d ;
+
+    for (i = 0 ; i < k ; i++) {
+	src[i] = my_malloc(sz, "decoder src") ;
+	dst[i] = my_malloc(sz, "decoder dst") ;
+	for (j = 0 ; j < sz ; j++)
+	    ((unsigned char *)src[i])[j] = rand() ;
+    }
+    for (i = 0 ; i < n ; i++) {
+	enc[i] = my_malloc(sz, "decoder enc") ;
+	idx[i % k] = i ;
+	if (i >= k)
+	    fec_encode_multi(code, src, &enc[i], &idx[i % k], 1, sz);
+	else
+	    bcopy(src[i], enc[i], sz);
+    }
+    for (t = 0 ; t < 12 ; t++) {
+	for (i = 0 ; i < n ; i++)
+	    order[i] = i ;
+	for (i = 0 ; i < n ; i++) {	/* shuffle */
+	    j = i + rand() % (n - i) ;
+	    x = order[i] ; order[i] = order[j] ; order[j] = x ;
+	}
+	if (t % 3 == 0)	/* sources received after the repairs */
+	    for (i = 0 ; i < k ; i++)
+		order[i] = (k - 1 - i) % 2 ? k + i : k - 1 - i ;
+	d = fec_decoder_new(code, dst, sz) ;
+	for (i = 0 ; d != NULL && fec_decoder_needed(d) > 0 ; i++)
+	    if (fec_decoder_add(d, enc[order[i]], order[i]))
+		errors++ ;
+	if (d == NULL || fec_decoder_add(d, enc[order[0]], order[0]) == 0 ||
+		fec_decoder_finish(d) != 0)
+	    errors++ ;
+	for (i = 0 ; i < k ; i++)
+	    if (bcmp(dst[i], src[i], sz)) {
+		fprintf(stderr, "decoder: round %d, packet %d wrong\n", t, i);
+		errors++ ;
+	    }
+    }
+    d = fec_decoder_new(code, dst, sz) ;
+    if (d == NULL || fec_decoder_add(d, enc[30], 30) ||
+	    fec_decoder_add(d, enc[0], n) == 0 || fec_decoder_needed(d) != k - 1
+	    || fec_decoder_finish(d) == 0)
+	errors++ ;
+    /*
+     * dst[] holds repair payloads until the end: a packet in dst[] is
+     * refused, and the decode from separate buffers still works.
+     */
+    d = fec_decoder_new(code, dst, sz) ;
+    if (d == NULL || fec_decoder_add(d, enc[k], k))
+	errors++ ;
+    for (i = 0 ; d != NULL && i < k - 1 ; i++)
+	if (fec_decoder_add(d, dst[i], i) == 0 ||
+		fec_decoder_add(d, enc[i], i))
+	    errors++ ;
+    if (d == NULL || fec_decoder_finish(d) != 0)
+	errors++ ;
+    for (i = 0 ; i < k ; i++)
+	if (bcmp(dst[i], src[i], sz))
+	    errors++ ;
+    for (i = 0 ; i < k ; i++) {
+	free(src[i]);
+	free(dst[i]);
+    }
+    for (i = 0 ; i < n ; i++)
+	free(enc[i]);
+    fec_free(code);
+    fprintf(stderr, "decoder: %s\n", errors ? "FAILED" : "ok");
+    return errors ;
+}
+
+/*
+ * Erasure decoding solves only for the e lost packets: one and two in
+ * closed form, more with the cached e x e inverse. Check each against
+ * the data, then fec_decode_matrix against fec_decode: decoding is
+ * linear, so decoding packets that are rows of the identity gives the
+ * decode matrix. Repeated repair indexes must be refused.
+ */
+int
+test_erasures(void)
+{
+    static const int es[] = { 1, 2, 3, 7, 32 };
+    int k = 32, n = 80, t, i, j, e, errors = 0 ;
+    void *code = fec_new(k, n) ;
+    int ixs[32], ixs2[32] ;
+    gf *m = my_malloc(k * k * sizeof(gf), "erasures matrix") ;
+    gf *pkt[32] ;
+    char buf[64] ;
+
+    for (i = 0 ; i < k ; i++)
+	pkt[i] = my_malloc(k * sizeof(gf), "erasures pkt") ;
+    for (t = 0 ; t < sizeof(es)/sizeof(es[0]) ; t++) {
+	e = es[t] ;
+	for (i = 0 ; i < k ; i++)
+	    ixs[i] = i ;
+	for (i = 0 ; i < e ; i++) {	/* lose e random sources */
+	    do
+		j = rand() % k ;
+	    while (ixs[j] >= k) ;
+	    ixs[j] = k + (i * 5 + t) % (n - k) ;
+	}
+	bcopy(ixs, ixs2, sizeof(ixs));
+	sprintf(buf, "%d erasures", e);
+	errors += test_decode(code, k, ixs2, 512, buf);
+
+	if (fec_decode_matrix(code, ixs, m) != 0)
+	    errors++ ;
+	for (i = 0 ; i < k ; i++) {
+	    bzero(pkt[i], k * sizeof(gf));
+	    pkt[i][i] = 1 ;
+	}
+	bcopy(ixs, ixs2, sizeof(ixs));
+	if (fec_decode(code, pkt, ixs2, k * sizeof(gf)) != 0)
+	    errors++ ;
+	for (i = 0 ; i < k ; i++)
+	    if (bcmp(pkt[i], m + i * k, k * sizeof(gf))) {
+		fprintf(stderr, "erasures: %d lost, row %d differs\n", e, i);
+		errors++ ;
+	    }
+
+	for (i = 0 ; i < k && ixs[i] < k ; i++)
+	    ;
+	for (j = i + 1 ; j < k && ixs[j] < k ; j++)
+	    ;
+	if (j < k) {		/* same repair packet twice */
+	    ixs[j] = ixs[i] ;
+	    if (fec_decode(code, pkt, ixs, k * sizeof(gf)) != FEC_EINVAL)
+		errors++ ;
+	}
+    }
+    for (i = 0 ; i < k ; i++)
+	free(pkt[i]);
+    free(m);
+    fec_free(code);
+    fprintf(stderr, "\nerasures: %s\n", errors ? "FAILED" : "ok");
+    return errors ;
+}
+
+/*
+ * fec_decode_to: packets in any order, decoded in place (the data moves,
+ * the pointers do not) or into separate buffers (the packets are left
+ * alone), serially and, for the larger code, on the pool.
+ */
+int
+test_decode_to(void)
+{
+    static const int ks[] = { 20, 64 }, szs[] = { 1000, 32768 } ;
+    int t, i, j, c, k, n, sz, e, errors = 0 ;
+    int ixs[64], ixs2[64] ;
+    gf *src[64], *pkt[64], *keep[64], *out[64] ;
+    void *code ;
+
+    fec_set_threads(4);
+    for (t = 0 ; t < 8 ; t++) {
+	k = ks[t % 2] ;
+	n = 2 * k ;
+	sz = szs[t % 2] ;
+	e = t < 2 || t >= 6 ? 0 : k / 2 ;	/* lost sources */
+	code = fec_new(k, n) ;
+	for (i = 0 ; i < k ; i++) {
+	    src[i] = my_malloc(sz, "decode_to src") ;
+	    for (j = 0 ; j < sz ; j++)
+		((unsigned char *)src[i])[j] = rand() ;
+	}
+	for (i = 0 ; i < k ; i++)
+	    ixs[i] = i < e ? n - 1 - i : i ;
+	for (i = k - 1 ; i > 0 ; i--) {	/* any order */
+	    j = rand() % (i + 1) ;
+	    c = ixs[i] ; ixs[i] = ixs[j] ; ixs[j] = c ;
+	}
+	for (i = 0 ; i < k ; i++) {
+	    pkt[i] = my_malloc(sz, "decode_to pkt") ;
+	    if (ixs[i] < k)
+		bcopy(src[ixs[i]], pkt[i], sz);
+	    else
+		fec_encode(code, src, pkt[i], ixs[i], sz);
+	    keep[i] = pkt[i] ;
+	    out[i] = my_malloc(sz, "decode_to out") ;
+	}
+	bcopy(ixs, ixs2, sizeof(ixs));
+	if (t >= 4) {			/* separate outputs */
+	    if (fec_decode_to(code, pkt, ixs, out, sz) != 0)
+		errors++ ;
+	    for (i = 0 ; i < k ; i++)
+		if (bcmp(out[i], src[i], sz) ||
+		    (ixs[i] < k && bcmp(pkt[i], src[ixs[i]], sz))) {
+		    fprintf(stderr, "decode_to: %d differs\n", i);
+		    errors++ ;
+		}
+	} else {
+	    if (fec_decode_to(code, pkt, ixs, pkt, sz) != 0)
+		errors++ ;
+	    for (i = 0 ; i < k ; i++)
+		if (pkt[i] != keep[i] || bcmp(pkt[i], src[i], sz)) {
+		    fprintf(stderr, "decode_to: %d differs in place\n", i);
+		    errors++ ;
+		}
+	}
+	if (bcmp(ixs, ixs2, sizeof(ixs)))
+	    errors++ ;
+	for (i = 0 ; i < k ; i++)
+	    if (ixs[i] < k && ixs[i] != ixs[0])
+		break ;
+	if (i < k && ixs[0] < k) {	/* duplicate source */
+	    ixs[i] = ixs[0] ;
+	    if (fec_decode_to(code, pkt, ixs, pkt, sz) != FEC_EINVAL)
+		errors++ ;
+	}
+	for (i = 0 ; i < k ; i++) {
+	    free(src[i]);
+	    free(pkt[i]);
+	    free(out[i]);
+	}
+	fec_free(code);
+    }
+    fec_set_threads(1);
+    fprintf(stderr, "\ndecode_to: %s\n", errors ? "FAILED" : "ok");
+    return errors ;
+}
+
+/*
+ * Losing more than FEC_INV_MIN (128) source packets inverts the erased
+ * submatrix with the blocked Gauss-Jordan, serially and on the pool.
+ * In the 16 bit field k is not a multiple of the panel width.
+ */
+int
+test_invert(void)
+{
+    int k = GF_BITS > 8 ? 300 : 128, n = 2 * k, i, t, errors = 0 ;
+    int *ixs = my_malloc(k * sizeof(int), "invert ixs") ;
+    gf *m = my_malloc(k * k * sizeof(gf), "invert matrix") ;
+    void *code = fec_new_type(k, n, FEC_CAUCHY) ;
+
+    for (t = 1 ; t <= 4 ; t *= 4) {
+	fec_set_threads(t);
+	for (i = 0 ; i < k ; i++)	/* all lost */
+	    ixs[i] = n - 1 - i ;
+	errors += test_decode(code, k, ixs, 256, "blocked inverse");
+	for (i = 0 ; i < k ; i++)
+	    ixs[i] = n - 1 - i ;
+	ixs[5] = ixs[3] ;		/* singular */
+	if (fec_decode_matrix(code, ixs, m) != FEC_EINVAL)
+	    errors++ ;
+    }
+    fec_set_threads(1);
+    fec_free(code);
+    free(m);
+    free(ixs);
+    fprintf(stderr, "\ninvert: %s\n", errors ? "FAILED" : "ok");
+    return errors ;
+}
+
+/*
+ * The Cauchy encoding matrix must give an MDS code like the original
+ * one: every choice of k of the n packets decodes. Exhaustive for a
+ * small code, random choices among all the packets of a large one.
+ */
+int
+test_cauchy_matrix(void)
+{
+    int k = 4, n = 12, i, j, r, mask, bits, errors = 0 ;
+    int ixs[16] ;
+    gf m[16] ;
+    char buf[64] ;
+    void *code = fec_new_type(k, n, FEC_CAUCHY) ;
+
+    for (mask = 0 ; mask < 1 << n ; mask++) {
+	for (bits = 0, i = 0 ; i < n ; i++)
+	    bits += (mask >> i) & 1 ;
+	if (bits != k)
+	    continue ;
+	for (i = 0 ; i < k ; i++)	/* shuffled, as fec_decode does */
+	    ixs[i] = (mask >> i) & 1 ? i : -1 ;
+	for (i = 0, j = k ; i < k ; i++) {
+	    if (ixs[i] >= 0)
+		continue ;
+	    while (!((mask >> j) & 1))
+		j++ ;
+	    ixs[i] = j++ ;
+	}
+	if (fec_decode_matrix(code, ixs, m) != 0) {
+	    fprintf(stderr, "cauchy matrix: packets %#x do not decode\n",
+		mask);
+	    errors++ ;
+	}
+    }
+    fec_free(code);
+
+    k = 16 ;
+    n = GF_SIZE + 1 ;
+    code = fec_new_type(k, n, FEC_CAUCHY) ;
+    for (r = 0 ; r < 20 ; r++) {
+	for (i = 0 ; i < k ; i++) {
+	    ixs[i] = i ;
+	    if (rand() & 1)
+		continue ;
+	    do {
+		ixs[i] = k + rand() % (n - k) ;
+		for (j = 0 ; j < i && ixs[j] != ixs[i] ; j++)
+		    ;
+	    } while (j < i) ;
+	}
+	sprintf(buf, "cauchy n=%d", n);
+	errors += test_decode(code, k, ixs, 256, buf);
+    }
+    fec_free(code);
+    if (fec_new_type(4, 8, 7) != NULL)
+	errors++ ;
+    fprintf(stderr, "\ncauchy matrix: %s\n", errors ? "FAILED" : "ok");
+    return errors ;
+}
+
+/*
+ * The decode matrix cache: a repeated erasure pattern must hit, a
+ * cache full of other patterns must have evicted it, and decoding
+ * from a cached matrix must still give the right data.
+ */
+int
+test_decode_cache(void)
+{
+    int k = 16, n = 64, i, p, errors = 0 ;
+    int ixs[16] ;
+    unsigned long hits, misses ;
+    void *code = fec_new(k, n) ;
+
+#define LOSE(first) \
+    for (i = 0 ; i < k ; i++) ixs[i] = i < 3 ? k + (first) + i : i
+
+    LOSE(0);
+    errors += test_decode(code, k, ixs, 512, "cache miss");
+    LOSE(0);
+    errors += test_decode(code, k, ixs, 512, "cache hit");
+    fec_decode_cache_stats(code, &hits, &misses);
+    if (hits != 1 || misses != 1) {
+	fprintf(stderr, "decode cache: %lu hits %lu misses, expected 1 1\n",
+	    hits, misses);
+	errors++ ;
+    }
+    /* enough other patterns to push the first one out */
+    for (p = 1 ; p <= 40 ; p++) {
+	LOSE(p);
+	errors += test_decode(code, k, ixs, 512, "cache fill");
+    }
+    LOSE(0);
+    errors += test_decode(code, k, ixs, 512, "cache evicted");
+    fec_decode_cache_stats(code, &hits, &misses);
+    if (hits != 1 || misses != 42) {
+	fprintf(stderr, "decode cache: %lu hits %lu misses, expected 1 42\n",
+	    hits, misses);
+	errors++ ;
+    }
+#undef LOSE
+    fprintf(stderr, "\ndecode cache: %s\n", errors ? "FAILED" : "ok");
+    fec_free(code);
+    return errors ;
+}
+
+/*
+ * fec_acquire must hand out one code per (k, n) while it is in use,
+ * keep it for a while once released, and the shared code must decode.
+ */
+int
+test_shared(void)
+{
+    int ixs[16], i, errors = 0 ;
+    struct fec_parms *a, *b, *c, *d ;
+
+    a = fec_acquire(16, 32) ;
+    b = fec_acquire(16, 32) ;
+    c = fec_acquire(16, 40) ;
+    if (a == NULL || a != b || a == c) {
+	fprintf(stderr, "shared: expected one code per (k, n)\n");
+	errors++ ;
+    }
+    d = fec_acquire_type(16, 32, FEC_CAUCHY) ;
+    if (d == NULL || d == a || d->type != FEC_CAUCHY) {
+	fprintf(stderr, "shared: expected one code per type\n");
+	errors++ ;
+    }
+    fec_release(d);
+    for (i = 0 ; i < 16 ; i++) ixs[i] = i < 4 ? 16 + i : i ;
+    errors += test_decode(a, 16, ixs, 512, "shared");
+    fec_release(a);
+    fec_release(b);
+    fec_release(c);
+    b = fec_acquire(16, 32) ;
+    if (b != a) {
+	fprintf(stderr, "shared: released code was not kept\n");
+	errors++ ;
+    }
+    fec_release(b);
+    fprintf(stderr, "\nshared: %s\n", errors ? "FAILED" : "ok");
+    return errors ;
+}
+
+/*
+ * Several threads encoding and decoding with one shared code at the
+ * same time, each with its own erasure patterns, plus the error
+ * returns that replaced exit() on bad input.
+ */
+#define TH_THREADS	8
+#define TH_K		24
+#define TH_N		48
+#define TH_SZ		3000
+#define TH_ROUNDS	50
+
+struct th_arg {
+    int id, errors ;
+} ;
+
+static void *
+th_main(void *arg)
+{
+    struct th_arg *t = arg ;
+    struct fec_parms *code = fec_acquire(TH_K, TH_N) ;
+    gf *src[TH_K], *pkt[TH_K] ;
+    int ixs[TH_K], r, i, j, lost ;
+    unsigned seed = t->id ;
+
+    for (i = 0 ; i < TH_K ; i++) {
+	src[i] = my_malloc(TH_SZ, "thread src") ;
+	pkt[i] = my_malloc(TH_SZ, "thread pkt") ;
+	for (j = 0 ; j < TH_SZ ; j++)
+	    ((unsigned char *)src[i])[j] = rand_r(&seed) ;
+    }
+    for (r = 0 ; r < TH_ROUNDS ; r++) {
+	/* lose a different run of packets each round */
+	lost = 1 + (t->id + r) % (TH_N - TH_K) ;
+	if (lost > TH_K)
+	    lost = TH_K ;
+	for (i = 0 ; i < TH_K ; i++) {
+	    ixs[i] = i < lost ? TH_K + (r + i) % (TH_N - TH_K) : i ;
+	    if (fec_encode(code, src, pkt[i], ixs[i], TH_SZ) != 0)
+		t->errors++ ;
+	}
+	if (fec_decode(code, pkt, ixs, TH_SZ) != 0) {
+	    t->errors++ ;
+	    continue ;
+	}
+	for (i = 0 ; i < TH_K ; i++)
+	    if (ixs[i] != i || bcmp(pkt[i], src[i], TH_SZ))
+		t->errors++ ;
+    }
+    for (i = 0 ; i < TH_K ; i++) {
+	free(src[i]);
+	free(pkt[i]);
+    }
+    fec_release(code);
+    return NULL ;
+}
+
+int
+test_threads(void)
+{
+    pthread_t tid[TH_THREADS] ;
+    struct th_arg args[TH_THREADS] ;
+    struct fec_parms *code ;
+    gf *pkt[4], buf[4][16] ;
+    int ixs[4], i, errors = 0 ;
+
+    for (i = 0 ; i < TH_THREADS ; i++) {
+	args[i].id = i ;
+	args[i].errors = 0 ;
+	if (pthread_create(&tid[i], NULL, th_main, &args[i]) != 0) {
+	    fprintf(stderr, "threads: pthread_create failed\n");
+	    return 1 ;
+	}
+    }
+    for (i = 0 ; i < TH_THREADS ; i++) {
+	pthread_join(tid[i], NULL);
+	errors += args[i].errors ;
+    }
+
+    code = fec_new(4, 8) ;
+    for (i = 0 ; i < 4 ; i++)
+	pkt[i] = buf[i] ;
+    if (fec_encode(code, pkt, buf[0], 8, 16) != FEC_EINVAL)
+	errors++ ;
+    ixs[0] = 1 ; ixs[1] = 1 ; ixs[2] = 2 ; ixs[3] = 3 ;
+    if (fec_decode(code, pkt, ixs, 16) == 0)	/* duplicate index */
+	errors++ ;
+    fec_free(code);
+    if (fec_new(9, 8) != NULL)
+	errors++ ;
+
+    fprintf(stderr, "threads: %s\n", errors ? "FAILED" : "ok");
+    return errors ;
+}
+
+/*
+ * fec_encode_segments / fec_decode_segments over segments of different
+ * shapes must match fec_encode per packet, and a bad segment must fail
+ * on its own without stopping the others.
+ */
+int
+test_segments(void)
+{
+    static const int ks[3] = { 4, 17, 32 }, ns[3] = { 8, 40, 33 },
+	szs[3] = { 512, 1000, 4096 } ;
+    struct fec_segment seg[3] ;
+    gf *src[3][32], *rep[3][32], *pkt[3][32] ;
+    int idx[3][32], ixs[3][32], s, i, j, nout, errors = 0 ;
+
+    for (s = 0 ; s < 3 ; s++) {
+	nout = ns[s] - ks[s] ;
+	for (i = 0 ; i < ks[s] ; i++) {
+	    src[s][i] = my_malloc(szs[s], "segment src") ;
+	    for (j = 0 ; j < szs[s] ; j++)
+		((unsigned char *)src[s][i])[j] = rand() ;
+	}
+	for (i = 0 ; i < nout ; i++) {
+	    rep[s][i] = my_malloc(szs[s], "segment repair") ;
+	    idx[s][i] = ks[s] + i ;
+	}
+	seg[s].code = fec_acquire(ks[s], ns[s]) ;
+	seg[s].pkt = src[s] ;
+	seg[s].out = rep[s] ;
+	seg[s].index = idx[s] ;
+	seg[s].nout = nout ;
+	seg[s].sz = szs[s] ;
+    }
+    if (fec_encode_segments(seg, 3) != 0)
+	errors++ ;
+    for (s = 0 ; s < 3 ; s++) {
+	gf *one = my_malloc(szs[s], "segment check") ;
+	for (i = 0 ; i < seg[s].nout ; i++) {
+	    fec_encode(seg[s].code, src[s], one, idx[s][i], szs[s]);
+	    if (bcmp(one, rep[s][i], szs[s])) {
+		fprintf(stderr, "segments: encode mismatch %d/%d\n", s, i);
+		errors++ ;
+	    }
+	}
+	free(one);
+	/* lose the first source packets, as many as there are repairs */
+	for (i = 0 ; i < ks[s] ; i++) {
+	    if (i < seg[s].nout) {
+		pkt[s][i] = rep[s][i] ;
+		ixs[s][i] = ks[s] + i ;
+	    } else {
+		pkt[s][i] = my_malloc(szs[s], "segment pkt") ;
+		bcopy(src[s][i], pkt[s][i], szs[s]);
+		ixs[s][i] = i ;
+	    }
+	}
+	seg[s].pkt = pkt[s] ;
+	seg[s].index = ixs[s] ;
+    }
+    ixs[0][3] = ixs[0][2] = 2 ;		/* duplicate, segment 0 must fail */
+    if (fec_decode_segments(seg, 3) != 1 || seg[0].err == 0)
+	errors++ ;
+    for (s = 1 ; s < 3 ; s++)
+	for (i = 0 ; i < ks[s] ; i++)
+	    if (seg[s].err || bcmp(pkt[s][i], src[s][i], szs[s])) {
+		fprintf(stderr, "segments: decode mismatch %d/%d\n", s, i);
+		errors++ ;
+	    }
+    for (s = 0 ; s < 3 ; s++) {
+	for (i = 0 ; i < ks[s] ; i++) {
+	    free(src[s][i]);
+	    free(pkt[s][i]);	/* the repair buffers and the copies */
+	}
+	for (i = ks[s] ; i < seg[s].nout ; i++)
+	    free(rep[s][i]);	/* repairs that were not used */
+	fec_release(seg[s].code);
+    }
+    fprintf(stderr, "segments: %s\n", errors ? "FAILED" : "ok");
+    return errors ;
+}
+
+/*
+ * the worker pool: large encodes and decodes, alone and from several
+ * threads at once (only one of them gets the pool), must give the same
+ * result as the serial fec_encode.
+ */
+#define PO_K		32
+#define PO_N		64
+#define PO_SZ		(65536 + 130)	/* not a whole number of strips */
+#define PO_THREADS	3
+
+static void *
+pool_main(void *arg)
+{
+    struct th_arg *t = arg ;
+    struct fec_parms *code = fec_acquire(PO_K, PO_N) ;
+    gf *src[PO_K], *rep[PO_N - PO_K], *pkt[PO_K], *one ;
+    int idx[PO_N - PO_K], ixs[PO_K], i, j, lost ;
+    unsigned seed = t->id ;
+
+    one = my_malloc(PO_SZ, "pool check") ;
+    for (i = 0 ; i < PO_K ; i++) {
+	src[i] = my_malloc(PO_SZ, "pool src") ;
+	pkt[i] = my_malloc(PO_SZ, "pool pkt") ;
+	for (j = 0 ; j < PO_SZ ; j++)
+	    ((unsigned char *)src[i])[j] = rand_r(&seed) ;
+    }
+    for (i = 0 ; i < PO_N - PO_K ; i++) {
+	rep[i] = my_malloc(PO_SZ, "pool repair") ;
+	idx[i] = PO_K + i ;
+    }
+    if (fec_encode_multi(code, src, rep, idx, PO_N - PO_K, PO_SZ) != 0)
+	t->errors++ ;
+    for (i = 0 ; i < PO_N - PO_K ; i++) {
+	fec_encode(code, src, one, idx[i], PO_SZ);
+	if (bcmp(one, rep[i], PO_SZ))
+	    t->errors++ ;
+    }
+    lost = 5 + 7 * t->id ;
+    for (i = 0 ; i < PO_K ; i++) {
+	ixs[i] = i < lost ? PO_N - 1 - i : i ;
+	bcopy(i < lost ? rep[PO_N - PO_K - 1 - i] : src[i], pkt[i], PO_SZ);
+    }
+    if (fec_decode(code, pkt, ixs, PO_SZ) != 0)
+	t->errors++ ;
+    for (i = 0 ; i < PO_K ; i++)
+	if (ixs[i] != i || bcmp(pkt[i], src[i], PO_SZ))
+	    t->errors++ ;
+    for (i = 0 ; i < PO_K ; i++) {
+	free(src[i]);
+	free(pkt[i]);
+    }
+    for (i = 0 ; i < PO_N - PO_K ; i++)
+	free(rep[i]);
+    free(one);
+    fec_release(code);
+    return NULL ;
+}
+
+int
+test_pool(void)
+{
+    pthread_t tid[PO_THREADS] ;
+    struct th_arg args[PO_THREADS + 1] ;
+    int i, errors = 0 ;
+
+    if (fec_set_threads(4) != 4 || fec_get_threads() != 4)
+	errors++ ;
+    for (i = 0 ; i <= PO_THREADS ; i++) {
+	args[i].id = i ;
+	args[i].errors = 0 ;
+    }
+    pool_main(&args[PO_THREADS]);
+    for (i = 0 ; i < PO_THREADS ; i++)
+	if (pthread_create(&tid[i], NULL, pool_main, &args[i]) != 0) {
+	    fprintf(stderr, "pool: pthread_create failed\n");
+	    return 1 ;
+	}
+    for (i = 0 ; i < PO_THREADS ; i++)
+	pthread_join(tid[i], NULL);
+    for (i = 0 ; i <= PO_THREADS ; i++)
+	errors += args[i].errors ;
+    fec_set_threads(1);
+
+    fprintf(stderr, "pool: %s\n", errors ? "FAILED" : "ok");
+    return errors ;
+}
+
+/*
+ * asynchronous requests: a few encodes, collected with fec_wait and
+ * fec_reap, then a decode of one of them and an in place decode
+ * (FEC_DECODE_TO) of another.
+ */
+#define AS_K	16
+#define AS_N	24
+#define AS_SZ	4096
+#define AS_REQ	6
+
+int
+test_async(void)
+{
+    struct fec_parms *code = fec_acquire(AS_K, AS_N) ;
+    struct fec_request req[AS_REQ], *r ;
+    struct fec_segment seg[AS_REQ] ;
+    gf *src[AS_REQ][AS_K], *rep[AS_REQ][AS_N - AS_K], *one ;
+    gf *pkt[AS_K], *copy ;
+    int idx[AS_N - AS_K], ixs[AS_K], s, i, j, reaped = 0, errors = 0 ;
+
+    one = my_malloc(AS_SZ, "async check") ;
+    for (i = 0 ; i < AS_N - AS_K ; i++)
+	idx[i] = AS_K + i ;
+    fec_set_threads(2);
+    for (s = 0 ; s < AS_REQ ; s++) {
+	for (i = 0 ; i < AS_K ; i++) {
+	    src[s][i] = my_malloc(AS_SZ, "async src") ;
+	    for (j = 0 ; j < AS_SZ ; j++)
+		((unsigned char *)src[s][i])[j] = rand() ;
+	}
+	for (i = 0 ; i < AS_N - AS_K ; i++)
+	    rep[s][i] = my_malloc(AS_SZ, "async repair") ;
+	seg[s].code = code ;
+	seg[s].pkt = src[s] ;
+	seg[s].out = rep[s] ;
+	seg[s].index = idx ;
+	seg[s].nout = AS_N - AS_K ;
+	seg[s].sz = AS_SZ ;
+	req[s].seg = &seg[s] ;
+	req[s].nseg = 1 ;
+	req[s].decode = 0 ;
+	if (fec_submit(&req[s]) != 0)
+	    errors++ ;
+    }
+    /* wait for the first half, reap the rest */
+    for (s = 0 ; s < AS_REQ / 2 ; s++)
+	if (fec_wait(&req[s]) != 0)
+	    errors++ ;
+    while (reaped < AS_REQ - AS_REQ / 2 && (r = fec_reap(1)) != NULL) {
+	if (r < &req[AS_REQ / 2] || r >= &req[AS_REQ] || r->failed)
+	    errors++ ;
+	reaped++ ;
+    }
+    if (fec_reap(0) != NULL)
+	errors++ ;
+    for (s = 0 ; s < AS_REQ ; s++)
+	for (i = 0 ; i < AS_N - AS_K ; i++) {
+	    fec_encode(code, src[s], one, idx[i], AS_SZ);
+	    if (bcmp(one, rep[s][i], AS_SZ))
+		errors++ ;
+	}
+
+    /* rebuild the first packets of segment 0 from its repairs */
+    for (i = 0 ; i < AS_N - AS_K ; i++) {
+	gf *t = src[0][i] ;
+	src[0][i] = rep[0][i] ;
+	rep[0][i] = t ;
+	ixs[i] = AS_K + i ;
+    }
+    for ( ; i < AS_K ; i++)
+	ixs[i] = i ;
+    seg[0].index = ixs ;
+    req[0].decode = 1 ;
+    if (fec_submit(&req[0]) != 0 || fec_wait(&req[0]) != 0 ||
+	    fec_reap(0) != NULL)
+	errors++ ;
+    for (i = 0 ; i < AS_N - AS_K ; i++)
+	if (bcmp(src[0][i], rep[0][i], AS_SZ))
+	    errors++ ;
+
+    /* segment 1 in place, its packets in reverse order */
+    copy = my_malloc(AS_K * AS_SZ, "async copy") ;
+    for (i = 0 ; i < AS_K ; i++) {
+	bcopy(src[1][i], (char *)copy + i * AS_SZ, AS_SZ);
+	j = AS_K - 1 - i ;
+	pkt[j] = i < AS_N - AS_K ? rep[1][i] : src[1][i] ;
+	ixs[j] = i < AS_N - AS_K ? AS_K + i : i ;
+    }
+    seg[1].pkt = pkt ;
+    seg[1].out = pkt ;
+    seg[1].index = ixs ;
+    req[1].decode = FEC_DECODE_TO ;
+    if (fec_submit(&req[1]) != 0 || fec_wait(&req[1]) != 0 ||
+	    fec_reap(0) != NULL)
+	errors++ ;
+    for (i = 0 ; i < AS_K ; i++)
+	if (bcmp(pkt[i], (char *)copy + i * AS_SZ, AS_SZ) ||
+		ixs[AS_K - 1 - i] != (i < AS_N - AS_K ? AS_K + i : i))
+	    errors++ ;
+    free(copy);
+    fec_set_threads(1);
+
+    for (s = 0 ; s < AS_REQ ; s++) {
+	for (i = 0 ; i < AS_K ; i++)
+	    free(src[s][i]);
+	for (i = 0 ; i < AS_N - AS_K ; i++)
+	    free(rep[s][i]);
+    }
+    free(one);
+    fec_release(code);
+    fprintf(stderr, "async: %s\n", errors ? "FAILED" : "ok");
+    return errors ;
+}
+
+/*
+ * the Cauchy XOR code: every k out of n packets must rebuild the
+ * source for a small code (it is MDS), random patterns for larger ones.
+ * At n = k + 1 it is a plain parity code.
+ */
+static int
+cauchy_round(struct cauchy_code *c, int k, int n, int sz, int ixs[],
+    unsigned char **src, unsigned char **enc)
+{
+    unsigned char *pkt[256], *buf[256] ;
+    int i, errors = 0 ;
+
+    for (i = 0 ; i < k ; i++) {
+	buf[i] = my_malloc(sz, "cauchy pkt") ;
+	bcopy(enc[ixs[i]], buf[i], sz);
+	pkt[i] = buf[i] ;
+    }
+    if (cauchy_decode(c, pkt, ixs, sz) != 0)
+	errors++ ;
+    else
+	for (i = 0 ; i < k ; i++)
+	    if (ixs[i] != i || bcmp(pkt[i], src[i], sz))
+		errors++ ;
+    for (i = 0 ; i < k ; i++)
+	free(buf[i]);
+    return errors ;
+}
+
+int
+test_cauchy(void)
+{
+    static const int ks[4] = { 4, 1, 10, 100 }, ns[4] = { 8, 2, 11, 256 } ;
+    unsigned char *src[256], *enc[256] ;
+    int ixs[256], all[256], t, i, j, m, k, n, sz, errors = 0 ;
+    struct cauchy_code *c ;
+
+    if (cauchy_new(9, 8) != NULL || cauchy_new(10, 257) != NULL)
+	errors++ ;
+    for (t = 0 ; t < 4 ; t++) {
+	k = ks[t] ; n = ns[t] ;
+	sz = 8 * (t + 1) * 129 ;	/* sub-packets not word aligned */
+	c = cauchy_new(k, n) ;
+	for (i = 0 ; i < n ; i++) {
+	    enc[i] = my_malloc(sz, "cauchy enc") ;
+	    all[i] = i ;
+	}
+	for (i = 0 ; i < k ; i++) {
+	    src[i] = my_malloc(sz, "cauchy src") ;
+	    for (j = 0 ; j < sz ; j++)
+		src[i][j] = rand() ;
+	}
+	if (cauchy_encode(c, src, enc, all, n, sz) != 0)
+	    errors++ ;
+	if (n == k + 1) {
+	    for (j = 0 ; j < sz ; j++) {
+		unsigned char x = 0 ;
+		for (i = 0 ; i <= k ; i++)
+		    x ^= enc[i][j] ;
+		if (x != 0) {
+		    errors++ ;
+		    break ;
+		}
+	    }
+	}
+	if (n <= 8) {		/* all subsets of k packets */
+	    for (m = 0 ; m < 1 << n ; m++) {
+		for (i = 0, j = 0 ; i < n && j <= k ; i++)
+		    if (m & (1 << i))
+			ixs[j++] = i ;
+		if (j != k)
+		    continue ;
+		errors += cauchy_round(c, k, n, sz, ixs, src, enc) ;
+	    }
+	} else {
+	    for (m = 0 ; m < 20 ; m++) {
+		for (i = 0 ; i < n ; i++)
+		    all[i] = i ;
+		for (i = 0 ; i < k ; i++) {	/* k of n, random order */
+		    j = i + rand() % (n - i) ;
+		    ixs[i] = all[j] ;
+		    all[j] = all[i] ;
+		}
+		errors += cauchy_round(c, k, n, sz, ixs, src, enc) ;
+	    }
+	}
+	ixs[0] = ixs[1] = 0 ;
+	if (k > 1 && cauchy_decode(c, src, ixs, sz) == 0)
+	    errors++ ;
+	/*
+	 * Lengths that are not a multiple of 8 are refused both ways:
+	 * zero padding them is not a round trip, the tail of a repair
+	 * packet is parity and cannot be dropped.
+	 */
+	if (cauchy_encode(c, src, enc, all, 1, sz + 1) == 0)
+	    errors++ ;
+	for (i = 0 ; i < k ; i++)
+	    ixs[i] = i ;
+	if (cauchy_decode(c, enc, ixs, sz - 3) == 0)
+	    errors++ ;
+	for (i = 0 ; i < k ; i++)
+	    free(src[i]);
+	for (i = 0 ; i < n ; i++)
+	    free(enc[i]);
+	cauchy_free(c);
+    }
+    fprintf(stderr, "cauchy: %s\n", errors ? "FAILED" : "ok");
+    return errors ;
+}
+
 #define KK 64 /* 255 */
 #define SZ 1024
 int
@@ -211,6 +1244,7 @@ main(int argc, char *argv[])
     int i ;
 
     int *ixs ;
+    int errors = 0 ;
 
     int lim = GF_SIZE + 1 ;
 
@@ -219,16 +1253,30 @@ main(int argc, char *argv[])
 #if 0
     test_gf();
 #endif
+    errors += test_kernels();
+    errors += test_encode_multi();
+    errors += test_decoder();
+    errors += test_erasures();
+    errors += test_decode_to();
+    errors += test_cauchy_matrix();
+    errors += test_invert();
+    errors += test_decode_cache();
+    errors += test_shared();
+    errors += test_threads();
+    errors += test_segments();
+    errors += test_pool();
+    errors += test_async();
+    errors += test_cauchy();
     for ( kk = KK ; kk > 2 ; kk-- ) {
 	code = fec_new(kk, lim);
 	ixs = my_malloc(kk * sizeof(int), "ixs" );
 
 	for (i=0; i<kk; i++) ixs[i] = kk - i ;
 	sprintf(buf, "kk=%d, kk - i", kk);
-	test_decode(code, kk, ixs, SZ, buf);
+	errors += test_decode(code, kk, ixs, SZ, buf);
 
 	for (i=0; i<kk; i++) ixs[i] = i ;
-	test_decode(code, kk, ixs, SZ, "i");
+	errors += test_decode(code, kk, ixs, SZ, "i");
 
 if (0) {
 	for (i=0; i<kk; i++) ixs[i] = i ;
@@ -258,12 +1306,27 @@ if (1)  {
 	for (i= 0 ; i <= max_i0 ; i++) {
 	    for (j=0; j<kk; j++)
 		ixs[j] = j + i ;
-	    test_decode(code, kk, ixs, SZ, "shifted j");
+	    errors += test_decode(code, kk, ixs, SZ, "shifted j");
 	}
 	}
 	fprintf(stderr, "\n");
 	free(ixs);
 	fec_free(code);
     }
-    return 0;
+
+    /*
+     * heavily damaged segments: 20 and then all KK source packets
+     * lost, with large packets so that decode has to shrink its strips
+     * and then use heap scratch.
+     */
+    code = fec_new(KK, lim);
+    ixs = my_malloc(KK * sizeof(int), "ixs" );
+    for (i=0; i<KK; i++) ixs[i] = i < 20 ? KK + i : i ;
+    errors += test_decode(code, KK, ixs, 8192, "20 lost");
+    for (i=0; i<KK; i++) ixs[i] = KK + i ;
+    errors += test_decode(code, KK, ixs, 8192, "all lost");
+    fprintf(stderr, "\n");
+    free(ixs);
+    fec_free(code);
+    return errors ? 1 : 0;
 }